@@ -1,1192 +1,7769 @@
-#include <cstdint>
-#include <cstring>
-#include <iostream>
-#include <fstream>
-#include <sstream>
-#include <string>
-#include <vector>
-#include <unordered_map>
-#include <cctype>
-#include <algorithm>
-#include <iomanip>
-#include <bitset>
-
-using namespace std;
-//===================IMPORTANT!!! READ THIS!!!===================
-//I added comments to help you understand it.
-//If you want to run the code, make sure to write the correct form in the console. For example,
-//if you want to print cycles 30, 34, and the final state, just write 30,34,last (where last stands for the final state).
-// -------------------------------------------------------------------
-// =================== Control Signals Struct ========================
-// -------------------------------------------------------------------
-// This struct holds all the single-cycle control signals that typically
-// come from the "control unit" in a MIPS CPU.
-// - RegisterDestination: If true, write destination is 'rd' (R-type).
-// - JumpSignal: If true, a jump instruction is executing.
-// - BranchSignal: If true, a branch instruction (beq, bne) is executing.
-// - MemoryRead: If true, read from memory (lw).
-// - MemoryToRegister: If true, take data from memory to write into a register (lw).
-// - ALUOperation: The numeric code that helps define the ALU function.
-// - MemoryWrite: If true, write data to memory (sw).
-// - ALUSource: If true, second ALU input is an immediate (I-type).
-// - RegisterWrite: If true, write back into a register.
-
-struct ControlSignals {
-    bool RegisterDestination;
-    bool JumpSignal;
-    bool BranchSignal;
-    bool MemoryRead;
-    bool MemoryToRegister;
-    int  ALUOperation;
-    bool MemoryWrite;
-    bool ALUSource;
-    bool RegisterWrite;
-
-    ControlSignals() {
-        RegisterDestination=false;
-        JumpSignal=false;
-        BranchSignal=false;
-        MemoryRead=false;
-        MemoryToRegister=false;
-        ALUOperation=0;
-        MemoryWrite=false;
-        ALUSource=false;
-        RegisterWrite=false;
-    }
-
-
-    string ToBinaryString() const {
-
-        int op = (ALUOperation & 0b11);
-        ostringstream oss;
-        oss << (RegisterDestination ? '1':'0') << " "
-            << (JumpSignal          ? '1':'0') << " "
-            << (BranchSignal        ? '1':'0') << " "
-            << (MemoryRead          ? '1':'0') << " "
-            << (MemoryToRegister    ? '1':'0') << " "
-            << bitset<2>(op)        << " "
-            << (MemoryWrite         ? '1':'0') << " "
-            << (ALUSource           ? '1':'0') << " "
-            << (RegisterWrite       ? '1':'0');
-        return oss.str();
-    }
-};
-
-// -------------------------------------------------------------------
-// =================== Instruction Struct ============================
-// -------------------------------------------------------------------
-// This struct encapsulates one assembly instruction's essential fields:
-// - label: if there's a label on the same line
-// - opcode: e.g. "add", "lw", "beq", etc.
-// - rs, rt, rd: integer register numbers for the MIPS fields
-// - imm: 32-bit immediate or offset
-// - originalLine: the exact text string of this instruction for printing
-struct Instruction {
-    string label;
-    string opcode;
-    int rs=0, rt=0, rd=0;
-    int32_t imm=0;
-    string originalLine;
-};
-
-// -------------------------------------------------------------------
-// =================== Register File ===============================
-// -------------------------------------------------------------------
-// Holds the 32 registers (regs[]) plus the program counter (pc).
-// We initialize all registers to zero, including pc.
-// Typically, $gp is set to 0x10008000, $sp is set to 0x7ffffffc later.
-struct RegFile {
-    int32_t regs[32];
-    uint32_t pc;
-    RegFile() {
-        memset(regs, 0, sizeof(regs));
-        pc = 0;
-    }
-};
-
-// -------------------------------------------------------------------
-// =================== Sparse Memory ===============================
-// -------------------------------------------------------------------
-// A simple "sparse" memory model using an unordered_map. We store only
-// addresses that are written or read, so we don't need a huge array.
-struct SparseMem {
-    unordered_map<uint32_t,int32_t> data;
-};
-
-// -------------------------------------------------------------------
-// GetAlu2Bits: Returns a 2-bit string code for the ALU operation that
-// will be displayed in the control signals portion of the cycle printout.
-// -------------------------------------------------------------------
-static string GetAlu2Bits(const string &opc)
-{
-    if (opc=="and" || opc=="andi" || opc=="nor"|| opc=="lw"|| opc=="sw") {
-        return "00";
-    }
-    else if (opc=="or" || opc=="ori"||opc=="beq"||opc=="bne") {
-        return "01";
-    }
-    else if (opc=="add"||opc=="addu"||opc=="addi"||opc=="addiu"||
-             opc=="sub"||opc=="subu"||opc=="sll"||opc=="srl") {
-        return "10";
-    }
-    else if (opc=="slt"||opc=="slti"||opc=="sltu"||opc=="sltiu") {
-        return "11";
-    }
-    return "--";
-}
-
-// -------------------------------------------------------------------
-// =================== SingleCycleMIPS Class =========================
-// -------------------------------------------------------------------
-// Orchestrates the loading of assembly instructions, simulates them
-// in a single-cycle manner, and prints out the cycle-by-cycle (or
-// final) state as requested.
-class SingleCycleMIPS {
-public:
-
-    void LoadAssembly(const string &filename);                         // read instructions from file
-    void RunSimulation(const string &outFile, const vector<int> &cyclesToPrint, bool includeLast);
-
-private:
-    // Data fields:
-
-    // The CPU state:
-    RegFile    rf;      // The 32 registers + PC
-    SparseMem  mem;     // Sparse memory structure
-    vector<Instruction> instrMem; // The instruction memory (vector)
-    unordered_map<string,int> labelMap; // label -> instruction index
-
-    // For monitoring/printing each cycle:
-    bool didLoad=false, didStore=false;
-    uint32_t memAddress=0;
-    int32_t storeValue=0, loadValue=0;
-
-    int cycleCount=0;   // how many instructions (cycles) have executed
-    bool finished=false; // true when the program ends
-
-    // The current instruction being executed:
-    Instruction IR;
-    int32_t regA=0, regB=0;
-    int32_t aluOut=0;
-    int32_t memDataReg=0;
-
-    // The control signals for the current instruction:
-    ControlSignals ctrl;
-    string branchLabelMonitor = "-";
-
-    // A list of memory addresses modified in the current cycle
-    vector<uint32_t> changedAddrs;
-
-private:
-    // ---------- Parsing-related ----------
-    void Trim(string &s);                        // remove leading/trailing whitespace
-    void ParseLine(const string &line, Instruction &ins, string &lbl);
-    void ParseInstruction(const string &text, Instruction &ins);
-    int  ParseRegister(string token);
-
-    // ---------- Helpers ----------
-    bool IsHalt(const Instruction &ins);         // detect "sll $zero,$zero,0" as a halt
-
-    // ---------- Control & Execution ----------
-    void GenerateControl(const string &opcode);  // sets the control signals
-    int32_t DoALU(const string &opcode, int32_t a, int32_t b);  // performs the ALU operation
-    void ExecuteInstruction(Instruction &ins);   // runs one instruction in one cycle
-
-    // ---------- Printing / Logging ----------
-    void PrintCycleInformation(std::ostream &out, uint32_t oldPC); // print cycle-by-cycle info
-    void PrintFinalState(ostream &out);          // print final registers/memory/cycle count
-    void DecodeMonitorRegisters(const Instruction &ins, string &m3, string &m4, string &m5);
-};
-
-// -------------------------------------------------------------------
-// LoadAssembly: Reads lines from a file, parsing them into instructions.
-//               Also identifies labels and stores them in labelMap.
-//
-// Halts early if it finds the "sll $zero, $zero, 0" instruction.
-// -------------------------------------------------------------------
-void SingleCycleMIPS::LoadAssembly(const string &filename) {
-    ifstream fin(filename);
-    if(!fin.is_open()){
-        cerr<<"Cannot open "<<filename<<"\n";
-        return;
-    }
-    string line;
-    while(getline(fin,line)) {
-        // 1) Print the raw line:
-        cout << "[DEBUG] Raw line read: '" << line << "'\n";
-        // Remove any comment starting with '#'
-        auto cpos = line.find('#');
-        if(cpos!=string::npos){
-            line=line.substr(0,cpos);
-        }
-        Trim(line);
-        if (line.empty()) {
-            cout << "[DEBUG] => line is empty after trim\n\n";
-            continue;
-        }
-
-        // 2) Print line after trim/comment removal:
-        cout << "[DEBUG] => after trim: '" << line << "'\n";
-
-        // Some lines might have .data or .text - we just ignore them
-        {
-            istringstream iss(line);
-            vector<string> tokens;
-            string t;
-            while(iss >> t) tokens.push_back(t);
-            if(tokens.empty()) continue;
-            if(tokens[0]==".data"||tokens[0]==".text") {
-                // ignore
-                continue;
-            }
-        }
-
-        // Now parse the instruction
-        Instruction ins;
-        ins.originalLine=line;
-        string lbl;
-        ParseLine(line, ins, lbl);
-
-        // If we see sll $zero, $zero, 0, we treat that as a "halt"
-        // and stop reading further lines.
-        if (ins.opcode == "sll" && ins.rs == 0 && ins.rt == 0 && ins.rd == 0 && ins.imm == 0) {
-            cout << "Halt instruction encountered. Stopping further input.\n";
-            instrMem.push_back(ins);  // Add the halt instruction into the instruction memory.
-            break;
-        }
-
-        // If there's a valid opcode, push back the instruction
-        if(!ins.opcode.empty()){
-            // If there's a label on the same line, map label -> current index
-            if(!lbl.empty()){
-                labelMap[lbl] = (int)instrMem.size();
-            }
-            instrMem.push_back(ins);
-        } else {
-            // Otherwise, maybe it was just a label line.
-            if(!lbl.empty()){
-                labelMap[lbl] = (int)instrMem.size();
-            }
-        }
-    }
-    fin.close();
-}
-
-// -------------------------------------------------------------------
-// RunSimulation: Executes instructions 1 cycle at a time until we
-//                either "run out" of instructions or see the halt.
-//
-//  - outFile: name of the output file to create
-//  - cyclesToPrint: which cycle numbers to log
-//  - includeLast: if true, we also print final registers/memory after
-//    the simulation ends
-// -------------------------------------------------------------------
-void SingleCycleMIPS::RunSimulation(const string &outFile, const vector<int> &cyclesToPrint, bool includeLast) {
-    ofstream out(outFile);
-    if(!out.is_open()){
-        cerr<<"Cannot open "<<outFile<<"\n";
-        return;
-    }
-    // Print
-    out<<"Name: *****\nUniversity ID: *****\n\n";
-
-    // Initialize registers
-    memset(rf.regs,0,sizeof(rf.regs));
-    // Typical GP and SP initialization that are given
-    rf.regs[28]=0x10008000; // $gp
-    rf.regs[29]=0x7ffffffc; // $sp
-    rf.pc=0;
-
-    cycleCount=0;
-    finished=false;
-
-    // Main loop: fetch instruction at pc/4, then execute
-    while(!finished) {
-        // 1) Capture oldPC BEFORE  execute the instruction
-        uint32_t oldPC = rf.pc;
-    
-        uint32_t idx = oldPC/4;
-
-        if(idx >= instrMem.size()) {
-            break;
-        }
-        Instruction &ins = instrMem[idx];
-        IR = ins;
-    
-        cycleCount++;
-
-        // Reset the monitoring for this cycle
-        didLoad=false;
-        didStore=false;
-        memAddress=0;
-        storeValue=0;
-        loadValue=0;
-        branchLabelMonitor="-";
-        aluOut=0;
-        memDataReg=0;
-        regA=0;
-        regB=0;
-        changedAddrs.clear();
-
-        // Single-cycle logic
-        ExecuteInstruction(ins);
-
-        // If this cycle is one the user asked to print (or if "all"),
-        // we log it
-        bool shouldPrint = false;
-        if (finished) {
-            // If we just executed the halt (final) cycle, print its monitor info only if the user
-            // explicitly requested that cycle number.
-            if (find(cyclesToPrint.begin(), cyclesToPrint.end(), cycleCount) != cyclesToPrint.end())
-                shouldPrint = true;
-        } else {
-            if (find(cyclesToPrint.begin(), cyclesToPrint.end(), cycleCount) != cyclesToPrint.end() ||
-                find(cyclesToPrint.begin(), cyclesToPrint.end(), -1) != cyclesToPrint.end())
-                shouldPrint = true;
-        }
-        
-        if (shouldPrint)
-            PrintCycleInformation(out, oldPC);
-    }
-
-    // If user wants final snapshot, print it now
-    if (includeLast){
-        PrintFinalState(out);
-    }
-
-    out.close();
-}
-
-// -------------------------------------------------------------------
-// ExecuteInstruction: The main single-cycle logic for one instruction.
-// 1) Determine control signals
-// 2) Read register file
-// 3) Possibly sign/zero-extend immediate
-// 4) Handle jumps/branches
-// 5) ALU
-// 6) Memory read/write
-// 7) Write back
-// 8) PC increment
-// -------------------------------------------------------------------
-void SingleCycleMIPS::ExecuteInstruction(Instruction &ins) {
-    // Step 1: Control
-    GenerateControl(ins.opcode);
-
-    // Step 2: read regs
-    regA = rf.regs[ins.rs];
-    regB = rf.regs[ins.rt];
-
-    // Step 3: immediate extension if I-type
-    if(ins.opcode=="addi"||ins.opcode=="addiu"||ins.opcode=="andi"||
-       ins.opcode=="ori" ||ins.opcode=="slti"||ins.opcode=="sltiu"){
-        // andi, ori => zero-extend
-        if(ins.opcode=="andi"||ins.opcode=="ori"){
-            uint16_t tmp = (uint16_t)(ins.imm & 0xffff);
-            ins.imm=(int32_t)tmp;
-        }
-        // otherwise => sign-extend
-        else {
-            int16_t tmp = (int16_t)(ins.imm & 0xffff);
-            ins.imm=(int32_t)tmp;
-        }
-    }
-
-    // Step 4: handle j, beq, bne (which modify PC directly)
-    if(ins.opcode=="j"){
-        ctrl.JumpSignal=true;
-
-        // Debug print: show the current PC, the jump, and where we go
-        cout << "[DEBUG] (PC=0x" << hex << rf.pc << ") j " 
-        << ins.label << "\n";
-
-        if(!ins.label.empty()){
-            if(labelMap.find(ins.label)!=labelMap.end()){
-                uint32_t targetPC = labelMap[ins.label]*4;
-                cout << "       => Jumping to PC=0x" << targetPC << "\n";
-                rf.pc = targetPC;
-            } else {
-                cout << "       => label not found => finishing.\n";
-                finished=true;
-            }
-        }
-        return;
-    }
-
-    if(ins.opcode=="beq"){
-        ctrl.BranchSignal=true;
-        branchLabelMonitor = ins.label;
-
-          // Debug: show current PC, the condition, and result
-          cout << "[DEBUG] (PC=0x" << hex << rf.pc << ") beq: regA=0x" 
-          << regA << ", regB=0x" << regB << "\n";
-
-        if(regA==regB){
-            // Branch taken
-            cout << "       => condition is TRUE => branch TAKEN\n";
-            
-            if(!ins.label.empty()){
-                if(labelMap.find(ins.label)!=labelMap.end()){
-                    uint32_t targetPC = labelMap[ins.label]*4;
-                    cout << "       => new PC=0x" << targetPC << "\n";
-                    rf.pc = targetPC;
-                } else {
-                    cout << "       => label not found => finishing.\n";
-                    finished=true;
-                }
-            }
-        } else {
-            cout << "       => NOT taken => next PC=0x" 
-                 << (rf.pc+4) << "\n";
-            rf.pc+=4;
-        }
-        return;
-    }
-
-    if(ins.opcode=="bne"){
-        ctrl.BranchSignal=true;
-        branchLabelMonitor = ins.label;
-
-        // Debug
-        cout << "[DEBUG] (PC=0x" << hex << rf.pc << ") bne: regA=0x" 
-             << regA << ", regB=0x" << regB << "\n";
-
-        if(regA!=regB){
-            cout << "       => condition is TRUE => branch TAKEN\n";
-
-            if(!ins.label.empty()){
-                if(labelMap.find(ins.label)!=labelMap.end()){
-                    uint32_t targetPC = labelMap[ins.label]*4;
-                    cout << "       => new PC=0x" << targetPC << "\n";
-                    rf.pc = targetPC;
-                } else {
-                    cout << "       => label not found => finishing.\n";
-                    finished=true;
-                }
-            }
-        } else {
-            cout << "       => NOT taken => next PC=0x" 
-                 << (rf.pc+4) << "\n";
-            rf.pc+=4;
-        }
-        return;
-    }
-
-    // Step 5: normal ALU
-    if (ins.opcode == "sll" || ins.opcode == "srl") {
-        // For shift instructions, use the value from register rt and the shift amount from ins.imm.
-        aluOut = DoALU(ins.opcode, rf.regs[ins.rt], ins.imm);
-    } else {
-        int32_t srcB = (ctrl.ALUSource ? ins.imm : regB);
-        aluOut = DoALU(ins.opcode, regA, srcB);
-    }
-
-    // Step 6: memory ops
-    if(ins.opcode=="lw"){
-        ctrl.MemoryRead=true;
-        didLoad=true;
-        memAddress= aluOut;
-        // If address not in map, default 0
-        if(mem.data.find(aluOut)==mem.data.end()){
-            memDataReg=0;
-        } else {
-            memDataReg=mem.data[aluOut];
-        }
-    }
-    else if(ins.opcode=="sw"){
-        ctrl.MemoryWrite=true;
-        didStore=true;
-        memAddress= aluOut;
-        storeValue= regB;
-        mem.data[aluOut] = regB;       // store
-        changedAddrs.push_back(aluOut);
-    }
-
-    // Step 7: write back
-    // If it's the "halt" instruction, we stop
-    if(IsHalt(ins)){
-        finished = true;
-        rf.pc += 4;  // increment PC for the halt cycle so that final PC becomes PC+4
-        return;
-    }
-   // R-type: for sltu (and for slt, if needed) we want the boolean in the register
-// but the ALU out to be the raw subtraction result.
-if (ins.opcode == "sltu") {
-    int32_t rawSub = regA - regB;  // raw subtraction result
-    int32_t boolRes = ((uint32_t)regA < (uint32_t)regB) ? 1 : 0;
-    rf.regs[ins.rd] = boolRes;     // store boolean in destination register
-    aluOut = rawSub;             // use raw subtraction for monitor output
-} else if (ins.opcode == "slt") {
-    int32_t rawSub = regA - regB;
-    int32_t boolRes = (regA < regB) ? 1 : 0;
-    rf.regs[ins.rd] = boolRes;
-    aluOut = rawSub;
-} else if (ins.opcode=="add" || ins.opcode=="addu" || ins.opcode=="sub" || ins.opcode=="subu" ||
-           ins.opcode=="and" || ins.opcode=="or"  || ins.opcode=="nor" ||
-           ins.opcode=="sll" || ins.opcode=="srl") {
-    rf.regs[ins.rd] = aluOut;
-}
-    
-    // I-type => write to rt
-    else if(ins.opcode=="addi"||ins.opcode=="addiu"||ins.opcode=="andi"||
-            ins.opcode=="ori" ||ins.opcode=="slti"||ins.opcode=="sltiu"){
-        rf.regs[ins.rt] = aluOut;}
-    
-    // lw => load data into rt
-    else if(ins.opcode=="lw"){
-        rf.regs[ins.rt] = memDataReg;
-    }
-
-    // Step 8: increment PC
-    rf.pc +=4;
-}
-
-// -------------------------------------------------------------------
-// GenerateControl: sets the single-cycle control signals based on opcode
-// -------------------------------------------------------------------
-void SingleCycleMIPS::GenerateControl(const string &opc){
-    // Reset all signals
-    ctrl = ControlSignals();
-
-    // R-type (like add, sub, sll, etc.)
-    if(opc=="add"||opc=="addu"||opc=="sub"||opc=="subu"||
-       opc=="and"||opc=="or"||opc=="nor"||opc=="slt"||
-       opc=="sltu"){
-        ctrl.RegisterDestination=true;  // writes to rd
-        ctrl.ALUOperation=2;           // 2 means "R-type function" in doALU
-        ctrl.ALUSource=false;
-        ctrl.RegisterWrite=true;
-    }
-    else if (opc=="sll" || opc=="srl") {
-        // For shift instructions, the expected control signals are:
-        // RegisterDestination = 0, ALUOperation = 2, ALUSource = 1, RegisterWrite = 1.
-        ctrl.RegisterDestination = false; 
-        ctrl.ALUOperation = 2;
-        ctrl.ALUSource = true;
-        ctrl.RegisterWrite = true;
-        
-    }
-    // I-type (addi, andi, slti, etc.)
-    else if(opc=="addi"||opc=="addiu"||opc=="andi"||opc=="ori"||
-            opc=="slti"||opc=="sltiu"){
-        ctrl.RegisterDestination=false; // writes to rt
-        ctrl.ALUOperation=0;           // 0 => add-like
-        ctrl.ALUSource=true;
-        ctrl.RegisterWrite=true;
-    }
-    // lw => read from memory
-    else if(opc=="lw"){
-        ctrl.ALUSource=true;
-        ctrl.MemoryToRegister=true;
-        ctrl.RegisterWrite=true;
-        ctrl.MemoryRead=true;
-        ctrl.ALUOperation=0;  // add
-    }
-    // sw => store to memory
-    else if(opc=="sw"){
-        ctrl.ALUSource=true;
-        ctrl.MemoryWrite=true;
-        ctrl.ALUOperation=0; // add
-    }
-    // beq, bne => sub
-    else if(opc=="beq"||opc=="bne"){
-        ctrl.BranchSignal=true;
-        ctrl.ALUOperation=1; // sub
-    }
-    // j => jump
-    else if(opc=="j"){
-        ctrl.JumpSignal=true;
-    }
-}
-
-// -------------------------------------------------------------------
-// DoALU: performs the ALU operation based on the opcode
-// -------------------------------------------------------------------
-int32_t SingleCycleMIPS::DoALU(const string &opc, int32_t a, int32_t b){
-    if(opc=="add"||opc=="addi"||opc=="addiu") return a+b;
-    if(opc=="addu") return (uint32_t)a + (uint32_t)b;
-    if(opc=="sub"||opc=="subu") return a-b;
-    if(opc=="and"||opc=="andi") return (a & b);
-    if(opc=="or" ||opc=="ori")  return (a | b);
-    if(opc=="nor")              return ~(a | b);
-    if(opc=="slt")              return (a<b) ? 1 : 0;
-    if(opc=="sltu")             return ((uint32_t)a<(uint32_t)b)?1:0;
-    if(opc=="slti")             return (a<b)?1:0;
-    if(opc=="sltiu")            return ((uint32_t)a<(uint32_t)b)?1:0;
-    if (opc == "sll") return ((uint32_t)a << (b & 31));
-    if (opc == "srl") return ((uint32_t)a >> (b & 31));
-    // default => just do add
-    return a+b;
-}
-
-// -------------------------------------------------------------------
-// Trim: removes leading/trailing whitespace in a string
-// -------------------------------------------------------------------
-void SingleCycleMIPS::Trim(string &s){
-    while(!s.empty() && isspace((unsigned char)s.front())) s.erase(s.begin());
-    while(!s.empty() && isspace((unsigned char)s.back()))  s.pop_back();
-}
-
-// -------------------------------------------------------------------
-// ParseLine: checks if there's a label ("something:") in the line,
-//            then parses the rest as an instruction.
-//
-// e.g. "start: addi $t0, $zero, 5"
-// -------------------------------------------------------------------
-void SingleCycleMIPS::ParseLine(const string &line, Instruction &ins, string &lbl){
-    auto p=line.find(':');
-    if(p!=string::npos){
-        lbl=line.substr(0,p);
-        Trim(lbl);
-        string after=line.substr(p+1);
-        Trim(after);
-        if(!after.empty()){
-            ParseInstruction(after,ins);
-        }
-    } else {
-        // no label, just parse
-        ParseInstruction(line,ins);
-    }
-}
-
-// -------------------------------------------------------------------
-// ParseInstruction: splits the text into tokens and interprets them
-// as a MIPS instruction format (e.g. opcode, registers, immediate)
-// -------------------------------------------------------------------
-void SingleCycleMIPS::ParseInstruction(const string &text, Instruction &ins){
-
-
-        // Make a copy of 'text'
-        string line = text;
-        // 1) Replace all commas with spaces:
-        for (char &c : line) {
-            if (c == ',') {
-                c = ' ';
-            }
-        }
-
-    vector<string> tokens;
-    {
-        istringstream iss(line);
-        string t;
-        while(iss >> t) tokens.push_back(t);
-    }
-    if(tokens.empty()) return;
-    ins.opcode = tokens[0];
-
-    // j
-    if(ins.opcode=="j"){
-        if(tokens.size()>=2){
-            ins.label = tokens[1];
-        }
-        return;
-    }
-    // beq, bne => beq $rs, $rt, LABEL
-    if(ins.opcode=="beq"||ins.opcode=="bne"){
-        if(tokens.size()>=4){
-            ins.rs = ParseRegister(tokens[1]);
-            ins.rt = ParseRegister(tokens[2]);
-            ins.label= tokens[3];
-        }
-        return;
-    }
-    // Shift instructions: sll and srl have a different operand format.
-// Format: sll $rd, $rt, shamt
-if(ins.opcode == "sll" || ins.opcode == "srl"){
-    if(tokens.size() < 4) return;
-    ins.rd = ParseRegister(tokens[1]);              // destination register
-    ins.rt = ParseRegister(tokens[2]);              // register to shift
-    ins.imm = stoi(tokens[3], nullptr, 0);            // shift amount (immediate)
-    ins.rs = 0;                                     // not used in shift instructions
-    return;
-}
-
-// R-type instructions (non-shift): add, addu, sub, subu, and, or, nor, slt, sltu
-if(ins.opcode=="add" || ins.opcode=="addu" || ins.opcode=="sub" || ins.opcode=="subu" ||
-   ins.opcode=="and" || ins.opcode=="or"  || ins.opcode=="nor" || ins.opcode=="slt" ||
-   ins.opcode=="sltu"){
-    if(tokens.size() < 4) return;
-    ins.rd = ParseRegister(tokens[1]);
-    ins.rs = ParseRegister(tokens[2]);
-    ins.rt = ParseRegister(tokens[3]);
-    return;
-}
-
-    // I-type => addi $rt, $rs, IMM
-    if(ins.opcode=="addi"||ins.opcode=="addiu"||ins.opcode=="andi"||ins.opcode=="ori"||
-       ins.opcode=="slti"||ins.opcode=="sltiu"){
-        if(tokens.size()<4) return;
-        ins.rt=ParseRegister(tokens[1]);
-        ins.rs=ParseRegister(tokens[2]);
-        // Parse imm with base=0 so 0xNNN works
-        ins.imm= stoi(tokens[3],nullptr,0);        return;
-    }
-    // lw, sw => lw $rt, offset($rs)
-    if(ins.opcode=="lw"||ins.opcode=="sw"){
-        if(tokens.size()<3) return;
-        ins.rt=ParseRegister(tokens[1]);
-        string expr=tokens[2];
-        auto p1=expr.find('(');
-        auto p2=expr.find(')');
-        if(p1!=string::npos && p2!=string::npos){
-            string off=expr.substr(0,p1);
-            string bas=expr.substr(p1+1,p2-(p1+1));
-              // parse offset with base=0
-              ins.imm= stoi(off,nullptr,0);
-              ins.rs= ParseRegister(bas);
-        }
-        return;
-    }
-}
-
-// -------------------------------------------------------------------
-// ParseRegister: converts a register name string to an int code
-//
-// e.g. "$t0" => 8, "$s1" => 17, "$ra" => 31, etc.
-// -------------------------------------------------------------------
-int SingleCycleMIPS::ParseRegister(string token){
-    // remove trailing comma if any
-    if(!token.empty() && token.back()==',') token.pop_back();
-    // remove leading '$' if present
-    if(!token.empty() && token.front()=='$') token.erase(token.begin());
-
-    if(token=="zero") return 0;
-    if(token=="at")   return 1;
-    if(token=="v0")   return 2;
-    if(token=="v1")   return 3;
-    if(token=="a0")   return 4;
-    if(token=="a1")   return 5;
-    if(token=="a2")   return 6;
-    if(token=="a3")   return 7;
-    if(token=="t0")   return 8;
-    if(token=="t1")   return 9;
-    if(token=="t2")   return 10;
-    if(token=="t3")   return 11;
-    if(token=="t4")   return 12;
-    if(token=="t5")   return 13;
-    if(token=="t6")   return 14;
-    if(token=="t7")   return 15;
-    if(token=="s0")   return 16;
-    if(token=="s1")   return 17;
-    if(token=="s2")   return 18;
-    if(token=="s3")   return 19;
-    if(token=="s4")   return 20;
-    if(token=="s5")   return 21;
-    if(token=="s6")   return 22;
-    if(token=="s7")   return 23;
-    if(token=="t8")   return 24;
-    if(token=="t9")   return 25;
-    if(token=="k0")   return 26;
-    if(token=="k1")   return 27;
-    if(token=="gp")   return 28;
-    if(token=="sp")   return 29;
-    if(token=="fp")   return 30;
-    if(token=="ra")   return 31;
-    return -1; // unrecognized
-}
-
-// -------------------------------------------------------------------
-// IsHalt: returns true if instruction is "sll $zero,$zero,0"
-// -------------------------------------------------------------------
-bool SingleCycleMIPS::IsHalt(const Instruction &ins){
-    if(ins.opcode=="sll" && ins.rs==0 && ins.rt==0 && ins.rd==0 && ins.imm==0){
-        return true;
-    }
-    return false;
-}
-
-// -------------------------------------------------------------------
-// DecodeMonitorRegisters: decide which registers to display in columns
-// (3), (4), (5) of the "Monitors" line.
-//
-// - j => no registers
-// - beq/bne => show (rs, rt, -)
-// - R-type => show (rs, rt, rd)
-// - I-type => show (rs, -, rt)
-// -------------------------------------------------------------------
-void SingleCycleMIPS::DecodeMonitorRegisters(const Instruction &ins,
-                                             string &m3, string &m4, string &m5)
-{
-    auto regName=[&](int r)->string{
-        if(r<0) return "-";
-        static const char* regNames[] = {
-            "$zero", "$at", "$v0", "$v1", "$a0", "$a1", "$a2", "$a3",
-            "$t0", "$t1", "$t2", "$t3", "$t4", "$t5", "$t6", "$t7",
-            "$s0", "$s1", "$s2", "$s3", "$s4", "$s5", "$s6", "$s7",
-            "$t8", "$t9", "$k0", "$k1", "$gp", "$sp", "$fp", "$ra"
-        };
-        if(r>=0 && r<32) return string(regNames[r]);
-        return "-";
-    };
-
-    // jump => no registers
-    if(ins.opcode=="j"){
-        m3="-"; m4="-"; m5="-";
-        return;
-    }
-    // beq/bne => (3=rs,4=rt,5="-")
-    if(ins.opcode=="beq"||ins.opcode=="bne"){
-        m3=regName(ins.rs);
-        m4=regName(ins.rt);
-        m5="-";
-        return;
-    }
-    // R-type => (3=rs,4=rt,5=rd)
-    if(ins.opcode=="add"||ins.opcode=="addu"||ins.opcode=="sub"||ins.opcode=="subu"||
-       ins.opcode=="and"||ins.opcode=="or"||ins.opcode=="nor"||ins.opcode=="slt"||
-       ins.opcode=="sltu"){
-        m3=regName(ins.rs);
-        m4=regName(ins.rt);
-        m5=regName(ins.rd);
-        return;
-    }
-    // For shift instructions: sll and srl have a different decode format.
-    if (ins.opcode == "sll" || ins.opcode == "srl") {
-        m3 = regName(ins.rt);  // the register being shifted (source)
-        m4 = "-";
-        m5 = regName(ins.rd);  // destination register
-        return;
-    }
-    // I-type => (3=rs,4="-",5=rt)
-    if(ins.opcode=="addi"||ins.opcode=="addiu"||ins.opcode=="andi"||ins.opcode=="ori"){
-        m3 = regName(ins.rs);
-        m4 = "-";
-        m5 = regName(ins.rt);
-        return;
-    }
-    if(
-        ins.opcode=="slti" || ins.opcode=="sltiu"){
-         m3 = regName(ins.rs);  // source
-         m4 = "-";
-         m5 = regName(ins.rt);  // destination
-         return;
-     }
-
-    // I-type lw,sw => ( 3=rs(base), 4=rt(dataReg), 5="-") //etsi einai sto sample, den kserw giati 
-    if(ins.opcode=="lw"||ins.opcode=="sw"){
-        m3 = regName(ins.rs);  // base
-        m4 = "-";  // data (to load/store)
-        m5 = regName(ins.rt);;
-        return;
-    }
-
-    // fallback => all "-"
-    m3="-"; m4="-"; m5="-";
-}
-
-// -------------------------------------------------------------------
-// PrintCycleInformation
-// - The "Registers" portion -> prints PC plus all 32 regs in hex
-// - The "Monitors" portion -> prints essential pipeline-like fields
-// -------------------------------------------------------------------
-void SingleCycleMIPS::PrintCycleInformation(ostream &out, uint32_t oldPC) {
-
-    auto toHexCustom = [&](int32_t val) -> string {
-        uint32_t u = (uint32_t)val;
-        // If the upper 16 bits are either 0 or 0xFFFF, print only the lower 16 bits.
-        if ((u & 0xFFFF0000) == 0 || (u & 0xFFFF0000) == 0xFFFF0000) {
-             ostringstream oss;
-             oss << hex << uppercase << (u & 0xFFFF);
-             string s = oss.str();
-             // Remove any leading zeros (if any)
-             size_t pos = s.find_first_not_of('0');
-             return (pos == string::npos) ? "0" : s.substr(pos);
-        } else {
-             ostringstream oss;
-             oss << hex << uppercase << u;
-             string s = oss.str();
-             size_t pos = s.find_first_not_of('0');
-             return (pos == string::npos) ? "0" : s.substr(pos);
-        }
-    };
-
-    auto toHexString = [&](int32_t val) -> string {
-        // If the upper 16 bits are either all 0's or all 1's, print only the lower 16 bits.
-        if (((uint32_t)val & 0xFFFF0000) == 0 || ((uint32_t)val & 0xFFFF0000) == 0xFFFF0000) {
-            ostringstream oss;
-            oss << hex << uppercase << (val & 0xFFFF);
-            return oss.str();
-        } else {
-            ostringstream oss;
-            oss << hex << uppercase << (uint32_t)val;
-            return oss.str();
-        }
-    };
-
-    auto toHexMin = [&](int32_t val) -> string {
-        ostringstream oss;
-        oss << hex << uppercase << (uint32_t)val;
-        string s = oss.str();
-        // Remove leading zeros
-        size_t pos = s.find_first_not_of('0');
-        if (pos == string::npos)
-            return "0";
-        else
-            return s.substr(pos);
-    };
-
-    auto toHexReg = [&](int32_t val) -> string {
-        // If the number is nonnegative and less than 0x10000, print it minimally.
-        // Otherwise, print the full 32-bit hexadecimal.
-        if (val >= 0 && (uint32_t)val < 0x10000) {
-            ostringstream oss;
-            oss << hex << uppercase << val;
-            return oss.str();
-        } else {
-            ostringstream oss;
-            oss << hex << uppercase << (uint32_t)val;
-            return oss.str();
-        }
-    };
-
-    auto toHexIType = [&](int32_t val) -> string {
-        ostringstream oss;
-        // Print as minimal hex using the same rule as toHexString.
-        if (((uint32_t)val & 0xFFFF0000) == 0 || ((uint32_t)val & 0xFFFF0000) == 0xFFFF0000)
-            oss << hex << uppercase << (val & 0xFFFF);
-        else
-            oss << hex << uppercase << (uint32_t)val;
-        return oss.str();
-    };
-    
-    auto toHexRType = [&](int32_t val) -> string {
-        ostringstream oss;
-        oss << hex << uppercase << (uint32_t)val;
-        return oss.str();
-    };
-    
-    out << "-----Cycle " << dec << cycleCount << "-----\n";
-
-    // 1) Print Register File
-    out << "Registers:\n";
-    auto R = [&](int i) { return rf.regs[i]; };
-
-    // Print PC first, then all 32 registers in hex
-   out << toHexCustom(rf.pc) << "\t";
-for (int i = 0; i < 32; i++) {
-    out << toHexCustom(rf.regs[i]) << "\t";
-}out << "\n\n";
-
-    // 2) Print "Monitors"
-    out << "Monitors:\n";
-
-    // (1) previous PC
-    out << hex << uppercase << oldPC << "\t";  
-    // (2) the instruction text
-    out << IR.originalLine << "\t";
-
-    // (3),(4),(5) => registers from decodeMonitorRegisters
-    string m3, m4, m5;
-    DecodeMonitorRegisters(IR, m3, m4, m5);
-    out << m3 << "\t" << m4 << "\t" << m5 << "\t";
-
-    // (6) Immediate
-bool isRtype = false, isItype = false;
-// Determine if the instruction is R-type or I-type
-if (IR.opcode == "add" || IR.opcode == "addu" || IR.opcode == "sub" || IR.opcode == "subu" ||
-    IR.opcode == "and" || IR.opcode == "or" || IR.opcode == "nor" || IR.opcode == "slt" ||
-    IR.opcode == "sltu" ) {
-    isRtype = true;
-} else if (IR.opcode == "addi" || IR.opcode == "addiu" || IR.opcode == "andi" || IR.opcode == "ori" ||
-           IR.opcode == "slti" || IR.opcode == "sltiu" || IR.opcode == "lw" || IR.opcode == "sw" ||
-           IR.opcode == "beq" || IR.opcode == "bne") {
-    isItype = true;
-}
-
-// Monitor 6: Contents of rd, rs, rt for R-type; rd, rt, - for I-type; -, rs, rt for branches
-if (IR.opcode == "sll" || IR.opcode == "srl") {
-    out << toHexCustom(rf.regs[IR.rd]) << "\t";   // destination (result) after execution
-    out << toHexCustom(rf.regs[IR.rt]) << "\t";       // operand value (from the register being shifted)
-    out << "-\t";                                  // no second source operand
-} else
-if (isRtype) {
-    // R-type: rd, rs, rt
-    out << toHexCustom(rf.regs[IR.rd]) << "\t";  // Monitor 6: rd
-    out << toHexCustom(rf.regs[IR.rs]) << "\t";  // Monitor 7: rs
-    out << toHexCustom(rf.regs[IR.rt]) << "\t";  // Monitor 8: rt
-} else if (isItype) {
-    // For I-type arithmetic instructions, the destination register (rt) is updated.
-    // We want to show the updated values from the register file.
-    out << toHexCustom(rf.regs[IR.rt]) << "\t";  // Monitor 6: destination (rt)
-    out << toHexCustom(rf.regs[IR.rs]) << "\t";  // Monitor 7: source (rs)
-    out << "-\t";                                     // Monitor 8: dash
-
-    
-    //if (IR.opcode == "sw" || IR.opcode == "lw") {
-        // lw/sw: -, rt, rs
-        //out << "-\t";                                  // Monitor 6: -
-       // out << hex << uppercase << regA << "\t";       // Monitor 7: rs (regA)
-       // out << hex << uppercase << regB << "\t";       // Monitor 8: rt (regB)
-   // }else {
-        // I-type: rd, rt, -
-        //out << hex << uppercase << rf.regs[IR.rd] << "\t";  // Monitor 6: rd
-        //out << hex << uppercase << regB << "\t";       // Monitor 7: rt (regB)
-       // out << "-\t";                                  // Monitor 8: -
-   // }
-} else {
-    // Other cases (e.g., j): -, -, -
-    out << "-\t";  // Monitor 6: -
-    out << "-\t";  // Monitor 7: -
-    out << "-\t";  // Monitor 8: -
-}
-
-    // (9) => ALU out
-    if (IR.opcode == "sll" || IR.opcode == "srl") {
-        out << toHexCustom(aluOut) << "\t";
-    } else if (isItype) {
-        out << toHexCustom(aluOut) << "\t";
-    } else {
-        out << toHexCustom(aluOut) << "\t";
-    }
-
-    
-    // (10) Branch label if used, else '-'
-    out << branchLabelMonitor << "\t";
-
-    // (11) Memory address if lw/sw
-    if ((IR.opcode=="lw"||IR.opcode=="sw") && memAddress != 0) {
-        out << hex << uppercase << memAddress << "\t";
-    } else {
-        out << "-\t";
-    }
-
-    // (12) Store data if sw
-    if (didStore) {
-        out << hex << uppercase << storeValue << "\t";
-    } else {
-        out << "-\t";
-    }
-
-    // (13) Load data if lw
-    if (didLoad) {
-        out << hex << uppercase << memDataReg << "\t";
-    } else {
-        out << "-\t";
-    }
-
-    // (14) Control signals in some textual form
-    out << (ctrl.RegisterDestination ? "1\t" : "0\t")
-        << (ctrl.JumpSignal          ? "1\t" : "0\t")
-        << (ctrl.BranchSignal        ? "1\t" : "0\t")
-        << (ctrl.MemoryRead          ? "1\t" : "0\t")
-        << (ctrl.MemoryToRegister    ? "1\t" : "0\t")
-        << GetAlu2Bits(IR.opcode)    << "\t"      // e.g. "10" ,not sure for the correct bits! Check again on next Part
-        << (ctrl.MemoryWrite         ? "1\t" : "0\t")
-        << (ctrl.ALUSource           ? "1\t" : "0\t")
-        << (ctrl.RegisterWrite       ? "1"   : "0")
-        << "\n\n";
-
-    // 3) "Memory State" => addresses updated in this cycle
-    out << "Memory State:\n";
-    
-    // Collect addresses in ascending order
-    vector<uint32_t> addrs;
-    for(auto &kv : mem.data) {
-        addrs.push_back(kv.first);
-    }
-    sort(addrs.begin(), addrs.end());
-
-    if(addrs.empty()) {
-        // If no memory used at all, just a blank line
-        out << "\n";
-    } else {
-        // Print the *values* in ascending offset from $gp
-        // e.g. 0 => 100, 4 => 1, 8 => 2, 12 => 1000
-        uint32_t gpBase = 0x10008000;
-
-        for(auto addr : addrs) {
-            // If you only want to show addresses >= gpBase
-            if(addr >= gpBase) {
-                out << hex << mem.data[addr] <<"\t";
-            }
-        }
-        out << "\n";  // end with blank line
-    }
-    // Possibly another newline if you want spacing:
-    out << "\n";
-}
-
-// -------------------------------------------------------------------
-// PrintFinalState: logs final CPU and memory contents when the program
-// has finished executing (or on user request).
-// -------------------------------------------------------------------
-void SingleCycleMIPS::PrintFinalState(ostream &out) {
-    out << "-----Final State-----\n";
-    out << "Registers:\n";
-
-    // Force $zero to 0 for safety:because sometimes its not zero for some reason 
-    rf.regs[0] = 0;
-
-    // Print final PC + all registers
-    out << hex << uppercase << rf.pc << "\t";
-    for (int i = 0; i < 32; i++) {
-        out << rf.regs[i] << "\t";
-    }
-    out << "\n\nMemory State:\n";
-
-    // base = 0x10008000 (the usual gp)
-    uint32_t gpBase = 0x10008000; //logo tou sample Instead of printing real addresses, let's gather them as offsets from $gp
-    // in ascending offset from $gp
-    // 1) Gather addresses from mem.data into a vector
-vector<uint32_t> sortedAddrs;
-sortedAddrs.reserve(mem.data.size());
-for (auto &kv : mem.data) {
-    sortedAddrs.push_back(kv.first);
-}
-
-// 2) Sort them ascending
-sort(sortedAddrs.begin(), sortedAddrs.end());
-
-// 3) Print values in ascending address order
-for (auto addr : sortedAddrs) {
-    // Now we get them in offset=0, offset=4, offset=8, offset=12, etc.
-    // Print the value in hex or decimal as you wish
-    out << hex << uppercase << mem.data[addr] << "\t";
-}
-    out << "\n\nTotal Cycles:\n" << dec << cycleCount << "\n";
-}
-
-
-// -------------------------------------------------------------------
-// main: simply creates a SingleCycleMIPS, asks user for cycle input,
-// loads instructions, and runs the simulation.
-// -------------------------------------------------------------------
-int main() {
-    SingleCycleMIPS sim;
-
-    cout << "Enter cycles to print (comma-separated, or 'all', or 'last'. e.g. 30,34,last): ";
-    string input;
-    getline(cin, input);
-
-    vector<int> cyclesToPrint;
-    bool includeLast = false;
-
-    // If user typed "all", we store -1 to indicate we print every cycle
-    if (input == "all") {
-        cyclesToPrint.push_back(-1);
-    }
-    else {
-        // Otherwise, parse comma-separated tokens
-        istringstream iss(input);
-        string token;
-        while (getline(iss, token, ',')) {
-            if (token == "last") {
-                includeLast = true;
-            } else {
-                try {
-                    cyclesToPrint.push_back(stoi(token));
-                } catch (const std::invalid_argument& e) {
-                    cerr << "Invalid input: " << token << " is not a number or 'last'." << endl;
-                    return 1;
-                }
-            }
-        }
-    }
-
-    // Load instructions from file
-    sim.LoadAssembly("simple2025.txt");
-
-    // Run the simulation, printing selected cycles and possibly final state
-    sim.RunSimulation("simple_output.txt", cyclesToPrint, includeLast);
-
-    return 0;
-}
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <cctype>
+#include <algorithm>
+#include <iomanip>
+#include <bitset>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <random>
+#include <map>
+#include <utility>
+#include <limits>
+#include <type_traits>
+#include <atomic>
+#include <cmath>
+#include <chrono>
+#include <filesystem>
+#include <csignal>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MIPS_POSIX 1
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef MIPS_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+
+#include "mips_sim.h"
+
+using namespace std;
+//===================IMPORTANT!!! READ THIS!!!===================
+//I added comments to help you understand it.
+//If you want to run the code, make sure to write the correct form in the console. For example,
+//if you want to print cycles 30, 34, and the final state, just write 30,34,last (where last stands for the final state).
+// The first lines of every output file
+static const char OUTPUT_HEADER[] = "Name: *****\nUniversity ID: *****\n\n";
+
+// -------------------------------------------------------------------
+// =================== Phase Profiling ===============================
+// -------------------------------------------------------------------
+// Build with -DMIPS_PROFILE to find out where the simulator's own time
+// goes. MIPS_PHASE(PH_x) times the rest of the enclosing scope with the
+// time-stamp counter (steady_clock where there is none) and adds it to
+// that phase, minus the time of the phases nested in it.
+// MIPS_CYCLE_DONE() counts a simulated cycle and about once a second
+// prints the throughput to stderr. The breakdown is printed to stderr
+// at exit. Without MIPS_PROFILE both macros are empty.
+#ifdef MIPS_PROFILE
+enum Phase { PH_PARSE, PH_FETCH, PH_CONTROL, PH_ALU, PH_MEMORY, PH_SELECT, PH_FORMAT, PH_WRITE, PH_COUNT };
+
+static inline uint64_t ProfileTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+static struct PhaseProfile {
+    atomic<uint64_t> ticks[PH_COUNT];
+    atomic<uint64_t> calls[PH_COUNT];
+    uint64_t cycles = 0;                          // simulation thread only
+    uint64_t lastReportCycles = 0;
+    chrono::steady_clock::time_point start, lastReport;
+    uint64_t startTicks;
+
+    PhaseProfile() {
+        for (int i = 0; i < PH_COUNT; i++) { ticks[i] = 0; calls[i] = 0; }
+        start = lastReport = chrono::steady_clock::now();
+        startTicks = ProfileTicks();
+    }
+
+    void CycleDone() {
+        if ((++cycles & 0xFFFFF) != 0) return;        // look at the clock every 2^20 cycles
+        auto now = chrono::steady_clock::now();
+        double secs = chrono::duration<double>(now - lastReport).count();
+        if (secs < 1.0) return;
+        cerr << "[profile] cycle " << dec << cycles << ": "
+             << fixed << setprecision(2) << (double)(cycles - lastReportCycles) / secs / 1e6
+             << " MIPS/s\n" << defaultfloat;
+        lastReport = now;
+        lastReportCycles = cycles;
+    }
+
+    ~PhaseProfile() {
+        static const char *const names[PH_COUNT] = {
+            "parse", "fetch", "control", "alu", "memory", "print-select", "format", "write"
+        };
+        double wall = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        // ticks -> seconds, measured over the whole run
+        double tickSecs = wall / (double)max<uint64_t>(1, ProfileTicks() - startTicks);
+        cerr << "[profile] " << dec << cycles << " cycles in " << fixed << setprecision(3) << wall << " s";
+        if (wall > 0) cerr << " (" << setprecision(2) << (double)cycles / wall / 1e6 << " MIPS/s)";
+        // (worker threads add up, so "format" can pass 100% with --render-threads)
+        cerr << "\n[profile] phase\tseconds\t% of wall\tcalls\tns/call\n";
+        for (int i = 0; i < PH_COUNT; i++) {
+            uint64_t n = calls[i];
+            if (!n) continue;
+            double secs = (double)ticks[i] * tickSecs;
+            cerr << "[profile] " << names[i] << "\t" << setprecision(3) << secs << "\t"
+                 << setprecision(1) << (wall > 0 ? 100 * secs / wall : 0) << "\t" << n << "\t"
+                 << setprecision(1) << secs * 1e9 / (double)n << "\n";
+        }
+        cerr << defaultfloat;
+    }
+} phaseProfile;
+
+// Each thread counts into its own copy and adds it to phaseProfile when
+// it exits (the main thread's copy goes before phaseProfile reports)
+static thread_local struct PhaseCounts {
+    uint64_t ticks[PH_COUNT] = {};
+    uint64_t calls[PH_COUNT] = {};
+    ~PhaseCounts() {
+        for (int i = 0; i < PH_COUNT; i++) {
+            phaseProfile.ticks[i] += ticks[i];
+            phaseProfile.calls[i] += calls[i];
+        }
+    }
+} phaseCounts;
+
+struct PhaseTimer {
+    Phase phase;
+    uint64_t begin;
+    uint64_t nested = 0;            // ticks of the timers inside this one
+    PhaseTimer *outer;
+    static thread_local PhaseTimer *innermost;
+
+    explicit PhaseTimer(Phase p) : phase(p), begin(ProfileTicks()), outer(innermost) { innermost = this; }
+    ~PhaseTimer() {
+        uint64_t ticks = ProfileTicks() - begin;
+        phaseCounts.ticks[phase] += ticks - nested;
+        phaseCounts.calls[phase]++;
+        if (outer) outer->nested += ticks;
+        innermost = outer;
+    }
+};
+thread_local PhaseTimer *PhaseTimer::innermost = nullptr;
+
+#define MIPS_PHASE_JOIN2(a, b) a##b
+#define MIPS_PHASE_JOIN(a, b) MIPS_PHASE_JOIN2(a, b)
+#define MIPS_PHASE(p) PhaseTimer MIPS_PHASE_JOIN(phaseTimer, __LINE__)(p)
+#define MIPS_CYCLE_DONE() phaseProfile.CycleDone()
+#else
+#define MIPS_PHASE(p) ((void)0)
+#define MIPS_CYCLE_DONE() ((void)0)
+#endif
+
+// -------------------------------------------------------------------
+// =================== Control Signals Struct ========================
+// -------------------------------------------------------------------
+// This struct holds all the single-cycle control signals that typically
+// come from the "control unit" in a MIPS CPU.
+// - RegisterDestination: If true, write destination is 'rd' (R-type).
+// - JumpSignal: If true, a jump instruction is executing.
+// - BranchSignal: If true, a branch instruction (beq, bne) is executing.
+// - MemoryRead: If true, read from memory (lw).
+// - MemoryToRegister: If true, take data from memory to write into a register (lw).
+// - ALUOperation: The numeric code that helps define the ALU function.
+// - MemoryWrite: If true, write data to memory (sw).
+// - ALUSource: If true, second ALU input is an immediate (I-type).
+// - RegisterWrite: If true, write back into a register.
+// It is an aggregate so the ISA table can hold each opcode's signals as
+// compile-time constants.
+struct ControlSignals {
+    bool RegisterDestination=false;
+    bool JumpSignal=false;
+    bool BranchSignal=false;
+    bool MemoryRead=false;
+    bool MemoryToRegister=false;
+    int  ALUOperation=0;
+    bool MemoryWrite=false;
+    bool ALUSource=false;
+    bool RegisterWrite=false;
+
+    string ToBinaryString() const {
+
+        int op = (ALUOperation & 0b11);
+        ostringstream oss;
+        oss << (RegisterDestination ? '1':'0') << " "
+            << (JumpSignal          ? '1':'0') << " "
+            << (BranchSignal        ? '1':'0') << " "
+            << (MemoryRead          ? '1':'0') << " "
+            << (MemoryToRegister    ? '1':'0') << " "
+            << bitset<2>(op)        << " "
+            << (MemoryWrite         ? '1':'0') << " "
+            << (ALUSource           ? '1':'0') << " "
+            << (RegisterWrite       ? '1':'0');
+        return oss.str();
+    }
+};
+
+// -------------------------------------------------------------------
+// =================== Opcodes =======================================
+// -------------------------------------------------------------------
+// Every supported mnemonic gets a small number so the simulator never
+// compares opcode strings while running. OP_NONE means "no instruction
+// on this line" and OP_UNKNOWN is any other mnemonic (it still takes a
+// cycle, like before, it just does nothing).
+enum Opcode : uint8_t {
+    OP_NONE, OP_ADD, OP_ADDU, OP_SUB, OP_SUBU, OP_AND, OP_OR, OP_NOR,
+    OP_SLT, OP_SLTU, OP_SLL, OP_SRL, OP_ADDI, OP_ADDIU, OP_ANDI, OP_ORI,
+    OP_SLTI, OP_SLTIU, OP_LW, OP_SW, OP_BEQ, OP_BNE, OP_J, OP_UNKNOWN
+};
+
+// -------------------------------------------------------------------
+// =================== ISA Table =====================================
+// -------------------------------------------------------------------
+// Everything the simulator knows about an opcode, in one place. The
+// parser, the control unit, the ALU, the write-back and the Monitors
+// columns all read this table, and the per-opcode execute handlers
+// (SingleCycleMIPS::Execute<OP>) are instantiated from it, so each one
+// is straight-line code. Adding an instruction means adding an Opcode
+// and its row here.
+//
+// format decides the operand syntax and the Monitors columns:
+//   FMT_R       op $rd, $rs, $rt          (3,4,5) = rs rt rd  (6,7,8) = rd rs rt
+//   FMT_SHIFT   op $rd, $rt, shamt        (3,4,5) = rt - rd   (6,7,8) = rd rt -
+//   FMT_I       op $rt, $rs, imm          (3,4,5) = rs - rt   (6,7,8) = rt rs -
+//   FMT_MEM     op $rt, offset($rs)       (3,4,5) = rs - rt   (6,7,8) = rt rs -
+//   FMT_BRANCH  op $rs, $rt, label        (3,4,5) = rs rt -   (6,7,8) = rt rs -
+//   FMT_JUMP    op label                  everything "-"
+enum IsaFormat : uint8_t { FMT_NONE, FMT_R, FMT_SHIFT, FMT_I, FMT_MEM, FMT_BRANCH, FMT_JUMP };
+enum IsaExtend : uint8_t { EXT_NONE, EXT_SIGN16, EXT_ZERO16 };     // immediate extension
+enum IsaDest   : uint8_t { DEST_NONE, DEST_RD, DEST_RT };          // register written back
+enum IsaAlu    : uint8_t { ALU_NONE, ALU_ADD, ALU_ADDU, ALU_SUB, ALU_AND, ALU_OR, ALU_NOR,
+                           ALU_SLT, ALU_SLTU, ALU_SLL, ALU_SRL };
+enum IsaCond   : uint8_t { COND_NONE, COND_EQ, COND_NE };           // branch condition
+
+struct IsaEntry {
+    uint8_t        op;
+    const char    *name;
+    IsaFormat      format;
+    IsaExtend      extend;
+    IsaDest        dest;
+    IsaAlu         alu;
+    IsaCond        cond;
+    const char    *alu2;       // the ALU column of the printed control signals
+    ControlSignals control;
+};
+
+//                                RegDst Jump  Branch MemRd MemToReg ALUOp MemWr ALUSrc RegWr
+static constexpr ControlSignals CTRL_NONE   {};
+static constexpr ControlSignals CTRL_R      {true,  false, false, false, false, 2, false, false, true};
+static constexpr ControlSignals CTRL_SHIFT  {false, false, false, false, false, 2, false, true,  true};
+static constexpr ControlSignals CTRL_I      {false, false, false, false, false, 0, false, true,  true};
+static constexpr ControlSignals CTRL_LOAD   {false, false, false, true,  true,  0, false, true,  true};
+static constexpr ControlSignals CTRL_STORE  {false, false, false, false, false, 0, true,  true,  false};
+static constexpr ControlSignals CTRL_BRANCH {false, false, true,  false, false, 1, false, false, false};
+static constexpr ControlSignals CTRL_JUMP   {false, true,  false, false, false, 0, false, false, false};
+
+static constexpr IsaEntry ISA[] = {
+    // op         name         format      extend      dest       alu       cond       alu2  control
+    {OP_NONE,    "(none)",    FMT_NONE,   EXT_NONE,   DEST_NONE, ALU_ADD,  COND_NONE, "--", CTRL_NONE},
+    {OP_ADD,     "add",       FMT_R,      EXT_NONE,   DEST_RD,   ALU_ADD,  COND_NONE, "10", CTRL_R},
+    {OP_ADDU,    "addu",      FMT_R,      EXT_NONE,   DEST_RD,   ALU_ADDU, COND_NONE, "10", CTRL_R},
+    {OP_SUB,     "sub",       FMT_R,      EXT_NONE,   DEST_RD,   ALU_SUB,  COND_NONE, "10", CTRL_R},
+    {OP_SUBU,    "subu",      FMT_R,      EXT_NONE,   DEST_RD,   ALU_SUB,  COND_NONE, "10", CTRL_R},
+    {OP_AND,     "and",       FMT_R,      EXT_NONE,   DEST_RD,   ALU_AND,  COND_NONE, "00", CTRL_R},
+    {OP_OR,      "or",        FMT_R,      EXT_NONE,   DEST_RD,   ALU_OR,   COND_NONE, "01", CTRL_R},
+    {OP_NOR,     "nor",       FMT_R,      EXT_NONE,   DEST_RD,   ALU_NOR,  COND_NONE, "00", CTRL_R},
+    {OP_SLT,     "slt",       FMT_R,      EXT_NONE,   DEST_RD,   ALU_SLT,  COND_NONE, "11", CTRL_R},
+    {OP_SLTU,    "sltu",      FMT_R,      EXT_NONE,   DEST_RD,   ALU_SLTU, COND_NONE, "11", CTRL_R},
+    {OP_SLL,     "sll",       FMT_SHIFT,  EXT_NONE,   DEST_RD,   ALU_SLL,  COND_NONE, "10", CTRL_SHIFT},
+    {OP_SRL,     "srl",       FMT_SHIFT,  EXT_NONE,   DEST_RD,   ALU_SRL,  COND_NONE, "10", CTRL_SHIFT},
+    {OP_ADDI,    "addi",      FMT_I,      EXT_SIGN16, DEST_RT,   ALU_ADD,  COND_NONE, "10", CTRL_I},
+    {OP_ADDIU,   "addiu",     FMT_I,      EXT_SIGN16, DEST_RT,   ALU_ADD,  COND_NONE, "10", CTRL_I},
+    {OP_ANDI,    "andi",      FMT_I,      EXT_ZERO16, DEST_RT,   ALU_AND,  COND_NONE, "00", CTRL_I},
+    {OP_ORI,     "ori",       FMT_I,      EXT_ZERO16, DEST_RT,   ALU_OR,   COND_NONE, "01", CTRL_I},
+    {OP_SLTI,    "slti",      FMT_I,      EXT_SIGN16, DEST_RT,   ALU_SLT,  COND_NONE, "11", CTRL_I},
+    {OP_SLTIU,   "sltiu",     FMT_I,      EXT_SIGN16, DEST_RT,   ALU_SLTU, COND_NONE, "11", CTRL_I},
+    {OP_LW,      "lw",        FMT_MEM,    EXT_NONE,   DEST_RT,   ALU_ADD,  COND_NONE, "00", CTRL_LOAD},
+    {OP_SW,      "sw",        FMT_MEM,    EXT_NONE,   DEST_NONE, ALU_ADD,  COND_NONE, "00", CTRL_STORE},
+    {OP_BEQ,     "beq",       FMT_BRANCH, EXT_NONE,   DEST_NONE, ALU_NONE, COND_EQ,   "01", CTRL_BRANCH},
+    {OP_BNE,     "bne",       FMT_BRANCH, EXT_NONE,   DEST_NONE, ALU_NONE, COND_NE,   "01", CTRL_BRANCH},
+    {OP_J,       "j",         FMT_JUMP,   EXT_NONE,   DEST_NONE, ALU_NONE, COND_NONE, "--", CTRL_JUMP},
+    {OP_UNKNOWN, "(unknown)", FMT_NONE,   EXT_NONE,   DEST_NONE, ALU_ADD,  COND_NONE, "--", CTRL_NONE},
+};
+static_assert(sizeof(ISA) / sizeof(ISA[0]) == OP_UNKNOWN + 1, "one ISA row per Opcode");
+
+static constexpr bool IsaRowsInOrder() {
+    for (size_t i = 0; i < sizeof(ISA) / sizeof(ISA[0]); i++) {
+        if (ISA[i].op != i) return false;
+    }
+    return true;
+}
+static_assert(IsaRowsInOrder(), "ISA rows must be in Opcode order");
+
+static uint8_t OpcodeFromName(const string &name)
+{
+    static const unordered_map<string,uint8_t> names = [] {
+        unordered_map<string,uint8_t> byName;
+        for (const IsaEntry &e : ISA) {
+            if (e.op != OP_NONE && e.op != OP_UNKNOWN) byName[e.name] = e.op;
+        }
+        return byName;
+    }();
+    if (name.empty()) return OP_NONE;
+    auto it = names.find(name);
+    return (it == names.end()) ? (uint8_t)OP_UNKNOWN : it->second;
+}
+
+static const char *OpcodeName(uint8_t op)
+{
+    return op <= OP_UNKNOWN ? ISA[op].name : "(unknown)";
+}
+
+// -------------------------------------------------------------------
+// IsaAluResult: the ALU for one operation, resolved at compile time
+// -------------------------------------------------------------------
+template <IsaAlu A>
+static inline int32_t IsaAluResult(int32_t a, int32_t b)
+{
+    if constexpr (A == ALU_ADDU) return (uint32_t)a + (uint32_t)b;
+    else if constexpr (A == ALU_SUB)  return a-b;
+    else if constexpr (A == ALU_AND)  return (a & b);
+    else if constexpr (A == ALU_OR)   return (a | b);
+    else if constexpr (A == ALU_NOR)  return ~(a | b);
+    else if constexpr (A == ALU_SLT)  return (a<b) ? 1 : 0;
+    else if constexpr (A == ALU_SLTU) return ((uint32_t)a<(uint32_t)b)?1:0;
+    else if constexpr (A == ALU_SLL)  return ((uint32_t)a << (b & 31));
+    else if constexpr (A == ALU_SRL)  return ((uint32_t)a >> (b & 31));
+    else return a+b;    // ALU_ADD (and anything without its own ALU function)
+}
+
+// -------------------------------------------------------------------
+// =================== Instruction Struct ============================
+// -------------------------------------------------------------------
+// This struct encapsulates one decoded instruction in 16 bytes:
+// - op: the Opcode
+// - rs, rt, rd: integer register numbers for the MIPS fields
+// - imm: 32-bit immediate or offset, already sign/zero-extended
+// - target: instruction index of the branch/jump label
+//           (-1 = label does not exist, -2 = no label given)
+// - label: id of the label text in the string pool (for printing)
+// The source text of each instruction lives in the string pool too and
+// is only looked up when a cycle is printed.
+struct Instruction {
+    uint8_t  op=OP_NONE;
+    int8_t   rs=0, rt=0, rd=0;
+    int32_t  imm=0;
+    int32_t  target=-2;
+    uint32_t label=0;
+};
+static_assert(sizeof(Instruction) == 16, "Instruction should stay 16 bytes");
+
+// -------------------------------------------------------------------
+// =================== String Pool ===================================
+// -------------------------------------------------------------------
+// Interns strings (labels, source lines) so each distinct text is kept
+// once and instructions only carry a 32-bit id. Id 0 is the empty string.
+// 'ids' is only needed while a program is being parsed; a pool read back
+// from the program cache leaves it empty.
+struct StringPool {
+    vector<string> strings{string()};
+    unordered_map<string,uint32_t> ids{{string(), 0}};
+
+    uint32_t Intern(const string &s) {
+        auto it = ids.find(s);
+        if (it != ids.end()) return it->second;
+        uint32_t id = (uint32_t)strings.size();
+        strings.push_back(s);
+        ids.emplace(s, id);
+        return id;
+    }
+    const string &Get(uint32_t id) const { return strings[id]; }
+};
+
+// -------------------------------------------------------------------
+// HashBytes: 64-bit FNV-1a, used to recognise identical program sources
+// -------------------------------------------------------------------
+static uint64_t HashBytes(const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char*)data;
+    uint64_t h = 1469598103934665603ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// -------------------------------------------------------------------
+// AlignedAllocator: lets the instruction memory start on a cache line
+// (64 bytes = 4 instructions) without padding every Instruction.
+// -------------------------------------------------------------------
+template <typename T, size_t Align>
+struct AlignedAllocator {
+    typedef T value_type;
+    template <typename U> struct rebind { typedef AlignedAllocator<U, Align> other; };
+
+    AlignedAllocator() = default;
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, Align> &) {}
+
+    T *allocate(size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Align)));
+    }
+    void deallocate(T *p, size_t) { ::operator delete(p, std::align_val_t(Align)); }
+
+    template <typename U> bool operator==(const AlignedAllocator<U, Align> &) const { return true; }
+    template <typename U> bool operator!=(const AlignedAllocator<U, Align> &) const { return false; }
+};
+
+// -------------------------------------------------------------------
+// =================== Program =======================================
+// -------------------------------------------------------------------
+// Everything LoadAssembly produces:
+// - instrs: the decoded instruction memory (index = PC/4)
+// - sourceLines: string pool id of each instruction's source text
+// - strings: the pool holding source text and label names
+// - labelMap: label -> instruction index
+// - dataSegments/data: the words of the .word directives, which every
+//   run starts with in memory, as runs of consecutive addresses
+//   (dataSegments[i] covers data[first .. first+count))
+static const uint32_t DATA_SEGMENT_BASE = 0x10008000;   // .data starts at $gp
+static const uint32_t MAX_DATA_WORDS = 1u << 24;        // .word words per program (64 MB)
+
+struct DataSegment {
+    uint32_t addr, first, count;
+    bool operator==(const DataSegment &o) const { return addr == o.addr && first == o.first && count == o.count; }
+};
+static_assert(sizeof(DataSegment) == 12, "DataSegment is written to the program cache as-is");
+
+// ProgramArray: one of the Program's per-instruction arrays. The parser
+// builds it in memory; a program read from the cache points it into the
+// mapped file instead and keeps the mapping alive. Reading is the same
+// either way. The first write (PatchInstruction's copy) turns a view into
+// an owned copy, so the mapping is never written.
+template <typename T, typename Alloc = std::allocator<T>>
+class ProgramArray {
+public:
+    ProgramArray() = default;
+    ProgramArray(const ProgramArray &o) { *this = o; }
+    ProgramArray &operator=(const ProgramArray &o) {
+        if (this == &o) return *this;
+        backing = o.backing;
+        if (backing) {
+            owned.clear();
+            ptr = o.ptr;
+            count = o.count;
+        } else {
+            owned = o.owned;
+            Sync();
+        }
+        return *this;
+    }
+
+    void View(const T *data, size_t n, shared_ptr<const void> keepAlive) {
+        owned.clear();
+        owned.shrink_to_fit();
+        backing = move(keepAlive);
+        ptr = data;
+        count = n;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T *data() const { return ptr; }
+    const T &operator[](size_t i) const { return ptr[i]; }
+    const T *begin() const { return ptr; }
+    const T *end() const { return ptr + count; }
+
+    T &operator[](size_t i) { Own(); return owned[i]; }
+    T *begin() { Own(); return owned.data(); }
+    T *end() { Own(); return owned.data() + count; }
+    void push_back(const T &v) { Own(); owned.push_back(v); Sync(); }
+
+private:
+    void Own() {
+        if (!backing) return;
+        owned.assign(ptr, ptr + count);
+        backing.reset();
+        Sync();
+    }
+    void Sync() { ptr = owned.data(); count = owned.size(); }
+
+    vector<T, Alloc> owned;
+    const T *ptr=nullptr;
+    size_t count=0;
+    shared_ptr<const void> backing;     // the mapped cache file, for a view
+};
+
+struct Program {
+    ProgramArray<Instruction, AlignedAllocator<Instruction, 64>> instrs;
+    ProgramArray<uint32_t> sourceLines;
+    StringPool strings;
+    unordered_map<string,int> labelMap;
+    vector<DataSegment> dataSegments;
+    vector<int32_t> data;
+
+    const string &SourceLine(size_t idx) const { return strings.Get(sourceLines[idx]); }
+    const string &Label(const Instruction &ins) const { return strings.Get(ins.label); }
+
+    void AddDataWord(uint32_t addr, int32_t value) {
+        if (!dataSegments.empty()) {
+            DataSegment &last = dataSegments.back();
+            if (last.addr + 4 * last.count == addr && last.first + last.count == data.size()) {
+                last.count++;
+                data.push_back(value);
+                return;
+            }
+        }
+        dataSegments.push_back({addr, (uint32_t)data.size(), 1});
+        data.push_back(value);
+    }
+    bool SameData(const Program &o) const { return dataSegments == o.dataSegments && data == o.data; }
+};
+
+// -------------------------------------------------------------------
+// =================== Register File ===============================
+// -------------------------------------------------------------------
+// Holds the 32 registers (regs[]) plus the program counter (pc).
+// We initialize all registers to zero, including pc.
+// Typically, $gp is set to 0x10008000, $sp is set to 0x7ffffffc later.
+struct RegFile {
+    int32_t regs[32];
+    uint32_t pc;
+    RegFile() {
+        memset(regs, 0, sizeof(regs));
+        pc = 0;
+    }
+};
+
+static const char *const REGISTER_NAMES[32] = {
+    "$zero", "$at", "$v0", "$v1", "$a0", "$a1", "$a2", "$a3",
+    "$t0", "$t1", "$t2", "$t3", "$t4", "$t5", "$t6", "$t7",
+    "$s0", "$s1", "$s2", "$s3", "$s4", "$s5", "$s6", "$s7",
+    "$t8", "$t9", "$k0", "$k1", "$gp", "$sp", "$fp", "$ra"
+};
+
+// -------------------------------------------------------------------
+// =================== Sparse Memory ===============================
+// -------------------------------------------------------------------
+// A "sparse" memory model: only addresses that were stored to exist,
+// so we don't need a huge array. Words live in 4 KB pages with a bit per
+// word saying whether it was ever stored (the printouts list exactly
+// those words). Copying a SparseMem is O(1): the copies share the page
+// table and the pages, and a store only copies the table and the one
+// page it touches when they are still shared (copy-on-write), so forks
+// of a simulation cost O(pages they change). Stores to addresses that
+// are not word aligned go to a small separate map.
+struct MemoryPage {
+    static const uint32_t WORDS = 1024;
+    int32_t words[WORDS];
+    uint64_t present[WORDS / 64];
+};
+
+class SparseMem {
+public:
+    // nullptr if never stored. The pointer is only good until the next
+    // Store: a store to a shared page (a fork's, or the initial memory's
+    // right after a Reset) moves the word to a private copy.
+    const int32_t *Find(uint32_t addr) const {
+        if (addr & 3) {
+            if (!unaligned) return nullptr;
+            auto it = unaligned->find(addr);
+            return it == unaligned->end() ? nullptr : &it->second;
+        }
+        if (!table) return nullptr;
+        auto it = table->find(addr >> 12);
+        if (it == table->end()) return nullptr;
+        uint32_t slot = (addr >> 2) & (MemoryPage::WORDS - 1);
+        if (!((it->second->present[slot / 64] >> (slot % 64)) & 1)) return nullptr;
+        return &it->second->words[slot];
+    }
+    int32_t Load(uint32_t addr) const {             // 0 if never stored
+        const int32_t *w = Find(addr);
+        return w ? *w : 0;
+    }
+
+    void Store(uint32_t addr, int32_t value) {
+        if (addr & 3) {
+            if (!unaligned) unaligned = make_shared<unordered_map<uint32_t,int32_t>>();
+            else if (unaligned.use_count() > 1) unaligned = make_shared<unordered_map<uint32_t,int32_t>>(*unaligned);
+            if (unaligned->insert({addr, value}).second) count++;
+            else (*unaligned)[addr] = value;
+            return;
+        }
+        if (!table) table = make_shared<PageTable>();
+        else if (table.use_count() > 1) table = make_shared<PageTable>(*table);
+        shared_ptr<MemoryPage> &page = (*table)[addr >> 12];
+        if (!page) page = make_shared<MemoryPage>();          // value-initialized: all zero
+        else if (page.use_count() > 1) page = make_shared<MemoryPage>(*page);
+        uint32_t slot = (addr >> 2) & (MemoryPage::WORDS - 1);
+        uint64_t bit = 1ull << (slot % 64);
+        if (!(page->present[slot / 64] & bit)) {
+            page->present[slot / 64] |= bit;
+            count++;
+        }
+        page->words[slot] = value;
+    }
+
+    size_t Size() const { return count; }           // words stored
+    void Clear() {
+        table.reset();
+        unaligned.reset();
+        count = 0;
+    }
+
+    // f(addr, value) for every stored word, in no particular order
+    template <class F> void ForEach(F f) const {
+        if (table) {
+            for (auto &kv : *table) {
+                const MemoryPage &page = *kv.second;
+                for (uint32_t w = 0; w < MemoryPage::WORDS / 64; w++) {
+                    for (uint64_t m = page.present[w]; m; m &= m - 1) {
+                        uint32_t slot = w * 64 + (uint32_t)__builtin_ctzll(m);
+                        f((kv.first << 12) | (slot << 2), page.words[slot]);
+                    }
+                }
+            }
+        }
+        if (unaligned) for (auto &kv : *unaligned) f(kv.first, kv.second);
+    }
+
+    // f(pageNumber, page) for every page, then g(addr, value) for every
+    // unaligned word, both in no particular order
+    template <class F, class G> void ForEachPage(F f, G g) const {
+        if (table) for (auto &kv : *table) f(kv.first, *kv.second);
+        if (unaligned) for (auto &kv : *unaligned) g(kv.first, kv.second);
+    }
+
+    // Same values everywhere (a word never stored counts as 0); pages
+    // still shared with 'other' are skipped without looking at them
+    bool SameValues(const SparseMem &other) const {
+        if (table == other.table && unaligned == other.unaligned) return true;
+        auto covered = [](const SparseMem &a, const SparseMem &b) {
+            bool same = true;
+            if (a.table) {
+                for (auto &kv : *a.table) {
+                    if (b.table) {
+                        auto it = b.table->find(kv.first);
+                        if (it != b.table->end() && it->second == kv.second) continue;
+                    }
+                    const MemoryPage &page = *kv.second;
+                    uint32_t base = kv.first << 12;
+                    for (uint32_t slot = 0; slot < MemoryPage::WORDS && same; slot++) {
+                        if (page.words[slot] != b.Load(base | (slot << 2))) same = false;
+                    }
+                    if (!same) return false;
+                }
+            }
+            if (a.unaligned) {
+                for (auto &kv : *a.unaligned) if (kv.second != b.Load(kv.first)) return false;
+            }
+            return true;
+        };
+        return covered(*this, other) && covered(other, *this);
+    }
+
+private:
+    typedef unordered_map<uint32_t, shared_ptr<MemoryPage>> PageTable;   // page number -> page
+    shared_ptr<PageTable> table;
+    shared_ptr<unordered_map<uint32_t,int32_t>> unaligned;
+    size_t count = 0;
+};
+
+// -------------------------------------------------------------------
+// State hashing (livelock detection)
+// -------------------------------------------------------------------
+// The architectural state (PC, registers, memory) hashes to the XOR of
+// one term per location, so a register write or a store updates it by
+// XOR-ing out the old term and XOR-ing in the new one. A zero value has
+// a zero term: an address never stored to and one holding 0 look the
+// same, just as they do to lw.
+static const uint64_t STATE_KEY_MEM = 1ull << 40;
+static const uint64_t STATE_KEY_PC  = 2ull << 40;
+
+static inline uint64_t StateTerm(uint64_t key, uint32_t value) {
+    if (value == 0) return 0;
+    uint64_t z = (key << 32 | value) + 0x9E3779B97F4A7C15ull;   // splitmix64 finalizer
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// A full copy of the state, kept so that a hash match can be confirmed
+// exactly before a run is declared stuck (the memory copy is
+// copy-on-write, so taking one is cheap)
+struct StateSnapshot {
+    uint32_t pc = 0;
+    int32_t regs[32] = {};
+    SparseMem mem;
+
+    bool Same(uint32_t pc2, const int32_t *regs2, const SparseMem &mem2) const {
+        if (pc != pc2 || memcmp(regs, regs2, sizeof(regs)) != 0) return false;
+        return mem.SameValues(mem2);
+    }
+};
+
+// -------------------------------------------------------------------
+// =================== Mapped Files ==================================
+// -------------------------------------------------------------------
+// A read-only view of a whole file: mmap on POSIX, so only the pages a
+// reader touches are loaded, and a plain read into memory elsewhere.
+class MappedFile {
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile &operator=(const MappedFile&) = delete;
+    ~MappedFile() { Close(); }
+
+    bool Open(const string &path) {
+        Close();
+#ifdef MIPS_POSIX
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return false;
+        }
+        size = (size_t)st.st_size;
+        if (size == 0) {            // mmap refuses empty files
+            close(fd);
+            base = "";
+            return true;
+        }
+        void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            size = 0;
+            return false;
+        }
+        mapped = map;
+        base = (const char*)map;
+#else
+        ifstream fin(path, ios::binary);
+        if (!fin.is_open()) return false;
+        ostringstream all;
+        all << fin.rdbuf();
+        bytes = all.str();
+        base = bytes.data();
+        size = bytes.size();
+#endif
+        return true;
+    }
+    void Close() {
+#ifdef MIPS_POSIX
+        if (mapped) munmap(mapped, size);
+        mapped = nullptr;
+#endif
+        bytes.clear();
+        base = nullptr;
+        size = 0;
+    }
+
+    const char *Data() const { return base; }
+    size_t Size() const { return size; }
+
+private:
+    const char *base=nullptr;
+    size_t size=0;
+    void *mapped=nullptr;
+    string bytes;           // only used when there is no mmap
+};
+
+// -------------------------------------------------------------------
+// =================== Program Cache =================================
+// -------------------------------------------------------------------
+// A decoded Program saved to disk so an unchanged source file does not
+// have to be parsed again. The file name is the hash of the source text,
+// and the header repeats the hash, the source size and the simulator
+// version, so an edited source or a newer simulator never picks up a
+// stale entry. Layout (all little-endian, host order):
+//   ProgramCacheHeader (64 bytes)
+//   Instruction[instrCount]          (starts 64-byte aligned)
+//   uint32 sourceLines[instrCount]
+//   uint32 stringOffsets[stringCount + 1], then the string bytes
+//   { uint32 stringId; int32 index } labels[labelCount]
+//   DataSegment dataSegments[dataSegmentCount], then int32 data[dataWords]
+//
+// Bump MIPS_SIM_VERSION whenever decoding or the Program layout changes.
+static const uint32_t MIPS_SIM_VERSION = 2;
+static const char PROGRAM_CACHE_MAGIC[8] = {'M','I','P','S','P','R','G','1'};
+
+struct ProgramCacheHeader {
+    char     magic[8];
+    uint32_t simVersion;
+    uint32_t instrSize;      // sizeof(Instruction), guards against layout changes
+    uint64_t sourceHash;
+    uint64_t sourceSize;
+    uint32_t instrCount;
+    uint32_t stringCount;
+    uint32_t labelCount;
+    uint32_t dataSegmentCount;
+    uint64_t stringBytes;
+    uint64_t dataWords;
+};
+static_assert(sizeof(ProgramCacheHeader) == 64, "cache header is one cache line");
+
+static string ProgramCachePath(const string &dir, uint64_t sourceHash) {
+    ostringstream name;
+    name << dir << "/" << hex << setw(16) << setfill('0') << sourceHash
+         << "-v" << dec << MIPS_SIM_VERSION << ".mprg";
+    return name.str();
+}
+
+// -------------------------------------------------------------------
+// SaveProgramCache: writes the program next to a temporary name and
+// renames it into place, so readers never see a half-written file.
+// -------------------------------------------------------------------
+static bool SaveProgramCache(const Program &prog, const string &path, uint64_t sourceHash, uint64_t sourceSize) {
+    ProgramCacheHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PROGRAM_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.simVersion = MIPS_SIM_VERSION;
+    hdr.instrSize = sizeof(Instruction);
+    hdr.sourceHash = sourceHash;
+    hdr.sourceSize = sourceSize;
+    hdr.instrCount = (uint32_t)prog.instrs.size();
+    hdr.stringCount = (uint32_t)prog.strings.strings.size();
+    hdr.labelCount = (uint32_t)prog.labelMap.size();
+    hdr.dataSegmentCount = (uint32_t)prog.dataSegments.size();
+    hdr.dataWords = prog.data.size();
+
+    vector<uint32_t> offsets;
+    offsets.reserve(hdr.stringCount + 1);
+    uint64_t total = 0;
+    for (const string &str : prog.strings.strings) {
+        offsets.push_back((uint32_t)total);
+        total += str.size();
+    }
+    offsets.push_back((uint32_t)total);
+    hdr.stringBytes = total;
+
+    string tmp = path + ".tmp" + to_string((uint64_t)hash<thread::id>()(this_thread::get_id()));
+    ofstream out(tmp, ios::binary);
+    if (!out.is_open()) return false;
+    out.write((const char*)&hdr, sizeof(hdr));
+    out.write((const char*)prog.instrs.data(), prog.instrs.size() * sizeof(Instruction));
+    out.write((const char*)prog.sourceLines.data(), prog.sourceLines.size() * sizeof(uint32_t));
+    out.write((const char*)offsets.data(), offsets.size() * sizeof(uint32_t));
+    for (const string &str : prog.strings.strings) out.write(str.data(), str.size());
+    for (auto &kv : prog.labelMap) {
+        auto it = prog.strings.ids.find(kv.first);   // the parser interns every label
+        if (it == prog.strings.ids.end()) {
+            out.close();
+            remove(tmp.c_str());
+            return false;
+        }
+        uint32_t id = it->second;
+        int32_t index = kv.second;
+        out.write((const char*)&id, sizeof(id));
+        out.write((const char*)&index, sizeof(index));
+    }
+    out.write((const char*)prog.dataSegments.data(), prog.dataSegments.size() * sizeof(DataSegment));
+    out.write((const char*)prog.data.data(), prog.data.size() * sizeof(int32_t));
+    out.close();
+    if (!out) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// -------------------------------------------------------------------
+// LoadProgramCache: maps a cache file and rebuilds the Program from it.
+// The instructions and source-line ids stay in the mapping; everything
+// else is small and copied out. Returns nullptr if there is no usable
+// entry for this source, including one that fails the range checks.
+// -------------------------------------------------------------------
+static shared_ptr<Program> LoadProgramCache(const string &path, uint64_t sourceHash, uint64_t sourceSize) {
+    auto file = make_shared<MappedFile>();
+    if (!file->Open(path) || file->Size() < sizeof(ProgramCacheHeader)) return nullptr;
+    const char *base = file->Data();
+    size_t size = file->Size();
+
+    ProgramCacheHeader hdr;
+    memcpy(&hdr, base, sizeof(hdr));
+    if (memcmp(hdr.magic, PROGRAM_CACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.simVersion != MIPS_SIM_VERSION || hdr.instrSize != sizeof(Instruction) ||
+        hdr.sourceHash != sourceHash || hdr.sourceSize != sourceSize || hdr.stringCount == 0) {
+        return nullptr;
+    }
+    uint64_t need = sizeof(hdr) + (uint64_t)hdr.instrCount * (sizeof(Instruction) + sizeof(uint32_t)) +
+                    ((uint64_t)hdr.stringCount + 1) * sizeof(uint32_t) + hdr.stringBytes +
+                    (uint64_t)hdr.labelCount * 8 + (uint64_t)hdr.dataSegmentCount * sizeof(DataSegment) +
+                    hdr.dataWords * sizeof(int32_t);
+    if (need != size) return nullptr;
+
+    auto prog = make_shared<Program>();
+    const char *p = base + sizeof(hdr);
+    prog->instrs.View((const Instruction*)p, hdr.instrCount, file);
+    p += hdr.instrCount * sizeof(Instruction);
+    prog->sourceLines.View((const uint32_t*)p, hdr.instrCount, file);
+    p += hdr.instrCount * sizeof(uint32_t);
+
+    vector<uint32_t> offsets(hdr.stringCount + 1);
+    memcpy(offsets.data(), p, offsets.size() * sizeof(uint32_t));
+    p += offsets.size() * sizeof(uint32_t);
+    prog->strings.strings.clear();
+    prog->strings.ids.clear();
+    prog->strings.strings.reserve(hdr.stringCount);
+    for (uint32_t i = 0; i < hdr.stringCount; i++) {
+        if (offsets[i] > offsets[i + 1] || offsets[i + 1] > hdr.stringBytes) return nullptr;
+        prog->strings.strings.emplace_back(p + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+    p += hdr.stringBytes;
+
+    for (uint32_t i = 0; i < hdr.labelCount; i++) {
+        uint32_t id;
+        int32_t index;
+        memcpy(&id, p, sizeof(id));
+        memcpy(&index, p + 4, sizeof(index));
+        p += 8;
+        if (id >= hdr.stringCount || index < 0 || (uint32_t)index > hdr.instrCount) return nullptr;
+        prog->labelMap[prog->strings.strings[id]] = index;
+    }
+
+    prog->dataSegments.resize(hdr.dataSegmentCount);
+    memcpy(prog->dataSegments.data(), p, hdr.dataSegmentCount * sizeof(DataSegment));
+    p += hdr.dataSegmentCount * sizeof(DataSegment);
+    prog->data.resize(hdr.dataWords);
+    memcpy(prog->data.data(), p, hdr.dataWords * sizeof(int32_t));
+    for (const DataSegment &seg : prog->dataSegments) {
+        if ((uint64_t)seg.first + seg.count > hdr.dataWords) return nullptr;
+    }
+
+    // reject anything that would index outside the program, the register
+    // file or the handler tables
+    const Program &view = *prog;
+    for (size_t i = 0; i < view.instrs.size(); i++) {
+        const Instruction &ins = view.instrs[i];
+        if (view.sourceLines[i] >= hdr.stringCount || ins.label >= hdr.stringCount) return nullptr;
+        if (ins.op > OP_UNKNOWN || (uint8_t)ins.rs >= 32 || (uint8_t)ins.rt >= 32 || (uint8_t)ins.rd >= 32) return nullptr;
+        if (ins.target < -2 || (ins.target >= 0 && (uint32_t)ins.target >= hdr.instrCount)) return nullptr;
+    }
+    return prog;
+}
+
+// -------------------------------------------------------------------
+// =================== Final-State Images ============================
+// -------------------------------------------------------------------
+// A binary form of the final state, for checking many runs against
+// expected results without printing and re-reading text. The file is
+// built in memory and written with one write; readers map it and
+// compare in place. Layout (host order):
+//   StateImageHeader
+//   StateImagePage[pageCount]     sorted by page number; words that were
+//                                 never stored are 0 and their bit clear
+//   { uint32 addr; int32 value } unaligned[unalignedCount], sorted
+static const char STATE_IMAGE_MAGIC[8] = {'M','I','P','S','S','T','1','\n'};
+
+struct StateImageHeader {
+    char     magic[8];
+    uint32_t pc;
+    uint32_t pageCount;
+    uint64_t cycles;
+    int32_t  regs[32];
+    uint32_t unalignedCount;
+    uint32_t reserved;
+};
+
+struct StateImagePage {
+    uint32_t page;           // address >> 12
+    uint32_t reserved;
+    uint64_t present[MemoryPage::WORDS / 64];
+    int32_t  words[MemoryPage::WORDS];
+};
+
+#ifndef MIPS_NO_MAIN
+// -------------------------------------------------------------------
+// FirstDifferentWord: the first i < n with a[i] != b[i], or n. Compares
+// 16 (AVX-512), 8 (AVX2) or 4 (SSE2) words per step.
+// -------------------------------------------------------------------
+static size_t FirstDifferentWord(const int32_t *a, const int32_t *b, size_t n) {
+    size_t i = 0;
+#if defined(__AVX512F__)
+    for (; i + 16 <= n; i += 16) {
+        uint32_t ne = _mm512_cmpneq_epi32_mask(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+        if (ne) return i + __builtin_ctz(ne);
+    }
+#elif defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(a + i)),
+                                        _mm256_loadu_si256((const __m256i*)(b + i)));
+        uint32_t ne = ~(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(eq)) & 0xFF;
+        if (ne) return i + __builtin_ctz(ne);
+    }
+#elif defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(a + i)),
+                                     _mm_loadu_si128((const __m128i*)(b + i)));
+        uint32_t ne = ~(uint32_t)_mm_movemask_ps(_mm_castsi128_ps(eq)) & 0xF;
+        if (ne) return i + __builtin_ctz(ne);
+    }
+#endif
+    for (; i < n; i++) if (a[i] != b[i]) return i;
+    return n;
+}
+
+// -------------------------------------------------------------------
+// StateImage: a mapped final-state image, checked when it is opened
+// -------------------------------------------------------------------
+class StateImage {
+public:
+    bool Open(const string &path, string &error) {
+        if (!file.Open(path)) {
+            error = "cannot open " + path;
+            return false;
+        }
+        if (file.Size() < sizeof(StateImageHeader) ||
+            memcmp(file.Data(), STATE_IMAGE_MAGIC, sizeof(STATE_IMAGE_MAGIC)) != 0) {
+            error = path + " is not a state image";
+            return false;
+        }
+        header = (const StateImageHeader*)file.Data();
+        pages = (const StateImagePage*)(header + 1);
+        unaligned = (const pair<uint32_t,int32_t>*)(pages + header->pageCount);
+        uint64_t expected = sizeof(StateImageHeader) + (uint64_t)header->pageCount * sizeof(StateImagePage) +
+                            (uint64_t)header->unalignedCount * sizeof(pair<uint32_t,int32_t>);
+        if (file.Size() != expected) {
+            error = path + " is cut short or damaged";
+            return false;
+        }
+        for (uint32_t i = 1; i < header->pageCount; i++) {
+            if (pages[i].page <= pages[i - 1].page) {
+                error = path + " has its pages out of order";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const StateImageHeader &Header() const { return *header; }
+    const StateImagePage *Pages() const { return pages; }
+    const pair<uint32_t,int32_t> *Unaligned() const { return unaligned; }
+
+private:
+    MappedFile file;
+    const StateImageHeader *header = nullptr;
+    const StateImagePage *pages = nullptr;
+    const pair<uint32_t,int32_t> *unaligned = nullptr;
+};
+static_assert(sizeof(pair<uint32_t,int32_t>) == 8, "unaligned entries are two words");
+
+// -------------------------------------------------------------------
+// CompareStateImages: "" if the two states are the same, otherwise the
+// first difference: the PC, then the registers, then memory by address
+// (a word stored in one state only counts, even if it holds 0), then
+// the cycle count.
+// -------------------------------------------------------------------
+static string CompareStateImages(const StateImage &a, const StateImage &b) {
+    const StateImageHeader &ha = a.Header(), &hb = b.Header();
+    ostringstream diff;
+    diff << hex << uppercase;
+    if (ha.pc != hb.pc) {
+        diff << "pc: 0x" << ha.pc << " vs 0x" << hb.pc;
+        return diff.str();
+    }
+    size_t r = FirstDifferentWord(ha.regs, hb.regs, 32);
+    if (r < 32) {
+        diff << "register " << REGISTER_NAMES[r] << ": 0x" << (uint32_t)ha.regs[r] << " vs 0x" << (uint32_t)hb.regs[r];
+        return diff.str();
+    }
+
+    // First differing word-aligned address, walking both page lists
+    uint64_t firstAddr = UINT64_MAX;
+    const char *onlyIn = nullptr;           // set if that word is stored in one image only
+    int32_t va = 0, vb = 0;
+    const StateImagePage *pa = a.Pages(), *pb = b.Pages();
+    const StateImagePage *ea = pa + ha.pageCount, *eb = pb + hb.pageCount;
+    auto firstPresent = [](const StateImagePage &p) {
+        for (uint32_t w = 0; w < MemoryPage::WORDS / 64; w++) {
+            if (p.present[w]) return w * 64 + (uint32_t)__builtin_ctzll(p.present[w]);
+        }
+        return MemoryPage::WORDS;
+    };
+    while ((pa != ea || pb != eb) && firstAddr == UINT64_MAX) {
+        if (pb == eb || (pa != ea && pa->page < pb->page)) {
+            uint32_t slot = firstPresent(*pa);
+            if (slot < MemoryPage::WORDS) {
+                firstAddr = (uint64_t)pa->page << 12 | slot << 2;
+                onlyIn = "first";
+                va = pa->words[slot];
+            }
+            pa++;
+        } else if (pa == ea || pb->page < pa->page) {
+            uint32_t slot = firstPresent(*pb);
+            if (slot < MemoryPage::WORDS) {
+                firstAddr = (uint64_t)pb->page << 12 | slot << 2;
+                onlyIn = "second";
+                vb = pb->words[slot];
+            }
+            pb++;
+        } else {
+            uint32_t slot = (uint32_t)FirstDifferentWord(pa->words, pb->words, MemoryPage::WORDS);
+            for (uint32_t w = 0; w < MemoryPage::WORDS / 64; w++) {
+                uint64_t x = pa->present[w] ^ pb->present[w];
+                if (x) {
+                    slot = min(slot, w * 64 + (uint32_t)__builtin_ctzll(x));
+                    break;
+                }
+            }
+            if (slot < MemoryPage::WORDS) {
+                uint64_t bit = 1ull << (slot % 64);
+                bool inA = pa->present[slot / 64] & bit, inB = pb->present[slot / 64] & bit;
+                firstAddr = (uint64_t)pa->page << 12 | slot << 2;
+                onlyIn = inA == inB ? nullptr : inA ? "first" : "second";
+                va = pa->words[slot];
+                vb = pb->words[slot];
+            }
+            pa++;
+            pb++;
+        }
+    }
+
+    // The unaligned words, sorted in both images
+    const pair<uint32_t,int32_t> *ua = a.Unaligned(), *ub = b.Unaligned();
+    const pair<uint32_t,int32_t> *uae = ua + ha.unalignedCount, *ube = ub + hb.unalignedCount;
+    auto head = [](const pair<uint32_t,int32_t> *u, const pair<uint32_t,int32_t> *end) {
+        return u == end ? UINT64_MAX : (uint64_t)u->first;
+    };
+    while (min(head(ua, uae), head(ub, ube)) < firstAddr) {
+        if (ua != uae && ub != ube && ua->first == ub->first) {
+            if (ua->second != ub->second) {
+                firstAddr = ua->first;
+                onlyIn = nullptr;
+                va = ua->second;
+                vb = ub->second;
+                break;
+            }
+            ua++;
+            ub++;
+        } else {
+            bool inA = ub == ube || (ua != uae && ua->first < ub->first);
+            firstAddr = inA ? ua->first : ub->first;
+            onlyIn = inA ? "first" : "second";
+            va = inA ? ua->second : 0;
+            vb = inA ? 0 : ub->second;
+            break;
+        }
+    }
+
+    if (firstAddr != UINT64_MAX) {
+        diff << "memory 0x" << firstAddr << ": ";
+        if (onlyIn) diff << "stored in the " << onlyIn << " state only (0x" << (uint32_t)(va | vb) << ")";
+        else        diff << "0x" << (uint32_t)va << " vs 0x" << (uint32_t)vb;
+        return diff.str();
+    }
+    if (ha.cycles != hb.cycles) {
+        diff << dec << "cycles: " << ha.cycles << " vs " << hb.cycles;
+        return diff.str();
+    }
+    return "";
+}
+
+// -------------------------------------------------------------------
+// LoadStatePairs: "<a> <b>" per line (blank lines and # comments skipped)
+// -------------------------------------------------------------------
+static bool LoadStatePairs(const string &filename, vector<pair<string,string>> &pairs) {
+    ifstream fin(filename);
+    if (!fin.is_open()) {
+        cerr << "Cannot open " << filename << "\n";
+        return false;
+    }
+    string line;
+    for (int lineNo = 1; getline(fin, line); lineNo++) {
+        istringstream words(line);
+        string a, b, extra;
+        if (!(words >> a) || a[0] == '#') continue;
+        if (!(words >> b) || (words >> extra)) {
+            cerr << filename << ":" << lineNo << ": expected two state images\n";
+            return false;
+        }
+        pairs.push_back({a, b});
+    }
+    return true;
+}
+
+// -------------------------------------------------------------------
+// CompareStatePairs: compares every pair on 'threads' threads and prints
+// one line per pair that differs or cannot be read, in list order.
+// Returns the exit code: 1 if an image could not be read, else 2 if a
+// pair differs, else 0.
+// -------------------------------------------------------------------
+static int CompareStatePairs(const vector<pair<string,string>> &pairs, unsigned threads, ostream &out) {
+    vector<string> results(pairs.size());
+    vector<char> failed(pairs.size(), 0);
+    atomic<size_t> next{0};
+    auto work = [&] {
+        for (size_t i; (i = next++) < pairs.size(); ) {
+            StateImage a, b;
+            string error;
+            if (!a.Open(pairs[i].first, error) || !b.Open(pairs[i].second, error)) {
+                results[i] = error;
+                failed[i] = 1;
+            } else {
+                results[i] = CompareStateImages(a, b);
+            }
+        }
+    };
+    threads = (unsigned)max<size_t>(1, min<size_t>(threads, pairs.size()));
+    vector<thread> workers;
+    for (unsigned t = 1; t < threads; t++) workers.emplace_back(work);
+    work();
+    for (thread &t : workers) t.join();
+
+    size_t differ = 0, errors = 0;
+    for (size_t i = 0; i < pairs.size(); i++) {
+        if (results[i].empty()) continue;
+        (failed[i] ? errors : differ)++;
+        out << pairs[i].first << " " << pairs[i].second << ": " << (failed[i] ? "error: " : "") << results[i] << "\n";
+    }
+    if (pairs.size() > 1) {
+        cerr << dec << pairs.size() << " pairs compared, " << differ << " differ, " << errors << " could not be read\n";
+    }
+    return errors ? 1 : differ ? 2 : 0;
+}
+#endif
+
+// -------------------------------------------------------------------
+// =================== Commit Trace ==================================
+// -------------------------------------------------------------------
+// One record per executed cycle with what the cycle did to the
+// architectural state: the PC it ran at, the register it wrote (if any)
+// and the memory word it wrote (if any). Used to compare a run against a
+// known-good reference run cycle by cycle.
+//
+// Text form, one line per cycle (values in hex):
+//     <cycle> <pc> [r<reg>=<value>] [m<addr>=<value>]
+// Binary form: the 8-byte magic "MIPSCTR1" followed by raw CommitRecords.
+struct CommitRecord {
+    uint64_t cycle=0;
+    uint32_t pc=0;
+    uint8_t  flags=0;      // HAS_REG | HAS_MEM
+    uint8_t  reg=0;
+    uint16_t pad=0;
+    int32_t  regValue=0;
+    uint32_t memAddr=0;
+    int32_t  memValue=0;
+    uint32_t pad2=0;
+
+    static const uint8_t HAS_REG = 1, HAS_MEM = 2;
+};
+static_assert(sizeof(CommitRecord) == 32, "CommitRecord is written to disk as-is");
+
+static const char COMMIT_TRACE_MAGIC[8] = {'M','I','P','S','C','T','R','1'};
+static const char COMMIT_TEXT_HEADER[] = "# mips commit trace v1: cycle pc [rN=value] [mADDR=value]\n";
+
+// -------------------------------------------------------------------
+// ParseCommitLine: one line of the text form; false if it is malformed
+// -------------------------------------------------------------------
+// A field must be a whole number in the given base that fits in 32 bits.
+static bool ParseCommitField(const string &text, int base, uint32_t &value) {
+    if (text.empty() || !isxdigit((unsigned char)text[0])) return false;
+    errno = 0;
+    char *end = nullptr;
+    unsigned long long v = strtoull(text.c_str(), &end, base);
+    if (errno != 0 || *end != '\0' || v > 0xFFFFFFFFull) return false;
+    value = (uint32_t)v;
+    return true;
+}
+
+static bool ParseCommitLine(const string &line, CommitRecord &rec) {
+    rec = CommitRecord();
+    istringstream iss(line);
+    string tok;
+    if (!(iss >> dec >> rec.cycle >> hex >> rec.pc)) return false;
+    while (iss >> tok) {
+        auto eq = tok.find('=');
+        if (tok.size() < 2 || eq == string::npos) return false;
+        uint32_t value, field;
+        if (!ParseCommitField(tok.substr(eq + 1), 16, value)) return false;
+        if (tok[0] == 'r') {
+            if (!ParseCommitField(tok.substr(1, eq - 1), 10, field) || field >= 32) return false;
+            rec.flags |= CommitRecord::HAS_REG;
+            rec.reg = (uint8_t)field;
+            rec.regValue = (int32_t)value;
+        } else if (tok[0] == 'm') {
+            if (!ParseCommitField(tok.substr(1, eq - 1), 16, field)) return false;
+            rec.flags |= CommitRecord::HAS_MEM;
+            rec.memAddr = field;
+            rec.memValue = (int32_t)value;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// -------------------------------------------------------------------
+// Trace index, "<trace>.idx": lets TraceQuery answer "what was X at cycle
+// N" and "every write to address A" without reading the whole trace.
+// Layout:
+//   TraceIndexHeader
+//   TraceKeyframe[keyframeCount]   the state after every interval-th
+//                                  cycle and the trace offset of that
+//                                  cycle's record
+//   TraceWrite[writeCount]         every memory write, sorted by
+//                                  address, then cycle
+// The write log cannot be kept in memory for a long run, so it is
+// written in sorted runs to temporary files and merged at the end.
+// -------------------------------------------------------------------
+static const char TRACE_INDEX_MAGIC[8] = {'M','I','P','S','I','D','X','1'};
+
+struct TraceIndexHeader {
+    char     magic[8];
+    uint64_t interval;
+    uint64_t keyframeCount;
+    uint64_t writeCount;
+    uint64_t lastCycle;
+    uint64_t pad[3];
+};
+static_assert(sizeof(TraceIndexHeader) == 64, "index header is one cache line");
+
+struct TraceKeyframe {
+    uint64_t cycle;
+    uint64_t offset;         // of the trace record of 'cycle'
+    uint32_t pc;             // the PC after 'cycle'
+    int32_t  regs[32];
+    uint32_t pad;
+};
+static_assert(sizeof(TraceKeyframe) == 152, "keyframes are written to disk as-is");
+
+struct TraceWrite {
+    uint32_t addr;
+    int32_t  value;
+    uint64_t cycle;
+
+    bool operator<(const TraceWrite &o) const {
+        return addr != o.addr ? addr < o.addr : cycle < o.cycle;
+    }
+};
+static_assert(sizeof(TraceWrite) == 16, "write log entries are written to disk as-is");
+
+class TraceIndexWriter {
+public:
+    ~TraceIndexWriter() { Finish(); }
+
+    bool Open(const string &filename, uint64_t keyframeEvery) {
+        path = filename;
+        out.open(path, ios::binary);
+        if (!out.is_open()) return false;
+        interval = keyframeEvery ? keyframeEvery : 1;
+        TraceIndexHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        out.write((const char*)&hdr, sizeof(hdr));   // filled in by Finish
+        return true;
+    }
+
+    // Called for every record, with the state the cycle left behind and
+    // the trace offset the record was written at
+    void Add(const CommitRecord &rec, uint32_t pc, const int32_t *regs, uint64_t offset) {
+        if (!out.is_open()) return;
+        if (keyframes == 0 || rec.cycle - lastKey >= interval) {
+            TraceKeyframe key;
+            memset(&key, 0, sizeof(key));
+            key.cycle = rec.cycle;
+            key.offset = offset;
+            key.pc = pc;
+            memcpy(key.regs, regs, sizeof(key.regs));
+            out.write((const char*)&key, sizeof(key));
+            keyframes++;
+            lastKey = rec.cycle;
+        }
+        if (rec.flags & CommitRecord::HAS_MEM) {
+            run.push_back(TraceWrite{rec.memAddr, rec.memValue, rec.cycle});
+            if (run.size() >= RUN_ENTRIES) SpillRun();
+        }
+        lastCycle = rec.cycle;
+    }
+
+    // Merges the write runs onto the end of the index and fills in the header
+    bool Finish() {
+        if (!out.is_open()) return true;
+        sort(run.begin(), run.end());
+        uint64_t writes = 0;
+        if (runFiles.empty()) {
+            out.write((const char*)run.data(), run.size() * sizeof(TraceWrite));
+            writes = run.size();
+        } else {
+            SpillRun();
+            writes = MergeRuns();
+        }
+        run.clear();
+        run.shrink_to_fit();
+
+        TraceIndexHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, TRACE_INDEX_MAGIC, sizeof(hdr.magic));
+        hdr.interval = interval;
+        hdr.keyframeCount = keyframes;
+        hdr.writeCount = writes;
+        hdr.lastCycle = lastCycle;
+        out.seekp(0);
+        out.write((const char*)&hdr, sizeof(hdr));
+        out.close();
+        return !out.fail();
+    }
+
+private:
+    static const size_t RUN_ENTRIES = 1 << 20;     // 16 MB of writes per sorted run
+
+    void SpillRun() {
+        if (run.empty()) return;
+        sort(run.begin(), run.end());
+        string name = path + ".run" + to_string(runFiles.size());
+        ofstream tmp(name, ios::binary);
+        tmp.write((const char*)run.data(), run.size() * sizeof(TraceWrite));
+        runFiles.push_back(name);
+        run.clear();
+    }
+
+    // k-way merge of the sorted runs, each read through a small buffer
+    uint64_t MergeRuns() {
+        struct Source {
+            ifstream in;
+            vector<TraceWrite> buf;
+            size_t pos=0;
+            bool Refill() {
+                buf.resize(4096);
+                in.read((char*)buf.data(), buf.size() * sizeof(TraceWrite));
+                buf.resize((size_t)in.gcount() / sizeof(TraceWrite));
+                pos = 0;
+                return !buf.empty();
+            }
+        };
+        vector<Source> sources(runFiles.size());
+        auto later = [&](size_t a, size_t b) { return sources[b].buf[sources[b].pos] < sources[a].buf[sources[a].pos]; };
+        vector<size_t> heap;
+        for (size_t i = 0; i < runFiles.size(); i++) {
+            sources[i].in.open(runFiles[i], ios::binary);
+            if (sources[i].Refill()) heap.push_back(i);
+        }
+        make_heap(heap.begin(), heap.end(), later);
+
+        vector<TraceWrite> merged;
+        merged.reserve(4096);
+        uint64_t total = 0;
+        while (!heap.empty()) {
+            pop_heap(heap.begin(), heap.end(), later);
+            Source &src = sources[heap.back()];
+            merged.push_back(src.buf[src.pos++]);
+            if (src.pos < src.buf.size() || src.Refill()) push_heap(heap.begin(), heap.end(), later);
+            else heap.pop_back();
+            if (merged.size() == merged.capacity()) {
+                out.write((const char*)merged.data(), merged.size() * sizeof(TraceWrite));
+                total += merged.size();
+                merged.clear();
+            }
+        }
+        out.write((const char*)merged.data(), merged.size() * sizeof(TraceWrite));
+        total += merged.size();
+        for (auto &name : runFiles) remove(name.c_str());
+        runFiles.clear();
+        return total;
+    }
+
+    string path;
+    ofstream out;
+    uint64_t interval=1, keyframes=0, lastKey=0, lastCycle=0;
+    vector<TraceWrite> run;
+    vector<string> runFiles;
+};
+
+// Writes the trace; the binary form is used when the file name ends in
+// ".bin". With an index interval it also writes "<file>.idx".
+class CommitTraceWriter {
+public:
+    bool Open(const string &filename, uint64_t indexEvery = 0) {
+        binary = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".bin") == 0;
+        out.open(filename, binary ? ios::binary : ios::out);
+        if (!out.is_open()) return false;
+        if (binary) {
+            out.write(COMMIT_TRACE_MAGIC, sizeof(COMMIT_TRACE_MAGIC));
+            offset = sizeof(COMMIT_TRACE_MAGIC);
+        } else {
+            out << COMMIT_TEXT_HEADER;
+            offset = sizeof(COMMIT_TEXT_HEADER) - 1;
+        }
+        if (indexEvery && !index.Open(filename + ".idx", indexEvery)) return false;
+        indexed = indexEvery != 0;
+        return true;
+    }
+    // 'pc' and 'regs' are the state after the cycle, for the index
+    void Write(const CommitRecord &rec, uint32_t pc, const int32_t *regs) {
+        MIPS_PHASE(PH_WRITE);
+        uint64_t at = offset;
+        if (binary) {
+            out.write((const char*)&rec, sizeof(rec));
+            offset += sizeof(rec);
+        } else {
+            line.clear();
+            char num[32];
+            snprintf(num, sizeof(num), "%llu %x", (unsigned long long)rec.cycle, rec.pc);
+            line += num;
+            if (rec.flags & CommitRecord::HAS_REG) {
+                snprintf(num, sizeof(num), " r%d=%x", (int)rec.reg, (uint32_t)rec.regValue);
+                line += num;
+            }
+            if (rec.flags & CommitRecord::HAS_MEM) {
+                snprintf(num, sizeof(num), " m%x=%x", rec.memAddr, (uint32_t)rec.memValue);
+                line += num;
+            }
+            line += '\n';
+            out.write(line.data(), line.size());
+            offset += line.size();
+        }
+        if (indexed) index.Add(rec, pc, regs, at);
+    }
+private:
+    ofstream out;
+    bool binary=false, indexed=false;
+    uint64_t offset=0;
+    string line;
+    TraceIndexWriter index;
+};
+
+// Reads a trace one record at a time (either form, detected from the
+// first bytes), so a reference trace of any length is never held in memory.
+class CommitTraceReader {
+public:
+    bool Open(const string &filename) {
+        in.open(filename, ios::binary);
+        if (!in.is_open()) return false;
+        char magic[sizeof(COMMIT_TRACE_MAGIC)] = {0};
+        in.read(magic, sizeof(magic));
+        binary = in.gcount() == (streamsize)sizeof(magic) && memcmp(magic, COMMIT_TRACE_MAGIC, sizeof(magic)) == 0;
+        if (!binary) {
+            in.clear();
+            in.seekg(0);
+        }
+        return true;
+    }
+    // false at the end of the trace or on a line that cannot be parsed;
+    // BadLine() then tells the two apart
+    bool Next(CommitRecord &rec) {
+        rec = CommitRecord();
+        if (binary) {
+            return (bool)in.read((char*)&rec, sizeof(rec));
+        }
+        string line;
+        while (getline(in, line)) {
+            lineNo++;
+            if (line.empty() || line[0] == '#') continue;
+            if (ParseCommitLine(line, rec)) return true;
+            badLine = lineNo;
+            return false;
+        }
+        return false;
+    }
+    uint64_t BadLine() const { return badLine; }    // 0 if none
+private:
+    ifstream in;
+    bool binary=false;
+    uint64_t lineNo=0, badLine=0;
+};
+
+// -------------------------------------------------------------------
+// =================== Delta Trace ===================================
+// -------------------------------------------------------------------
+// A compact replacement for the text cycle printout. Every N cycles a
+// keyframe holds the full state (PC, 32 registers, all stored memory);
+// the printed cycles in between only hold what changed since the
+// previous record, plus the Monitors block (which is per-instruction
+// anyway). The final state is one more full record. ReconstructDeltaTrace
+// turns the file back into the normal text output.
+//
+// Layout: magic "MIPSDLT1", varint keyframe interval, then records that
+// start with a tag byte ('K' keyframe, 'D' delta, 'F' final state).
+// All numbers are LEB128 varints.
+static const char DELTA_TRACE_MAGIC[8] = {'M','I','P','S','D','L','T','1'};
+
+// -------------------------------------------------------------------
+// ChangedRegisterMask: bit i is set when a[i] != b[i] (32 registers).
+// Uses 4 AVX2 or 8 SSE2 compares instead of 32 scalar ones.
+// -------------------------------------------------------------------
+static inline uint32_t ChangedRegisterMask(const int32_t *a, const int32_t *b) {
+#if defined(__AVX2__)
+    uint32_t same = 0;
+    for (int i = 0; i < 4; i++) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + 8 * i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + 8 * i));
+        same |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(x, y))) << (8 * i);
+    }
+    return ~same;
+#elif defined(__SSE2__)
+    uint32_t same = 0;
+    for (int i = 0; i < 8; i++) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + 4 * i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + 4 * i));
+        same |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(x, y))) << (4 * i);
+    }
+    return ~same;
+#else
+    uint32_t changed = 0;
+    for (int i = 0; i < 32; i++) if (a[i] != b[i]) changed |= 1u << i;
+    return changed;
+#endif
+}
+
+static inline void PutVarint(string &buf, uint64_t v) {
+    while (v >= 0x80) {
+        buf.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    buf.push_back((char)v);
+}
+
+class DeltaTraceWriter {
+public:
+    bool Open(const string &filename, uint64_t keyframeEvery) {
+        out.open(filename, ios::binary);
+        if (!out.is_open()) return false;
+        interval = keyframeEvery ? keyframeEvery : 1;
+        string hdr(DELTA_TRACE_MAGIC, sizeof(DELTA_TRACE_MAGIC));
+        PutVarint(hdr, interval);
+        out.write(hdr.data(), hdr.size());
+        return true;
+    }
+
+    // One printed cycle. 'dirty' holds the addresses stored to since the
+    // previous record; 'monitors' is the formatted Monitors block.
+    void WriteCycle(uint64_t cycle, uint32_t pc, const int32_t *regs, const SparseMem &mem,
+                    const unordered_set<uint32_t> &dirty, const string &monitors) {
+        buf.clear();
+        if (!haveKey || cycle - lastKey >= interval) {
+            buf.push_back('K');
+            PutVarint(buf, cycle);
+            PutFullState(pc, regs, mem);
+            lastKey = cycle;
+            haveKey = true;
+        } else {
+            buf.push_back('D');
+            PutVarint(buf, cycle - lastCycle);
+            PutVarint(buf, pc);
+            uint32_t changed = ChangedRegisterMask(regs, prevRegs);
+            PutVarint(buf, changed);
+            for (uint32_t m = changed; m; m &= m - 1) PutVarint(buf, (uint32_t)regs[__builtin_ctz(m)]);
+
+            // each dirty address with its current value
+            PutVarint(buf, dirty.size());
+            for (uint32_t a : dirty) {
+                PutVarint(buf, a);
+                PutVarint(buf, (uint32_t)mem.Load(a));
+            }
+        }
+        PutVarint(buf, monitors.size());
+        buf += monitors;
+        MIPS_PHASE(PH_WRITE);
+        out.write(buf.data(), buf.size());
+
+        memcpy(prevRegs, regs, sizeof(prevRegs));
+        lastCycle = cycle;
+    }
+
+    void WriteFinal(uint64_t cycles, uint32_t pc, const int32_t *regs, const SparseMem &mem) {
+        buf.clear();
+        buf.push_back('F');
+        PutVarint(buf, cycles);
+        PutFullState(pc, regs, mem);
+        MIPS_PHASE(PH_WRITE);
+        out.write(buf.data(), buf.size());
+    }
+
+private:
+    void PutFullState(uint32_t pc, const int32_t *regs, const SparseMem &mem) {
+        PutVarint(buf, pc);
+        for (int i = 0; i < 32; i++) PutVarint(buf, (uint32_t)regs[i]);
+        PutVarint(buf, mem.Size());
+        mem.ForEach([&](uint32_t addr, int32_t value) {
+            PutVarint(buf, addr);
+            PutVarint(buf, (uint32_t)value);
+        });
+    }
+
+    ofstream out;
+    string buf;
+    uint64_t interval=1, lastKey=0, lastCycle=0;
+    bool haveKey=false;
+    int32_t prevRegs[32] = {0};
+};
+
+// -------------------------------------------------------------------
+// =================== Breakpoints and Watchpoints ===================
+// -------------------------------------------------------------------
+// A breakpoint stops the run, a watchpoint prints the cycle into the
+// output and keeps going. Both are written as a small expression and
+// compiled once into bytecode for a little stack machine.
+//
+//   at <label|address> [if <cond>]   fires when that instruction executes
+//   write <address> [if <cond>]      fires when that memory word is stored to
+//   write $reg [if <cond>]           fires when that register is written
+//   <cond>                           fires when <cond> becomes true
+//
+// <cond> is a C-like expression over numbers, labels (their PC), $regs,
+// mem[addr], pc (of the instruction that just ran), cycle and hits (how
+// often the trigger has fired, including now), with ! - & + - < <= > >=
+// == != && || and parentheses. Examples:
+//   "$t0 < 0"     "write 0x10008010"     "at loop if hits > 1000"
+//
+// Each predicate is indexed under what can change its outcome (its PC,
+// its address, its register, or every register/word the condition
+// reads), so a cycle only evaluates the predicates its own register
+// write or store can affect.
+enum PredicateOp : uint8_t {
+    P_IMM, P_REG, P_PC, P_CYCLE, P_HITS, P_MEM,
+    P_NEG, P_NOT, P_ADD, P_SUB, P_AND,
+    P_LT, P_LE, P_GT, P_GE, P_EQ, P_NE, P_LAND, P_LOR
+};
+
+struct PredicateInstr {
+    uint8_t op;
+    int32_t arg;
+};
+
+struct Predicate {
+    enum Trigger : uint8_t { AT_PC, WRITE_MEM, WRITE_REG, BECOMES_TRUE };
+
+    string text;                    // as the user wrote it
+    bool isBreak=false;
+    Trigger trigger=BECOMES_TRUE;
+    uint32_t where=0;               // PC, address or register of the trigger
+    vector<PredicateInstr> code;    // empty = always true
+    uint64_t hits=0;
+    bool lastValue=false;           // BECOMES_TRUE only fires on false -> true
+    uint64_t evaluatedAt=0;         // cycle of the last evaluation
+
+    // What the condition reads, used to index BECOMES_TRUE predicates
+    vector<int> regsRead;
+    vector<uint32_t> addrsRead;
+    bool readsAnyAddr=false;        // mem[...] with a computed address
+    bool readsPcOrCycle=false;
+};
+
+// RunPredicate's stack; the compiler rejects code that would need more
+static const int PREDICATE_STACK = 64;
+
+// The values a condition can read
+struct PredicateContext {
+    const int32_t *regs;
+    const SparseMem *mem;
+    uint32_t pc;
+    uint64_t cycle;
+    uint64_t hits;
+};
+
+static int64_t RunPredicate(const vector<PredicateInstr> &code, const PredicateContext &ctx) {
+    int64_t stack[PREDICATE_STACK];
+    int sp = 0;
+    for (const PredicateInstr &ins : code) {
+        switch (ins.op) {
+        case P_IMM:   stack[sp++] = ins.arg; break;
+        case P_REG:   stack[sp++] = ctx.regs[ins.arg]; break;
+        case P_PC:    stack[sp++] = ctx.pc; break;
+        case P_CYCLE: stack[sp++] = (int64_t)ctx.cycle; break;
+        case P_HITS:  stack[sp++] = (int64_t)ctx.hits; break;
+        case P_MEM: {
+            stack[sp - 1] = ctx.mem->Load((uint32_t)stack[sp - 1]);
+            break;
+        }
+        case P_NEG:   stack[sp - 1] = -stack[sp - 1]; break;
+        case P_NOT:   stack[sp - 1] = !stack[sp - 1]; break;
+        default: {
+            int64_t b = stack[--sp], a = stack[sp - 1], r = 0;
+            switch (ins.op) {
+            case P_ADD:  r = a + b; break;
+            case P_SUB:  r = a - b; break;
+            case P_AND:  r = a & b; break;
+            case P_LT:   r = a < b; break;
+            case P_LE:   r = a <= b; break;
+            case P_GT:   r = a > b; break;
+            case P_GE:   r = a >= b; break;
+            case P_EQ:   r = a == b; break;
+            case P_NE:   r = a != b; break;
+            case P_LAND: r = a && b; break;
+            case P_LOR:  r = a || b; break;
+            }
+            stack[sp - 1] = r;
+        }
+        }
+    }
+    return sp ? stack[sp - 1] : 1;
+}
+
+// -------------------------------------------------------------------
+// PredicateCompiler: recursive-descent parser that emits the bytecode.
+// Errors are reported through 'error' (the first one wins).
+// -------------------------------------------------------------------
+class PredicateCompiler {
+public:
+    typedef int (*RegisterLookup)(const string &name);
+
+    PredicateCompiler(const Program &program, RegisterLookup regs) : prog(program), lookupReg(regs) {}
+
+    bool Compile(const string &spec, bool isBreak, Predicate &pred, string &err) {
+        pred = Predicate();
+        pred.text = spec;
+        pred.isBreak = isBreak;
+        error.clear();
+        Tokenize(spec);
+        pos = 0;
+        nesting = 0;
+
+        if (Peek() == "at" || Peek() == "write") {
+            string kind = Next();
+            string what = Next();
+            if (kind == "at") {
+                pred.trigger = Predicate::AT_PC;
+                int64_t pc = 0;
+                if (!LabelOrNumber(what, pc)) Fail("unknown label or address '" + what + "'");
+                pred.where = (uint32_t)pc;
+            } else if (!what.empty() && what[0] == '$') {
+                pred.trigger = Predicate::WRITE_REG;
+                int r = lookupReg(what);
+                if (r < 0) Fail("unknown register '" + what + "'");
+                pred.where = (uint32_t)r;
+            } else {
+                pred.trigger = Predicate::WRITE_MEM;
+                int64_t addr = 0;
+                if (!Number(what, addr)) Fail("expected an address after 'write', got '" + what + "'");
+                pred.where = (uint32_t)addr;
+            }
+            if (Peek() == "if") {
+                Next();
+                Expression(pred);
+            }
+        } else {
+            pred.trigger = Predicate::BECOMES_TRUE;
+            Expression(pred);
+            if (pred.regsRead.empty() && pred.addrsRead.empty() && !pred.readsAnyAddr && !pred.readsPcOrCycle) {
+                Fail("the condition never changes");
+            }
+        }
+        if (error.empty() && pos < toks.size()) Fail("unexpected '" + toks[pos] + "'");
+        if (error.empty() && StackDepth(pred.code) > PREDICATE_STACK) Fail("the condition is nested too deeply");
+        err = error;
+        return error.empty();
+    }
+
+private:
+    const Program &prog;
+    RegisterLookup lookupReg;
+    vector<string> toks;
+    size_t pos=0;
+    string error;
+    int nesting=0;      // parentheses and unary operators being parsed, bounds the recursion
+
+    void Fail(const string &msg) { if (error.empty()) error = msg; }
+    const string &Peek() { static const string none; return pos < toks.size() ? toks[pos] : none; }
+    string Next() { return pos < toks.size() ? toks[pos++] : string(); }
+
+    void Tokenize(const string &s) {
+        toks.clear();
+        static const char *twoChar[] = {"<=", ">=", "==", "!=", "&&", "||"};
+        for (size_t i = 0; i < s.size();) {
+            unsigned char c = (unsigned char)s[i];
+            if (isspace(c)) { i++; continue; }
+            if (isalnum(c) || c == '_' || c == '$' || c == '.') {
+                size_t j = i + 1;
+                while (j < s.size() && (isalnum((unsigned char)s[j]) || s[j] == '_' || s[j] == '.')) j++;
+                toks.push_back(s.substr(i, j - i));
+                i = j;
+                continue;
+            }
+            bool two = false;
+            for (const char *op : twoChar) {
+                if (s.compare(i, 2, op) == 0) { toks.push_back(op); i += 2; two = true; break; }
+            }
+            if (!two) toks.push_back(string(1, s[i++]));
+        }
+    }
+
+    static bool Number(const string &t, int64_t &v) {
+        if (t.empty() || !isdigit((unsigned char)t[0])) return false;
+        try {
+            size_t used;
+            v = (int64_t)stoull(t, &used, 0);
+            return used == t.size();
+        } catch (const std::exception &e) {
+            return false;
+        }
+    }
+    bool LabelOrNumber(const string &t, int64_t &v) {
+        if (Number(t, v)) return true;
+        auto it = prog.labelMap.find(t);
+        if (it == prog.labelMap.end()) return false;
+        v = (int64_t)it->second * 4;
+        return true;
+    }
+
+    void Emit(Predicate &p, uint8_t op, int32_t arg = 0) { p.code.push_back({op, arg}); }
+
+    // the most values the code keeps on RunPredicate's stack at once
+    static int StackDepth(const vector<PredicateInstr> &code) {
+        int sp = 0, most = 0;
+        for (const PredicateInstr &ins : code) {
+            if (ins.op <= P_HITS) most = max(most, ++sp);
+            else if (ins.op > P_NOT) sp--;
+        }
+        return most;
+    }
+
+    // precedence, lowest first: || && comparisons + - & unary
+    void Expression(Predicate &p) {
+        if (++nesting > PREDICATE_STACK) {
+            Fail("the condition is nested too deeply");
+            pos = toks.size();
+        } else {
+            And(p);
+            while (Peek() == "||") { Next(); And(p); Emit(p, P_LOR); }
+        }
+        nesting--;
+    }
+    void And(Predicate &p) {
+        Compare(p);
+        while (Peek() == "&&") { Next(); Compare(p); Emit(p, P_LAND); }
+    }
+    void Compare(Predicate &p) {
+        Additive(p);
+        static const pair<const char*, uint8_t> ops[] = {
+            {"<", P_LT}, {"<=", P_LE}, {">", P_GT}, {">=", P_GE}, {"==", P_EQ}, {"!=", P_NE}
+        };
+        for (;;) {
+            uint8_t op = 0xFF;
+            for (auto &o : ops) if (Peek() == o.first) op = o.second;
+            if (op == 0xFF) return;
+            Next();
+            Additive(p);
+            Emit(p, op);
+        }
+    }
+    void Additive(Predicate &p) {
+        BitAnd(p);
+        while (Peek() == "+" || Peek() == "-") {
+            uint8_t op = (Next() == "+") ? P_ADD : P_SUB;
+            BitAnd(p);
+            Emit(p, op);
+        }
+    }
+    void BitAnd(Predicate &p) {
+        Unary(p);
+        while (Peek() == "&") { Next(); Unary(p); Emit(p, P_AND); }
+    }
+    void Unary(Predicate &p) {
+        if (Peek() != "!" && Peek() != "-") {
+            Primary(p);
+            return;
+        }
+        uint8_t op = (Next() == "!") ? P_NOT : P_NEG;
+        if (++nesting > PREDICATE_STACK) {
+            Fail("the condition is nested too deeply");
+            pos = toks.size();
+        } else {
+            Unary(p);
+            Emit(p, op);
+        }
+        nesting--;
+    }
+    void Primary(Predicate &p) {
+        string t = Next();
+        int64_t v;
+        if (t.empty()) {
+            Fail("expression ends too early");
+        } else if (t == "(") {
+            Expression(p);
+            if (Next() != ")") Fail("missing ')'");
+        } else if (t == "mem") {
+            if (Next() != "[") { Fail("expected '[' after mem"); return; }
+            size_t start = p.code.size();
+            Expression(p);
+            if (Next() != "]") Fail("missing ']'");
+            if (p.code.size() == start + 1 && p.code[start].op == P_IMM) {
+                p.addrsRead.push_back((uint32_t)p.code[start].arg);
+            } else {
+                p.readsAnyAddr = true;
+            }
+            Emit(p, P_MEM);
+        } else if (t[0] == '$') {
+            int r = lookupReg(t);
+            if (r < 0) Fail("unknown register '" + t + "'");
+            Emit(p, P_REG, r < 0 ? 0 : r);
+            p.regsRead.push_back(r);
+        } else if (t == "pc") {
+            Emit(p, P_PC);
+            p.readsPcOrCycle = true;
+        } else if (t == "cycle") {
+            Emit(p, P_CYCLE);
+            p.readsPcOrCycle = true;
+        } else if (t == "hits") {
+            Emit(p, P_HITS);
+        } else if (LabelOrNumber(t, v)) {
+            Emit(p, P_IMM, (int32_t)v);
+        } else {
+            Fail("unknown name '" + t + "'");
+        }
+    }
+};
+
+// -------------------------------------------------------------------
+// =================== Block Compression =============================
+// -------------------------------------------------------------------
+// The text of an "all" run repeats itself almost line for line, so an
+// output file whose name ends in .lz is written compressed. The text is
+// cut into blocks of COMPRESS_BLOCK bytes and every block is compressed
+// on its own by a worker thread (LZ77: literal runs and back-references
+// within the block), so any block can be decoded without the ones
+// before it. --decompress turns such a file back into the text.
+//
+// File: COMPRESSED_MAGIC, then per block a CompressedBlockHeader and
+// storedSize bytes (the raw bytes if compressing did not help). A block
+// is a list of sequences: a token byte (literal count in the high
+// nibble, match length - 4 in the low one; 15 means length bytes
+// follow, each adding up to 255), the literals, the match offset as a
+// LEB128 varint, then the match length bytes. The last sequence of a
+// block has literals only.
+
+static const char COMPRESSED_MAGIC[8] = {'M','I','P','S','L','Z','1','\n'};
+static const size_t COMPRESS_BLOCK = 4u << 20;
+static const size_t COMPRESS_MIN_MATCH = 4;
+static const uint32_t BLOCK_STORED = 1;     // CompressedBlockHeader::flags
+
+struct CompressedBlockHeader {
+    uint32_t rawSize;
+    uint32_t storedSize;
+    uint32_t flags;
+    uint32_t checksum;      // low half of HashBytes over the raw bytes
+};
+
+static bool IsCompressedName(const string &filename) {
+    return filename.size() >= 3 && filename.compare(filename.size() - 3, 3, ".lz") == 0;
+}
+
+class BlockCodec {
+public:
+    BlockCodec() : table(HASH_SIZE) {}
+
+    // Appends the compressed form of src[0..n) to out
+    void Compress(const char *src, size_t n, string &out) {
+        fill(table.begin(), table.end(), UINT32_MAX);
+        size_t pos = 0, literalStart = 0;
+        while (pos + COMPRESS_MIN_MATCH <= n) {
+            uint32_t &slot = table[Hash(src + pos)];
+            size_t cand = slot;
+            slot = (uint32_t)pos;
+            if (cand == UINT32_MAX || memcmp(src + cand, src + pos, COMPRESS_MIN_MATCH) != 0) {
+                pos++;
+                continue;
+            }
+            size_t len = COMPRESS_MIN_MATCH;
+            while (pos + len < n && src[cand + len] == src[pos + len]) len++;
+            PutSequence(out, src + literalStart, pos - literalStart, len, pos - cand);
+            // the matched text is the most recent copy of itself from now on
+            size_t end = pos + len;
+            for (pos++; pos < end && pos + COMPRESS_MIN_MATCH <= n; pos++) table[Hash(src + pos)] = (uint32_t)pos;
+            pos = literalStart = end;
+        }
+        PutSequence(out, src + literalStart, n - literalStart, 0, 0);
+    }
+
+    // Decodes one block into dst, which holds rawSize bytes; false if the
+    // data is not a valid block of that size
+    static bool Decompress(const unsigned char *src, size_t n, char *dst, size_t rawSize) {
+        size_t in = 0, at = 0;
+        auto moreLength = [&](size_t &len) {
+            for (;;) {
+                if (in >= n) return false;
+                unsigned char b = src[in++];
+                len += b;
+                if (b != 255) return true;
+            }
+        };
+        while (in < n) {
+            unsigned char token = src[in++];
+            size_t literals = token >> 4, len = token & 15;
+            if (literals == 15 && !moreLength(literals)) return false;
+            if (literals > n - in || literals > rawSize - at) return false;
+            memcpy(dst + at, src + in, literals);
+            in += literals;
+            at += literals;
+            if (in == n) break;                 // the closing literal run
+
+            size_t offset = 0;
+            for (int shift = 0; ; shift += 7) {
+                if (in >= n || shift > 28) return false;
+                unsigned char b = src[in++];
+                offset |= (size_t)(b & 0x7F) << shift;
+                if (!(b & 0x80)) break;
+            }
+            if (len == 15 && !moreLength(len)) return false;
+            len += COMPRESS_MIN_MATCH;
+            if (offset == 0 || offset > at || len > rawSize - at) return false;
+            char *d = dst + at;
+            const char *s = d - offset;
+            if (offset >= len) memcpy(d, s, len);
+            else for (size_t i = 0; i < len; i++) d[i] = s[i];   // overlapping: a repeat
+            at += len;
+        }
+        return at == rawSize;
+    }
+
+private:
+    static const int HASH_BITS = 16;
+    static const size_t HASH_SIZE = size_t(1) << HASH_BITS;
+
+    static uint32_t Hash(const char *p) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return (v * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    static void PutLength(string &out, size_t extra) {
+        for (; extra >= 255; extra -= 255) out.push_back((char)255);
+        out.push_back((char)extra);
+    }
+
+    static void PutSequence(string &out, const char *literals, size_t count, size_t len, size_t offset) {
+        size_t extra = len ? len - COMPRESS_MIN_MATCH : 0;
+        out.push_back((char)((min<size_t>(count, 15) << 4) | min<size_t>(extra, 15)));
+        if (count >= 15) PutLength(out, count - 15);
+        out.append(literals, count);
+        if (!len) return;
+        for (; offset >= 0x80; offset >>= 7) out.push_back((char)(0x80 | (offset & 0x7F)));
+        out.push_back((char)offset);
+        if (extra >= 15) PutLength(out, extra - 15);
+    }
+
+    vector<uint32_t> table;     // hash of 4 bytes -> their last position
+};
+
+// -------------------------------------------------------------------
+// CompressingStreamBuf: the stream buffer behind a .lz output. Full
+// blocks are handed to one worker thread, which compresses and writes
+// them in order while the simulation goes on filling the next one. At
+// most COMPRESS_PENDING blocks wait, so a slow disk holds the run back
+// instead of filling memory.
+// -------------------------------------------------------------------
+class CompressingStreamBuf : public streambuf {
+public:
+    ~CompressingStreamBuf() { Close(); }
+
+    bool Open(const string &filename) {
+        file.open(filename, ios::binary | ios::trunc);
+        if (!file.is_open()) return false;
+        file.write(COMPRESSED_MAGIC, sizeof(COMPRESSED_MAGIC));
+        NewBlock();
+        worker = thread([this] { Work(); });
+        return true;
+    }
+
+    // Writes what is buffered, waits for the worker and closes the file;
+    // false if a write failed
+    bool Close() {
+        if (!worker.joinable()) return !failed;
+        Hand();
+        {
+            lock_guard<mutex> lk(mu);
+            closing = true;
+        }
+        queued.notify_one();
+        worker.join();
+        file.close();
+        if (file.fail()) failed = true;
+        setp(nullptr, nullptr);
+        return !failed;
+    }
+
+protected:
+    int overflow(int ch) override {
+        if (!worker.joinable()) return traits_type::eof();
+        Hand();
+        NewBlock();
+        if (ch != traits_type::eof()) {
+            *pptr() = (char)ch;
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    // A flush does not cut the block short: small blocks compress badly
+    int sync() override { return failed ? -1 : 0; }
+
+private:
+    static const size_t COMPRESS_PENDING = 4;
+
+    void NewBlock() {
+        lock_guard<mutex> lk(mu);
+        if (!spare.empty()) {
+            block = std::move(spare.back());
+            spare.pop_back();
+        }
+        block.resize(COMPRESS_BLOCK);
+        setp(&block[0], &block[0] + block.size());
+    }
+
+    // Queues the filled part of the current block
+    void Hand() {
+        size_t used = pptr() - pbase();
+        if (used == 0) return;
+        block.resize(used);
+        unique_lock<mutex> lk(mu);
+        drained.wait(lk, [this] { return pending.size() < COMPRESS_PENDING; });
+        pending.push_back(std::move(block));
+        block.clear();
+        lk.unlock();
+        queued.notify_one();
+        setp(nullptr, nullptr);
+    }
+
+    void Work() {
+        BlockCodec codec;
+        string packed;
+        for (;;) {
+            unique_lock<mutex> lk(mu);
+            queued.wait(lk, [this] { return closing || !pending.empty(); });
+            if (pending.empty()) return;
+            string raw = std::move(pending.front());
+            pending.pop_front();
+            lk.unlock();
+
+            packed.clear();
+            codec.Compress(raw.data(), raw.size(), packed);
+            CompressedBlockHeader header;
+            header.rawSize = (uint32_t)raw.size();
+            header.flags = packed.size() < raw.size() ? 0 : BLOCK_STORED;
+            const string &stored = header.flags ? raw : packed;
+            header.storedSize = (uint32_t)stored.size();
+            header.checksum = (uint32_t)HashBytes(raw.data(), raw.size());
+            {
+                MIPS_PHASE(PH_WRITE);
+                file.write((const char*)&header, sizeof(header));
+                file.write(stored.data(), stored.size());
+                if (!file) failed = true;
+            }
+
+            lk.lock();
+            spare.push_back(std::move(raw));
+            lk.unlock();
+            drained.notify_one();
+        }
+    }
+
+    ofstream file;
+    string block;                   // being filled by the stream
+    thread worker;
+    mutex mu;
+    condition_variable queued, drained;
+    deque<string> pending;          // full blocks, oldest first
+    vector<string> spare;           // written blocks, reused as buffers
+    bool closing = false;
+    atomic<bool> failed{false};
+};
+
+#ifdef MIPS_PROFILE
+// -------------------------------------------------------------------
+// WriteTimingBuf (profiling builds): collects the text in front of a file
+// and hands it over 64 KB at a time, so the file's own writes count as
+// "write" instead of as the formatting that happened to fill its buffer.
+// -------------------------------------------------------------------
+class WriteTimingBuf : public streambuf {
+public:
+    explicit WriteTimingBuf(streambuf *target) : to(target), buf(1 << 16) { Reset(); }
+
+protected:
+    int overflow(int ch) override {
+        MIPS_PHASE(PH_WRITE);
+        if (!Drain()) return traits_type::eof();
+        if (ch != traits_type::eof()) {
+            *pptr() = (char)ch;
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+    int sync() override {
+        MIPS_PHASE(PH_WRITE);
+        return Drain() && to->pubsync() == 0 ? 0 : -1;
+    }
+
+private:
+    void Reset() { setp(buf.data(), buf.data() + buf.size()); }
+    bool Drain() {
+        streamsize n = pptr() - pbase();
+        bool ok = n == 0 || to->sputn(pbase(), n) == n;
+        Reset();
+        return ok;
+    }
+
+    streambuf *to;
+    vector<char> buf;
+};
+#endif
+
+// -------------------------------------------------------------------
+// OutputFile: a text output file, compressed if its name ends in .lz
+// -------------------------------------------------------------------
+class OutputFile {
+public:
+    bool Open(const string &filename) {
+        compressed = IsCompressedName(filename);
+        if (compressed) {
+            if (!packer.Open(filename)) return false;
+            stream.rdbuf(&packer);
+        } else {
+            plain.open(filename);
+            if (!plain.is_open()) return false;
+#ifdef MIPS_PROFILE
+            timing = make_unique<WriteTimingBuf>(plain.rdbuf());
+            stream.rdbuf(timing.get());
+#else
+            stream.rdbuf(plain.rdbuf());
+#endif
+        }
+        return true;
+    }
+
+    ostream &Stream() { return stream; }
+
+    // false if anything could not be written
+    bool Close() {
+        if (!stream.rdbuf()) return closedOk;
+        closedOk = (bool)stream.flush();
+        stream.rdbuf(nullptr);
+        if (compressed) {
+            closedOk = packer.Close() && closedOk;
+        } else {
+            plain.close();
+            closedOk = !plain.fail() && closedOk;
+        }
+        return closedOk;
+    }
+
+private:
+    bool compressed = false, closedOk = true;
+    ofstream plain;
+#ifdef MIPS_PROFILE
+    unique_ptr<WriteTimingBuf> timing;
+#endif
+    CompressingStreamBuf packer;
+    ostream stream{nullptr};
+};
+
+#ifndef MIPS_NO_MAIN
+// -------------------------------------------------------------------
+// DecompressFile: writes the text of a .lz output to 'out'. Every block
+// is checked against its checksum; the blocks before a damaged one are
+// still written.
+// -------------------------------------------------------------------
+static bool DecompressFile(const string &filename, ostream &out, string &error) {
+    MappedFile in;
+    if (!in.Open(filename)) {
+        error = "cannot open " + filename;
+        return false;
+    }
+    const char *data = in.Data();
+    size_t size = in.Size();
+    if (size < sizeof(COMPRESSED_MAGIC) || memcmp(data, COMPRESSED_MAGIC, sizeof(COMPRESSED_MAGIC)) != 0) {
+        error = filename + " is not a compressed output file";
+        return false;
+    }
+    string raw;
+    size_t at = sizeof(COMPRESSED_MAGIC);
+    for (uint64_t index = 0; at < size; index++) {
+        CompressedBlockHeader header;
+        if (size - at < sizeof(header)) {
+            error = "block " + to_string(index) + " is cut short";
+            return false;
+        }
+        memcpy(&header, data + at, sizeof(header));
+        at += sizeof(header);
+        if (header.storedSize > size - at || header.rawSize > COMPRESS_BLOCK) {
+            error = "block " + to_string(index) + " is cut short or damaged";
+            return false;
+        }
+        const unsigned char *stored = (const unsigned char*)data + at;
+        at += header.storedSize;
+        raw.resize(header.rawSize);
+        bool ok;
+        if (header.flags & BLOCK_STORED) {
+            ok = header.storedSize == header.rawSize;
+            if (ok) memcpy(&raw[0], stored, header.rawSize);
+        } else {
+            ok = BlockCodec::Decompress(stored, header.storedSize, &raw[0], header.rawSize);
+        }
+        if (!ok || (uint32_t)HashBytes(raw.data(), raw.size()) != header.checksum) {
+            error = "block " + to_string(index) + " is damaged";
+            return false;
+        }
+        out.write(raw.data(), raw.size());
+    }
+    if (!out.flush()) {
+        error = "cannot write the output";
+        return false;
+    }
+    return true;
+}
+#endif
+
+// -------------------------------------------------------------------
+// =================== Parallel Rendering ============================
+// -------------------------------------------------------------------
+// Turning cycles into text can cost more than simulating them, mostly
+// because of the memory dump in every cycle. With --render-threads the
+// run (or a --reconstruct) only captures a compact CycleSnapshot per
+// printed cycle; chunks of snapshots are formatted on worker threads
+// into separate buffers and written out in order. On POSIX each chunk
+// is written with pwrite at the offset where the previous chunk ends,
+// so the writes themselves also overlap.
+
+// -------------------------------------------------------------------
+// ToHexCustom: hex the way the cycle printout wants it. If the upper 16
+// bits are either 0 or 0xFFFF, print only the lower 16 bits.
+// -------------------------------------------------------------------
+static string ToHexCustom(int32_t val) {
+    uint32_t u = (uint32_t)val;
+    if ((u & 0xFFFF0000) == 0 || (u & 0xFFFF0000) == 0xFFFF0000) {
+         ostringstream oss;
+         oss << hex << uppercase << (u & 0xFFFF);
+         string s = oss.str();
+         // Remove any leading zeros (if any)
+         size_t pos = s.find_first_not_of('0');
+         return (pos == string::npos) ? "0" : s.substr(pos);
+    } else {
+         ostringstream oss;
+         oss << hex << uppercase << u;
+         string s = oss.str();
+         size_t pos = s.find_first_not_of('0');
+         return (pos == string::npos) ? "0" : s.substr(pos);
+    }
+}
+
+// Every stored word, sorted by address: what a Memory State block prints
+typedef vector<pair<uint32_t,int32_t>> MemoryImage;
+
+// -------------------------------------------------------------------
+// FormatCycleRegisters / FormatMemoryState: the "-----Cycle N-----" +
+// registers block and the "Memory State" block, from plain values
+// -------------------------------------------------------------------
+static void FormatCycleRegisters(ostream &out, uint64_t cycle, uint32_t pc, const int32_t *regs) {
+    out << "-----Cycle " << dec << cycle << "-----\n";
+
+    // 1) Print Register File
+    out << "Registers:\n";
+    // Print PC first, then all 32 registers in hex
+    out << ToHexCustom(pc) << "\t";
+    for (int i = 0; i < 32; i++) {
+        out << ToHexCustom(regs[i]) << "\t";
+    }
+    out << "\n\n";
+}
+
+static void FormatMemoryState(ostream &out, const MemoryImage &image) {
+    // 3) "Memory State" => addresses updated in this cycle
+    out << "Memory State:\n" << uppercase;
+
+    if (image.empty()) {
+        // If no memory used at all, just a blank line
+        out << "\n";
+    } else {
+        // Print the *values* in ascending address order, from $gp upwards
+        uint32_t gpBase = 0x10008000;
+        for (auto &word : image) {
+            if (word.first >= gpBase) {
+                out << hex << word.second << "\t";
+            }
+        }
+        out << "\n";  // end with blank line
+    }
+    out << "\n";
+}
+
+// -------------------------------------------------------------------
+// UpdateMemoryImage: the image after the stores to 'dirty' (cleared on
+// return). Snapshots share an image until a store changes it, and then
+// the new one is a copy with a few words patched, not a re-sort.
+// -------------------------------------------------------------------
+static shared_ptr<const MemoryImage> UpdateMemoryImage(const shared_ptr<const MemoryImage> &old,
+                                                       const SparseMem &mem, vector<uint32_t> &dirty) {
+    if (old && dirty.empty()) return old;
+    auto image = make_shared<MemoryImage>();
+    if (!old) {
+        image->reserve(mem.Size());
+        mem.ForEach([&](uint32_t addr, int32_t value) { image->push_back({addr, value}); });
+        sort(image->begin(), image->end());
+    } else {
+        *image = *old;
+        for (uint32_t addr : dirty) {
+            const int32_t *word = mem.Find(addr);
+            if (!word) continue;
+            auto pos = lower_bound(image->begin(), image->end(), make_pair(addr, INT32_MIN));
+            if (pos != image->end() && pos->first == addr) pos->second = *word;
+            else image->insert(pos, {addr, *word});
+        }
+    }
+    dirty.clear();
+    return image;
+}
+
+// One printed cycle, with everything its text needs
+struct CycleSnapshot {
+    uint64_t cycle = 0;
+    uint32_t pc = 0;
+    int32_t regs[32];
+    string monitors;                          // the formatted Monitors block
+    shared_ptr<const MemoryImage> memory;
+};
+
+class ParallelRenderer {
+public:
+    ~ParallelRenderer() { Finish(); }
+
+    // threads = 0: one per core. A .lz file goes through a
+    // CompressingStreamBuf instead of pwrite.
+    bool Open(const string &filename, unsigned threads) {
+        compressed = IsCompressedName(filename);
+        if (compressed) {
+            if (!packer.Open(filename)) return false;
+        } else {
+#ifdef MIPS_POSIX
+        fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+#else
+        fileOut.open(filename, ios::binary);
+        if (!fileOut.is_open()) return false;
+#endif
+        }
+        if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+        maxPending = 4 * threads;
+        for (unsigned i = 0; i < threads; i++) workers.emplace_back([this] { Work(); });
+        return true;
+    }
+
+    void Add(CycleSnapshot &&snap) {
+        current.push_back(Item{std::move(snap), string(), false});
+        currentBytes += TextBytes(current.back());
+        if (current.size() >= CHUNK_CYCLES || currentBytes >= CHUNK_BYTES) Flush();
+    }
+
+    void AddText(string text) {
+        current.push_back(Item{CycleSnapshot(), std::move(text), true});
+        currentBytes += TextBytes(current.back());
+    }
+
+    // Writes everything still queued and closes the file; false if a
+    // write failed
+    bool Finish() {
+        if (workers.empty()) return !failed;
+        Flush();
+        {
+            lock_guard<mutex> lk(mu);
+            closing = true;
+        }
+        queued.notify_all();
+        for (thread &t : workers) t.join();
+        workers.clear();
+        if (compressed) {
+            if (!packer.Close()) failed = true;
+            return !failed;
+        }
+#ifdef MIPS_POSIX
+        if (fd >= 0) close(fd);
+        fd = -1;
+#else
+        fileOut.close();
+        if (!fileOut) failed = true;
+#endif
+        return !failed;
+    }
+
+private:
+    static const size_t CHUNK_CYCLES = 256;
+    static const size_t MAX_PENDING_BYTES = 64u << 20;   // text of the chunks not yet written
+    static const size_t CHUNK_BYTES = 4u << 20;          // a chunk ends early at this much text
+
+    struct Item {
+        CycleSnapshot snap;
+        string text;
+        bool isText;
+    };
+    struct Chunk {
+        uint64_t index;
+        vector<Item> items;
+        size_t bytes;           // estimated text size until it is rendered
+    };
+
+    // About how much text an item becomes: a memory word is at most 9
+    // characters, like a register
+    static size_t TextBytes(const Item &item) {
+        if (item.isText) return item.text.size();
+        size_t words = 33 + (item.snap.memory ? item.snap.memory->size() : 0);
+        return 64 + item.snap.monitors.size() + 9 * words;
+    }
+
+    // Hands the current chunk to the workers; waits while too many chunks
+    // or too much text are pending so the snapshots and the rendered text
+    // never pile up in memory (one chunk is always let through)
+    void Flush() {
+        if (current.empty()) return;
+        size_t bytes = currentBytes;
+        currentBytes = 0;
+        unique_lock<mutex> lk(mu);
+        drained.wait(lk, [&] {
+            return pending == 0 || (pending < maxPending && pendingBytes + bytes <= MAX_PENDING_BYTES);
+        });
+        queue.push_back(Chunk{nextChunk++, std::move(current), bytes});
+        pending++;
+        pendingBytes += bytes;
+        lk.unlock();
+        queued.notify_one();
+        current.clear();
+    }
+
+    void Work() {
+        for (;;) {
+            unique_lock<mutex> lk(mu);
+            queued.wait(lk, [this] { return closing || !queue.empty(); });
+            if (queue.empty()) return;
+            Chunk chunk = std::move(queue.front());
+            queue.pop_front();
+            lk.unlock();
+
+            MIPS_PHASE(PH_FORMAT);
+            ostringstream text;
+            for (const Item &item : chunk.items) {
+                if (item.isText) {
+                    text << item.text;
+                    continue;
+                }
+                const CycleSnapshot &snap = item.snap;
+                FormatCycleRegisters(text, snap.cycle, snap.pc, snap.regs);
+                text << snap.monitors;
+                FormatMemoryState(text, *snap.memory);
+            }
+            Commit(chunk.index, chunk.bytes, text.str());
+        }
+    }
+
+    // Chunks finish in any order; offsets are handed out in chunk order.
+    // From here on a chunk counts as its text instead of its snapshots.
+    void Commit(uint64_t index, size_t snapshotBytes, string text) {
+        unique_lock<mutex> lk(mu);
+        pendingBytes += text.size() - snapshotBytes;
+        done[index] = std::move(text);
+        while (!done.empty() && done.begin()->first == nextWrite) {
+            string chunkText = std::move(done.begin()->second);
+            done.erase(done.begin());
+            nextWrite++;
+            if (compressed) {
+                // in order, under the lock: the compressor takes one stream
+                MIPS_PHASE(PH_WRITE);
+                if (packer.sputn(chunkText.data(), chunkText.size()) != (streamsize)chunkText.size()) failed = true;
+                pending--;
+                pendingBytes -= chunkText.size();
+                continue;
+            }
+#ifdef MIPS_POSIX
+            uint64_t at = offset;
+            offset += chunkText.size();
+            lk.unlock();
+            MIPS_PHASE(PH_WRITE);
+            for (size_t written = 0; written < chunkText.size(); ) {
+                ssize_t n = pwrite(fd, chunkText.data() + written, chunkText.size() - written,
+                                   (off_t)(at + written));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    failed = true;
+                    break;
+                }
+                written += (size_t)n;
+            }
+            lk.lock();
+#else
+            MIPS_PHASE(PH_WRITE);
+            fileOut.write(chunkText.data(), chunkText.size());
+#endif
+            pending--;
+            pendingBytes -= chunkText.size();
+        }
+        lk.unlock();
+        drained.notify_all();
+    }
+
+#ifdef MIPS_POSIX
+    int fd = -1;
+    uint64_t offset = 0;
+#else
+    ofstream fileOut;
+#endif
+    bool compressed = false;
+    CompressingStreamBuf packer;
+    vector<thread> workers;
+    mutex mu;
+    condition_variable queued, drained;
+    deque<Chunk> queue;
+    map<uint64_t, string> done;      // rendered, waiting for their turn
+    vector<Item> current;            // the chunk being filled
+    size_t currentBytes = 0;         // its estimated text
+    uint64_t nextChunk = 0, nextWrite = 0;
+    size_t pending = 0, maxPending = 4;
+    size_t pendingBytes = 0;
+    bool closing = false;
+    atomic<bool> failed{false};
+};
+
+// -------------------------------------------------------------------
+// =================== Cycle Sampling ================================
+// -------------------------------------------------------------------
+// For very long runs: instead of a cycle list, print a sample of the
+// cycles plus estimates of where the time goes. Three modes:
+//   every:N            every Nth cycle
+//   random:N[:seed]    each cycle with probability 1/N
+//   reservoir:K[:seed] K cycles chosen uniformly from the whole run
+// Nothing is done per cycle except comparing the cycle number with
+// Next(): the random gaps are drawn from a geometric distribution and
+// the reservoir uses Algorithm L, so the RNG only runs when a sample is
+// taken. Reservoir samples are kept formatted until the run ends.
+class CycleSampler {
+public:
+    enum Mode { EVERY, RANDOM, RESERVOIR };
+
+    bool Parse(const string &spec, string &err) {
+        vector<string> parts;
+        stringstream ss(spec);
+        string part;
+        while (getline(ss, part, ':')) parts.push_back(part);
+        if (parts.size() < 2 || parts.size() > 3) {
+            err = "expected every:N, random:N[:seed] or reservoir:K[:seed]";
+            return false;
+        }
+        if      (parts[0] == "every")     mode = EVERY;
+        else if (parts[0] == "random")    mode = RANDOM;
+        else if (parts[0] == "reservoir") mode = RESERVOIR;
+        else {
+            err = "unknown sampling mode '" + parts[0] + "'";
+            return false;
+        }
+        try {
+            n = stoull(parts[1]);
+            if (parts.size() == 3) seed = stoull(parts[2]);
+        } catch (...) {
+            err = "bad number in '" + spec + "'";
+            return false;
+        }
+        if (n == 0) {
+            err = "the sampling interval / size must be at least 1";
+            return false;
+        }
+        if (mode == EVERY && parts.size() == 3) {
+            err = "every:N takes no seed";
+            return false;
+        }
+        return true;
+    }
+
+    bool Deferred() const { return mode == RESERVOIR; }   // printed at the end
+    uint64_t Next() const { return next; }
+
+    void Start() {
+        rng.seed(seed);
+        samples.clear();
+        taken = 0;
+        w = 1.0;
+        if (mode == EVERY)       next = n;
+        else if (mode == RANDOM) next = Gap(1.0 / (double)n);
+        else                     next = 1;                 // the reservoir fills first
+    }
+
+    // Records cycle Next(); 'text' is only kept for deferred modes.
+    // Advances Next().
+    void Take(uint64_t cycle, uint32_t pc, uint8_t op, string text) {
+        taken++;
+        Sample smp = {cycle, pc, op, std::move(text)};
+        if (mode != RESERVOIR) {
+            samples.push_back(std::move(smp));
+            next = cycle + (mode == EVERY ? n : Gap(1.0 / (double)n));
+            return;
+        }
+        if (samples.size() < n) {
+            samples.push_back(std::move(smp));
+            if (samples.size() < n) {
+                next = cycle + 1;
+                return;
+            }
+        } else {
+            samples[(size_t)(Uniform() * (double)n)] = std::move(smp);
+        }
+        // Algorithm L: skip ahead to the next cycle that replaces a sample
+        w *= exp(log(Uniform()) / (double)n);
+        next = cycle + Gap(w);
+    }
+
+    // Reservoir mode: the kept cycles' text, in cycle order
+    void WriteDeferred(ostream &out) {
+        sort(samples.begin(), samples.end(), [](const Sample &a, const Sample &b) { return a.cycle < b.cycle; });
+        for (const Sample &smp : samples) out << smp.text;
+    }
+
+    void WriteSummary(ostream &out, uint64_t totalCycles) const {
+        static const char *const modeNames[] = {"every", "random", "reservoir"};
+        out << dec << nouppercase << "-----Sampling Summary-----\n";
+        out << "Mode: " << modeNames[mode] << " " << n;
+        if (mode != EVERY) out << " (seed " << seed << ")";
+        out << "\nCycles run: " << totalCycles << "\n";
+        out << "Samples: " << samples.size() << "\n";
+        if (samples.empty()) return;
+
+        // Share of the samples (and so, estimated, of the run) with a 95%
+        // normal-approximation interval
+        double total = (double)samples.size();
+        auto share = [&](uint64_t count) {
+            double p = (double)count / total;
+            double half = 1.96 * sqrt(p * (1 - p) / total);
+            ostringstream o;
+            o << fixed << setprecision(1) << 100 * p << "%\t+-" << 100 * half << "%";
+            return o.str();
+        };
+
+        uint64_t byOp[OP_UNKNOWN + 1] = {};
+        unordered_map<uint32_t, uint64_t> byPC;
+        for (const Sample &smp : samples) {
+            byOp[smp.op <= OP_UNKNOWN ? smp.op : (uint8_t)OP_UNKNOWN]++;
+            byPC[smp.pc]++;
+        }
+        out << "\nInstruction mix (share of cycles, 95% interval):\n";
+        vector<pair<uint64_t,int>> ops;
+        for (int op = 0; op <= OP_UNKNOWN; op++) if (byOp[op]) ops.push_back({byOp[op], op});
+        sort(ops.rbegin(), ops.rend());
+        for (auto &o : ops) out << OpcodeName((uint8_t)o.second) << "\t" << share(o.first) << "\n";
+
+        out << "\nHottest PCs:\n";
+        vector<pair<uint64_t,uint32_t>> pcs;
+        for (auto &kv : byPC) pcs.push_back({kv.second, kv.first});
+        sort(pcs.begin(), pcs.end(), [](const pair<uint64_t,uint32_t> &a, const pair<uint64_t,uint32_t> &b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+        if (pcs.size() > 10) pcs.resize(10);
+        for (auto &pc : pcs) out << "0x" << hex << pc.second << dec << "\t" << share(pc.first) << "\n";
+    }
+
+private:
+    struct Sample {
+        uint64_t cycle;
+        uint32_t pc;
+        uint8_t op;
+        string text;
+    };
+
+    double Uniform() {          // (0,1), from the top 53 bits
+        return ((double)(rng() >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+    }
+    uint64_t Gap(double p) {    // cycles until the next success, p per cycle
+        if (p >= 1.0) return 1;
+        return (uint64_t)floor(log(Uniform()) / log(1.0 - p)) + 1;
+    }
+
+    Mode mode = EVERY;
+    uint64_t n = 1;             // interval, mean interval or reservoir size
+    uint64_t seed = 1;
+    mt19937_64 rng;
+    uint64_t next = 0;
+    uint64_t taken = 0;
+    double w = 1.0;             // Algorithm L state
+    vector<Sample> samples;
+};
+
+// -------------------------------------------------------------------
+// =================== Long Runs =====================================
+// -------------------------------------------------------------------
+// For runs of billions of cycles: a wall-clock budget, a stop request
+// from SIGINT/SIGTERM, and a progress marker file. The run loop only
+// looks at these every LONG_RUN_POLL cycles, so they cost nothing per
+// cycle.
+//
+// The marker is a few "key value" lines (cycle, pc, elapsed seconds,
+// status). It is replaced in one step: written to a temporary file,
+// flushed to disk and renamed over the old one, so whenever the
+// process dies the file holds a complete marker. A run stopped by a
+// signal writes a last marker with the exact cycle it stopped at.
+static const uint64_t LONG_RUN_POLL = 1u << 16;
+static volatile sig_atomic_t stopSignal = 0;
+
+#ifndef MIPS_NO_MAIN
+static void RequestStop(int sig) {      // installed by main
+    stopSignal = sig;
+    signal(sig, SIG_DFL);      // a second signal ends the process as usual
+}
+#endif
+
+class ProgressMarker {
+public:
+    bool Open(const string &file, double everySeconds) {
+        path = file;
+        every = everySeconds;
+        due = chrono::steady_clock::now();
+        return Write(0, 0, 0.0, "starting");
+    }
+    bool Due(chrono::steady_clock::time_point now) const { return now >= due; }
+
+    bool Write(uint64_t cycle, uint32_t pc, double elapsed, const char *status) {
+        MIPS_PHASE(PH_WRITE);
+        due = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(
+                                                 chrono::duration<double>(every));
+        char text[192];
+        int len = snprintf(text, sizeof(text), "cycle %llu\npc 0x%x\nelapsed %.3f\nstatus %s\n",
+                           (unsigned long long)cycle, pc, elapsed, status);
+        string tmp = path + ".tmp";
+#ifdef MIPS_POSIX
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        bool ok = write(fd, text, (size_t)len) == len && fsync(fd) == 0;
+        close(fd);
+        return ok && rename(tmp.c_str(), path.c_str()) == 0;
+#else
+        {
+            ofstream out(tmp, ios::binary | ios::trunc);
+            out.write(text, len);
+            if (!out) return false;
+        }
+        remove(path.c_str());
+        return rename(tmp.c_str(), path.c_str()) == 0;
+#endif
+    }
+
+private:
+    string path;
+    double every = 10;
+    chrono::steady_clock::time_point due;
+};
+
+// -------------------------------------------------------------------
+// =================== Profile-Guided Layout =========================
+// -------------------------------------------------------------------
+// instrs[] follows the source, so in a large program a hot loop and the
+// code it calls can be spread over many cache lines, with setup code and
+// rare paths in between. A first run with --layout-profile counts how
+// often each instruction ran and how often each jump or taken branch
+// went from one instruction to another. A later run with --layout turns
+// those counts into a ProgramLayout: basic blocks are chained along
+// their hottest edges (Pettis-Hansen), the chains are placed hottest
+// first, and blocks that never ran come last in source order. The run
+// fetches from that copy. Each entry also knows the positions of its
+// fall-through and target instructions (next[]), so following the
+// program does not touch the source-ordered slotOf, which is only used
+// when the PC is set some other way. PCs, targets and everything
+// printed stay those of the source order.
+//
+// The handlers themselves are machine code, so their placement is up
+// to the compiler: they are marked MIPS_HOT (grouped in .text.hot by
+// GCC and Clang), and the [DEBUG] printing of j/beq/bne is kept out of
+// line as MIPS_COLD so it does not sit between them.
+#if defined(__GNUC__)
+#define MIPS_HOT  __attribute__((hot))
+#define MIPS_COLD __attribute__((cold, noinline))
+#else
+#define MIPS_HOT
+#define MIPS_COLD
+#endif
+
+// Recognises a profile made from a different program
+static uint64_t ProgramCodeHash(const Program &prog) {
+    return HashBytes(prog.instrs.data(), prog.instrs.size() * sizeof(Instruction));
+}
+
+class ExecutionProfile {
+public:
+    void Start(const Program &prog) {
+        programHash = ProgramCodeHash(prog);
+        counts.assign(prog.instrs.size(), 0);
+        edges.clear();
+    }
+
+    // One executed instruction and the instruction index it went to
+    void Record(uint32_t from, uint32_t to) {
+        counts[from]++;
+        if (to != from + 1) edges[(uint64_t)from << 32 | to]++;
+    }
+
+    // Text: a "mips-layout-profile" line with the program hash and
+    // size, then "count <index> <n>" and "edge <from> <to> <n>" lines
+    bool Save(const string &filename) const {
+        ofstream out(filename);
+        if (!out.is_open()) return false;
+        out << "mips-layout-profile 1 " << hex << programHash << dec << " " << counts.size() << "\n";
+        for (size_t i = 0; i < counts.size(); i++) {
+            if (counts[i]) out << "count " << i << " " << counts[i] << "\n";
+        }
+        vector<pair<uint64_t,uint64_t>> sorted(edges.begin(), edges.end());
+        sort(sorted.begin(), sorted.end());
+        for (auto &e : sorted) out << "edge " << (e.first >> 32) << " " << (uint32_t)e.first << " " << e.second << "\n";
+        out.close();
+        return !out.fail();
+    }
+
+    bool Load(const string &filename, const Program &prog, string &error) {
+        ifstream fin(filename);
+        if (!fin.is_open()) {
+            error = "cannot open " + filename;
+            return false;
+        }
+        string magic;
+        int version = 0;
+        uint64_t hash = 0;
+        size_t size = 0;
+        if (!(fin >> magic >> version >> hex >> hash >> dec >> size) || magic != "mips-layout-profile" || version != 1) {
+            error = filename + " is not a layout profile";
+            return false;
+        }
+        Start(prog);
+        if (hash != programHash || size != counts.size()) {
+            error = filename + " was recorded for a different program";
+            return false;
+        }
+        string kind;
+        uint64_t a, b, n;
+        while (fin >> kind) {
+            if (kind == "count" && fin >> a >> n && a < size) {
+                counts[a] = n;
+            } else if (kind == "edge" && fin >> a >> b >> n && a < size) {
+                edges[a << 32 | (uint32_t)b] = n;
+            } else {
+                error = filename + ": bad line starting with '" + kind + "'";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const vector<uint64_t> &Counts() const { return counts; }
+    const unordered_map<uint64_t,uint64_t> &Edges() const { return edges; }   // (from << 32 | to) -> n
+
+private:
+    uint64_t programHash = 0;
+    vector<uint64_t> counts;                 // per instruction index
+    unordered_map<uint64_t,uint64_t> edges;  // only the ones that are not from i to i+1
+};
+
+// The decoded program in profile order
+struct ProgramLayout {
+    shared_ptr<const Program> program;       // the program it was built for
+    vector<Instruction, AlignedAllocator<Instruction, 64>> instrs;
+    vector<uint32_t> slotOf;                 // instruction index -> position in instrs
+    vector<uint32_t> next;                   // per position: {fall-through, target} positions
+
+    static shared_ptr<const ProgramLayout> Build(shared_ptr<const Program> program, const ExecutionProfile &profile);
+};
+
+// -------------------------------------------------------------------
+// ProgramLayout::Build: split the program into basic blocks, chain
+// blocks along their edges from the heaviest down (a chain only grows
+// at its ends), then place the chains by their hottest block
+// -------------------------------------------------------------------
+shared_ptr<const ProgramLayout> ProgramLayout::Build(shared_ptr<const Program> program, const ExecutionProfile &profile) {
+    const Program &prog = *program;
+    const vector<uint64_t> &counts = profile.Counts();
+    uint32_t n = (uint32_t)prog.instrs.size();
+
+    // Block leaders: the entry, every target and every instruction after
+    // a jump or branch
+    vector<char> leader(n + 1, 0);
+    leader[0] = 1;
+    for (uint32_t i = 0; i < n; i++) {
+        const Instruction &ins = prog.instrs[i];
+        if (ISA[ins.op].format == FMT_JUMP || ISA[ins.op].format == FMT_BRANCH) {
+            if (ins.target >= 0 && (uint32_t)ins.target < n) leader[ins.target] = 1;
+            leader[i + 1] = 1;
+        }
+    }
+    for (auto &e : profile.Edges()) {
+        uint32_t from = (uint32_t)(e.first >> 32), to = (uint32_t)e.first;
+        leader[from + 1] = 1;
+        if (to < n) leader[to] = 1;
+    }
+    vector<uint32_t> blockStart, blockOf(n);
+    for (uint32_t i = 0; i < n; i++) {
+        if (leader[i]) blockStart.push_back(i);
+        blockOf[i] = (uint32_t)blockStart.size() - 1;
+    }
+    uint32_t blocks = (uint32_t)blockStart.size();
+    blockStart.push_back(n);
+    auto weight = [&](uint32_t b) { return counts[blockStart[b]]; };
+
+    // Block edges: the recorded jumps/taken branches plus the fall-through
+    // out of each block's last instruction
+    struct Edge { uint64_t n; uint32_t from, to; };
+    vector<Edge> edgeList;
+    vector<uint64_t> leaving(n, 0);
+    for (auto &e : profile.Edges()) {
+        uint32_t from = (uint32_t)(e.first >> 32), to = (uint32_t)e.first;
+        leaving[from] += e.second;
+        if (to < n) edgeList.push_back({e.second, blockOf[from], blockOf[to]});
+    }
+    for (uint32_t b = 0; b + 1 < blocks; b++) {
+        uint32_t last = blockStart[b + 1] - 1;
+        if (counts[last] > leaving[last]) edgeList.push_back({counts[last] - leaving[last], b, b + 1});
+    }
+    sort(edgeList.begin(), edgeList.end(), [](const Edge &x, const Edge &y) {
+        if (x.n != y.n) return x.n > y.n;
+        return x.from != y.from ? x.from < y.from : x.to < y.to;
+    });
+
+    vector<uint32_t> next(blocks, UINT32_MAX), prev(blocks, UINT32_MAX), chain(blocks);
+    for (uint32_t b = 0; b < blocks; b++) chain[b] = b;
+    auto chainOf = [&](uint32_t b) {
+        while (chain[b] != b) b = chain[b] = chain[chain[b]];
+        return b;
+    };
+    for (const Edge &e : edgeList) {
+        if (next[e.from] != UINT32_MAX || prev[e.to] != UINT32_MAX) continue;
+        uint32_t a = chainOf(e.from), c = chainOf(e.to);
+        if (a == c) continue;
+        next[e.from] = e.to;
+        prev[e.to] = e.from;
+        chain[c] = a;
+    }
+
+    // Chains that ran, hottest first; then the blocks that never ran
+    vector<pair<uint64_t,uint32_t>> hot;       // (hottest block, chain head)
+    for (uint32_t b = 0; b < blocks; b++) {
+        if (prev[b] != UINT32_MAX) continue;
+        uint64_t top = 0;
+        for (uint32_t c = b; c != UINT32_MAX; c = next[c]) top = max(top, weight(c));
+        if (top) hot.push_back({top, b});
+    }
+    stable_sort(hot.begin(), hot.end(), [](const pair<uint64_t,uint32_t> &x, const pair<uint64_t,uint32_t> &y) {
+        return x.first > y.first;
+    });
+
+    auto layout = make_shared<ProgramLayout>();
+    layout->program = program;
+    layout->instrs.reserve(n);
+    layout->slotOf.assign(n, 0);
+    vector<char> placed(blocks, 0);
+    auto place = [&](uint32_t b) {
+        placed[b] = 1;
+        for (uint32_t i = blockStart[b]; i < blockStart[b + 1]; i++) {
+            layout->slotOf[i] = (uint32_t)layout->instrs.size();
+            layout->instrs.push_back(prog.instrs[i]);
+        }
+    };
+    for (auto &h : hot) {
+        for (uint32_t c = h.second; c != UINT32_MAX; c = next[c]) place(c);
+    }
+    for (uint32_t b = 0; b < blocks; b++) if (!placed[b]) place(b);
+
+    layout->next.assign(2 * (size_t)n, 0);
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t slot = layout->slotOf[i];
+        int32_t target = prog.instrs[i].target;
+        if (i + 1 < n) layout->next[2 * slot] = layout->slotOf[i + 1];
+        if (target >= 0 && (uint32_t)target < n) layout->next[2 * slot + 1] = layout->slotOf[target];
+    }
+    return layout;
+}
+
+// -------------------------------------------------------------------
+// =================== SingleCycleMIPS Class =========================
+// -------------------------------------------------------------------
+// Orchestrates the loading of assembly instructions, simulates them
+// in a single-cycle manner, and prints out the cycle-by-cycle (or
+// final) state as requested.
+class IncrementalRunner;
+
+class SingleCycleMIPS {
+    friend class LockstepMIPS;   // the sweep engine reads the decoded program
+    friend class TraceQuery;     // the query tool names registers the same way
+    friend class IncrementalRunner;   // restores checkpoints, swaps programs
+public:
+
+    bool LoadAssembly(const string &filename);                         // read instructions from file
+    void LoadAssembly(istream &in);                                    // ... or from any stream
+    void LoadAssembly(const char *text, size_t length);                // ... or from memory (no copy)
+    shared_ptr<const Program> GetProgram() const { return program; }   // the decoded program
+    void SetProgram(shared_ptr<const Program> p) { program = p; }      // run an already decoded one
+    void SetDebugLog(bool on) { debugLog = on; }                       // the [DEBUG] lines on cout
+    void SetStopReports(bool on) { stopReports = on; }                 // breakpoint/livelock/budget messages
+    void SetProgramCache(const string &dir) { programCacheDir = dir; } // reuse decoded programs from disk
+    bool RunSimulation(const string &outFile, const vector<int64_t> &cyclesToPrint, bool includeLast);  // false if the file failed
+    void RunSimulation(ostream &out, const vector<int64_t> &cyclesToPrint, bool includeLast);
+    void SetInitialRegister(int reg, int32_t value);                   // override a register before the run
+    // Raw little-endian words from a file, stored from 'addr' on at the
+    // start of every run, on top of the program's .data words
+    bool LoadBinaryImage(const string &filename, uint32_t addr, string &error);
+    const SparseMem &BinaryImages() const { return binaryImages; }
+    void SetBinaryImages(const SparseMem &images) { binaryImages = images; initialFor.reset(); }
+    void SetCommitTrace(CommitTraceWriter *writer) { commitOut = writer; }   // record every cycle
+    void SetReference(CommitTraceReader *reader) { reference = reader; }     // check every cycle
+    bool Diverged() const { return diverged; }
+    void SetDeltaTrace(DeltaTraceWriter *writer) { deltaOut = writer; }  // printed cycles go here instead
+    bool SaveStateImage(const string &path, string &error) const;     // see StateImageHeader
+    // Profile-guided layout (see ProgramLayout): count what every run
+    // executes into 'profile', or fetch from 'layout' while it belongs
+    // to the loaded program. Both take effect at the next Reset.
+    void SetExecutionProfile(ExecutionProfile *profile) { execProfile = profile; }
+    void SetLayout(shared_ptr<const ProgramLayout> l) { layout = l; }
+
+    // Stop when the state repeats exactly (the program can never halt) or
+    // after maxCycles cycles (0 = no limit)
+    void SetLoopDetection(bool on) { detectLoops = on; }
+    void SetCycleBudget(uint64_t maxCycles) { cycleBudget = maxCycles; }
+    bool Livelocked() const { return livelocked; }
+    bool OutOfBudget() const { return outOfBudget; }
+
+    // Long runs (see ProgressMarker): stop after 'seconds' of wall time
+    // (0 = no limit, counts as running out of budget), keep a progress
+    // marker file, and stop cleanly on SIGINT/SIGTERM once RequestStop
+    // is installed. All three take effect at the next Reset.
+    void SetTimeBudget(double seconds) { timeBudget = seconds; }
+    void SetProgressMarker(ProgressMarker *m) { progress = m; }
+    bool Interrupted() const { return interrupted; }
+    const char *StopReason() const;    // "halted", "cycle-budget", ... or "running"
+
+    // Print a sample of the cycles plus a summary instead of the cycle
+    // list (see CycleSampler)
+    void SetSampler(CycleSampler *s) { sampler = s; }
+
+    // Format the printed cycles on worker threads (the text output then
+    // goes to the renderer, not to RunSimulation's stream)
+    void SetRenderer(ParallelRenderer *r) { renderer = r; }
+
+    // Rebuilds the text output from a delta trace; prints the cycles in
+    // 'cyclesToPrint' (-1 or empty = every recorded cycle) and the final
+    // state if it was recorded and includeLast is set.
+    static bool ReconstructDeltaTrace(const string &deltaFile, ostream &out,
+                                      const vector<int64_t> &cyclesToPrint, bool includeLast,
+                                      ParallelRenderer *renderer = nullptr);
+
+    // Adds a breakpoint (stops the run) or watchpoint (prints the cycle);
+    // the program must already be loaded so labels can be resolved.
+    bool AddPredicate(const string &spec, bool isBreak, string &error);
+
+    // Driving the simulator directly (library use) instead of through
+    // RunSimulation: Reset, then Step / RunUntil as often as needed.
+    void Reset();
+    uint64_t Step(uint64_t n);
+    uint64_t RunUntil(bool (*stop)(const SingleCycleMIPS &, void *), void *ctx, uint64_t maxCycles);
+    bool Finished() const { return finished; }           // halted or ran off the program
+    bool BreakpointHit() const { return stopRequested; }
+    bool Stopped() const { return finished || stopRequested || livelocked || outOfBudget || interrupted || diverged; }
+
+    // Read access to the live state. Registers() points into this object
+    // and stays valid as long as it does. Memory words are returned by
+    // value: a store copies a shared page (after a Fork, or while the
+    // pages are still those of the initial memory), which would leave a
+    // pointer to the old copy behind.
+    const int32_t *Registers() const { return rf.regs; }
+    uint32_t PC() const { return rf.pc; }
+    uint64_t Cycles() const { return cycleCount; }
+    const SparseMem &Memory() const { return mem; }
+    bool Word(uint32_t addr, int32_t &value) const {     // false if never stored
+        const int32_t *word = mem.Find(addr);
+        if (word) value = *word;
+        return word != nullptr;
+    }
+
+    // What-if exploration: Fork returns a child that continues from
+    // exactly this state and can then be changed. Memory pages are
+    // shared copy-on-write and the decoded program is only copied if the
+    // child patches it, so a fork costs O(pages changed afterwards). The
+    // child has no trace, cosim, sampler or renderer attached.
+    SingleCycleMIPS Fork() const;
+    void SetRegisterNow(int reg, int32_t value);
+    void StoreWord(uint32_t addr, int32_t value);
+    void SetPC(uint32_t pc);
+    bool PatchInstruction(uint32_t pc, const string &text, string &error);
+    // One edit in text form: "$a0=5", "mem[0x10008004]=7", "pc=0x20" or
+    // "<label|address>: <instruction>"
+    bool ApplyEdit(const string &edit, string &error);
+
+    // Runs to cycle forkCycle, then forks one child per variant (edits
+    // separated by ';'), runs the children to the end on 'threads'
+    // threads and prints each one's final state. A child that hits the
+    // cycle budget is marked in its header and sets OutOfBudget().
+    bool RunVariants(ostream &out, uint64_t forkCycle, const vector<string> &variants,
+                     unsigned threads, string &error);
+    static bool LoadVariants(const string &filename, vector<string> &variants);
+
+private:
+    // Data fields:
+
+    // The CPU state:
+    RegFile    rf;      // The 32 registers + PC
+    SparseMem  mem;     // Sparse memory structure
+    // Instruction memory, labels and source text. Read-only once loaded,
+    // so several simulators (e.g. server jobs) can share one copy.
+    shared_ptr<const Program> program = make_shared<Program>();
+    bool debugLog = true;
+    bool stopReports = true;
+    string programCacheDir;    // empty = always parse
+
+    // For monitoring/printing each cycle:
+    bool didLoad=false, didStore=false;
+    uint32_t memAddress=0;
+    int32_t storeValue=0, loadValue=0;
+
+    uint64_t cycleCount=0;   // how many instructions (cycles) have executed
+    bool finished=false; // true when the program ends
+
+    // The current instruction being executed (points into prog.instrs):
+    const Instruction *IR=nullptr;
+    uint32_t irIndex=0;
+
+    // Profile-guided layout: fetches go through layoutSlot when it is set
+    ExecutionProfile *execProfile=nullptr;
+    shared_ptr<const ProgramLayout> layout;
+    const Instruction *layoutInstrs=nullptr;
+    const uint32_t *layoutSlot=nullptr;
+    const uint32_t *layoutNext=nullptr;
+    uint32_t nextSlotPC=UINT32_MAX;   // the PC whose position nextSlot holds
+    uint32_t nextSlot=0;
+    int32_t regA=0, regB=0;
+    int32_t aluOut=0;
+    int32_t memDataReg=0;
+
+    // The control signals for the current instruction:
+    ControlSignals ctrl;
+    bool showBranchLabel=false;   // monitor (10) prints IR's label when set
+
+    // A list of memory addresses modified in the current cycle
+    vector<uint32_t> changedAddrs;
+
+    // The register written in the current cycle (-1 if none)
+    int regWritten=-1;
+    int32_t regWriteValue=0;
+
+    // Commit trace output and the reference trace we are checked against
+    CommitTraceWriter *commitOut=nullptr;
+    CommitTraceReader *reference=nullptr;
+    bool diverged=false;
+
+    // Delta trace output and the stores since its last record
+    DeltaTraceWriter *deltaOut=nullptr;
+    unordered_set<uint32_t> deltaDirty;     // each address once
+
+    CycleSampler *sampler=nullptr;
+    IncrementalRunner *incremental=nullptr;    // takes checkpoints during the run
+    vector<uint64_t> *firstExecuted=nullptr;   // per instruction index, 0 = not yet
+
+    // Parallel rendering: the memory image shared by snapshots, and the
+    // addresses stored to since it was made
+    ParallelRenderer *renderer=nullptr;
+    shared_ptr<const MemoryImage> memImage;
+    vector<uint32_t> imageDirty;
+    CycleSnapshot TakeSnapshot(uint32_t oldPC);
+
+    // Livelock detection / cycle budget
+    bool detectLoops=false;
+    uint64_t cycleBudget=0;
+    bool livelocked=false;
+    bool outOfBudget=false;
+    bool outOfTime=false;          // outOfBudget because of timeBudget
+    uint64_t stateHash=0;          // registers + memory, kept up to date by every write
+    uint64_t savedHash=0;          // hash of 'saved' (Brent's cycle finding)
+    StateSnapshot saved;
+    uint64_t savedAt=0, power=1, period=0;
+    void StartLoopDetection();
+
+    // Long runs: checked every LONG_RUN_POLL cycles
+    double timeBudget=0;
+    ProgressMarker *progress=nullptr;
+    bool interrupted=false;
+    uint64_t nextPoll=UINT64_MAX;  // cycle of the next check
+    chrono::steady_clock::time_point runStart;
+    void PollLongRun();
+
+    MIPS_HOT bool StepCycle(bool &watchHit);  // one cycle plus all per-cycle checks
+    bool CheckForLoop();           // true if the state repeated
+
+    // Register values applied on top of the $gp/$sp defaults at the start
+    // of a run (used by the sweep mode to give every instance its inputs)
+    vector<pair<int,int32_t>> initialRegs;
+
+    // The memory every run starts with: the program's .data words plus
+    // the binary images. Built once per program and then copied (O(1),
+    // copy-on-write) by every Reset.
+    SparseMem binaryImages;
+    mutable SparseMem initialMem;
+    mutable shared_ptr<const Program> initialFor;    // the program initialMem was built for
+    const SparseMem &InitialMemory() const;
+
+    // Breakpoints/watchpoints, indexed by what can trigger them
+    vector<Predicate> predicates;
+    bool havePredicates=false;
+    bool stopRequested=false;                          // a breakpoint fired
+    vector<uint8_t> pcHasPredicate;                    // by instruction index
+    unordered_map<uint32_t, vector<int>> pcPredicates; // by PC
+    vector<int> regPredicates[32];
+    uint32_t regPredicateMask=0;                       // bit r: regPredicates[r] not empty
+    unordered_map<uint32_t, vector<int>> memPredicates;  // by stored address
+    vector<int> anyStorePredicates;                    // read mem[computed address]
+    vector<int> everyCyclePredicates;                  // read pc or cycle
+
+private:
+    // ---------- Parsing-related ----------
+    void Trim(string &s);                        // remove leading/trailing whitespace
+    void ParseLine(const string &line, Instruction &ins, string &lbl, Program &prog);
+    void ParseInstruction(const string &text, Instruction &ins, Program &prog);
+    void ParseDataDirective(const vector<string> &tokens, Program &prog, uint32_t &dataAddr);
+    static int ParseRegister(string token);
+
+    // ---------- Helpers ----------
+    bool IsHalt(const Instruction &ins);         // detect "sll $zero,$zero,0" as a halt
+    void ResolveLabels(Program &prog);           // fill in branch/jump targets
+
+    // ---------- Control & Execution ----------
+    MIPS_HOT void ExecuteInstruction(const Instruction &ins);  // runs one instruction in one cycle
+    template <uint8_t OP> MIPS_HOT void Execute(const Instruction &ins);   // ... for one opcode (see ISA)
+    MIPS_COLD void LogJump(const char *name, const Instruction &ins);     // the [DEBUG] lines of j
+    MIPS_COLD void LogBranch(const char *name, bool taken, const Instruction &ins);   // ... of beq/bne
+    template <size_t... OPS> static const auto &ExecuteHandlers(index_sequence<OPS...>);
+    void WriteRegister(int reg, int32_t value);  // write back + remember the write
+
+    // ---------- Breakpoints / watchpoints ----------
+    bool CheckPredicates(uint32_t oldPC);        // true if a watchpoint wants this cycle printed
+    bool EvaluatePredicate(int id, uint32_t oldPC);
+
+    // ---------- Reference checking ----------
+    CommitRecord MakeCommitRecord(uint32_t oldPC) const;
+    bool CheckAgainstReference(const CommitRecord &actual);   // false on divergence
+    void CheckReferenceEnded();
+
+    void ContinueSimulation(ostream &out, const vector<int64_t> &cyclesToPrint, bool includeLast);
+
+    // ---------- Printing / Logging ----------
+    void PrintCycleInformation(std::ostream &out, uint32_t oldPC); // print cycle-by-cycle info
+    void PrintCycleRegisters(ostream &out);      // "-----Cycle N-----" + registers
+    void PrintMonitors(ostream &out, uint32_t oldPC);  // the "Monitors" block
+    void PrintMemoryState(ostream &out);         // the "Memory State" block
+    void PrintFinalState(ostream &out);          // print final registers/memory/cycle count
+    void DecodeMonitorRegisters(const Instruction &ins, string &m3, string &m4, string &m5);
+};
+
+// -------------------------------------------------------------------
+// =================== Incremental Re-simulation =====================
+// -------------------------------------------------------------------
+// Watch mode: runs the program once, keeping a checkpoint (a Fork plus
+// the output file offset) every 'every' cycles and the first cycle each
+// instruction ran at. When the source file changes, the new program is
+// compared with the old one instruction by instruction. The earliest
+// cycle that ran a changed instruction is where the two runs can first
+// differ, so the run resumes from the last checkpoint before it, with
+// the new program, and the output file is cut back to that checkpoint's
+// offset and rewritten from there. Edits to code that never ran cost
+// nothing at all.
+class IncrementalRunner {
+public:
+    IncrementalRunner(SingleCycleMIPS &sim, const string &inFile, const string &outFile,
+                      const vector<int64_t> &cyclesToPrint, bool includeLast, uint64_t every)
+        : sim(sim), inFile(inFile), outFile(outFile), cyclesToPrint(cyclesToPrint),
+          includeLast(includeLast), every(every ? every : 1) {}
+
+    // Runs, then re-runs on every change of the source; never returns
+    // unless a file cannot be read or written
+    bool Watch(unsigned pollMillis);
+
+    // Called by the run loop before every cycle
+    void AtCycle(const SingleCycleMIPS &at, ostream &out);
+
+private:
+    struct Checkpoint {
+        uint64_t cycle;
+        streamoff outOffset;
+        shared_ptr<const SingleCycleMIPS> state;
+    };
+    // A checkpoint holds the pages written after it, so a long run keeps
+    // at most this many: when full, every other one is dropped and the
+    // interval doubles
+    static const size_t MAX_CHECKPOINTS = 64;
+
+    bool ReadSource(string &text);
+    uint64_t FirstChangedCycle(const Program &before, const Program &after, size_t &changedIdx) const;
+    bool Resume(const Checkpoint &from, shared_ptr<const Program> program);
+
+    SingleCycleMIPS &sim;
+    string inFile, outFile;
+    vector<int64_t> cyclesToPrint;
+    bool includeLast;
+    uint64_t every;
+    uint64_t nextCheckpoint=0;
+    vector<Checkpoint> checkpoints;
+    vector<uint64_t> firstExecuted;    // first cycle each instruction ran in, 0 = never
+};
+
+// -------------------------------------------------------------------
+// LoadAssembly: Reads lines from a file, parsing them into instructions.
+//               Also identifies labels and stores them in labelMap.
+//
+// Halts early if it finds the "sll $zero, $zero, 0" instruction.
+// -------------------------------------------------------------------
+bool SingleCycleMIPS::LoadAssembly(const string &filename) {
+    ifstream fin(filename);
+    if(!fin.is_open()){
+        cerr<<"Cannot open "<<filename<<"\n";
+        return false;
+    }
+    if (programCacheDir.empty()) {
+        LoadAssembly(fin);
+        fin.close();
+        return true;
+    }
+
+    // With a program cache: look the source text up by its hash first
+    ostringstream text;
+    text << fin.rdbuf();
+    fin.close();
+    string source = text.str();
+    uint64_t hash = HashBytes(source.data(), source.size());
+    string path = ProgramCachePath(programCacheDir, hash);
+
+    if (auto cached = LoadProgramCache(path, hash, source.size())) {
+        if (debugLog) cout << "[DEBUG] Decoded program loaded from " << path << "\n";
+        program = cached;
+        return true;
+    }
+    istringstream in(source);
+    LoadAssembly(in);
+    if (!SaveProgramCache(*program, path, hash, source.size())) {
+        cerr << "Warning: could not write program cache " << path << "\n";
+    }
+    return true;
+}
+
+// -------------------------------------------------------------------
+// LoadAssembly (buffer version): parses source text already in memory,
+// reading it in place through a streambuf instead of copying it.
+// -------------------------------------------------------------------
+void SingleCycleMIPS::LoadAssembly(const char *text, size_t length) {
+    struct BufferStream : streambuf {
+        BufferStream(const char *b, size_t n) {
+            char *p = const_cast<char *>(b);    // only ever read
+            setg(p, p, p + n);
+        }
+    } buf(text, length);
+    istream in(&buf);
+    LoadAssembly(in);
+}
+
+// -------------------------------------------------------------------
+// LoadAssembly (stream version): the actual parser. Builds a new
+// Program and only publishes it once it is complete.
+// -------------------------------------------------------------------
+void SingleCycleMIPS::LoadAssembly(istream &fin) {
+    MIPS_PHASE(PH_PARSE);
+    auto built = make_shared<Program>();
+    Program &prog = *built;
+    uint32_t dataAddr = DATA_SEGMENT_BASE;
+    string line;
+    while(getline(fin,line)) {
+        // 1) Print the raw line:
+        if (debugLog) cout << "[DEBUG] Raw line read: '" << line << "'\n";
+        // Remove any comment starting with '#'
+        auto cpos = line.find('#');
+        if(cpos!=string::npos){
+            line=line.substr(0,cpos);
+        }
+        Trim(line);
+        if (line.empty()) {
+            if (debugLog) cout << "[DEBUG] => line is empty after trim\n\n";
+            continue;
+        }
+
+        // 2) Print line after trim/comment removal:
+        if (debugLog) cout << "[DEBUG] => after trim: '" << line << "'\n";
+
+        // .data [address] / .text only switch sections; .word and .space
+        // (optionally after a label, which is not kept) fill the initial
+        // memory from the data address on
+        {
+            string spaced = line;
+            for (char &c : spaced) if (c == ',') c = ' ';
+            istringstream iss(spaced);
+            vector<string> tokens;
+            string t;
+            while(iss >> t) tokens.push_back(t);
+            if(tokens.empty()) continue;
+            if(tokens[0]==".data"||tokens[0]==".text") {
+                if (tokens[0]==".data" && tokens.size()>1) ParseDataDirective(tokens, prog, dataAddr);
+                continue;
+            }
+            if (tokens.size()>1 && tokens[0].back()==':') tokens.erase(tokens.begin());
+            if (tokens[0]==".word"||tokens[0]==".space") {
+                ParseDataDirective(tokens, prog, dataAddr);
+                continue;
+            }
+        }
+
+        // Now parse the instruction
+        Instruction ins;
+        string lbl;
+        ParseLine(line, ins, lbl, prog);
+
+        // If we see sll $zero, $zero, 0, we treat that as a "halt"
+        // and stop reading further lines.
+        if (IsHalt(ins)) {
+            if (debugLog) cout << "Halt instruction encountered. Stopping further input.\n";
+            prog.instrs.push_back(ins);  // Add the halt instruction into the instruction memory.
+            prog.sourceLines.push_back(prog.strings.Intern(line));
+            break;
+        }
+
+        // If there's a valid opcode, push back the instruction
+        if(ins.op!=OP_NONE){
+            // If there's a label on the same line, map label -> current index
+            if(!lbl.empty()){
+                prog.labelMap[lbl] = (int)prog.instrs.size();
+                prog.strings.Intern(lbl);
+            }
+            prog.instrs.push_back(ins);
+            prog.sourceLines.push_back(prog.strings.Intern(line));
+        } else {
+            // Otherwise, maybe it was just a label line.
+            if(!lbl.empty()){
+                prog.labelMap[lbl] = (int)prog.instrs.size();
+                prog.strings.Intern(lbl);
+            }
+        }
+    }
+
+    ResolveLabels(prog);
+    program = built;
+}
+
+// -------------------------------------------------------------------
+// ParseDataDirective: one data line, already split into tokens
+//   .data <addr>          later data goes to <addr>
+//   .word v1, v2, ...     one word each; "v:n" repeats v n times
+//   .space n              skips n bytes (rounded up to whole words);
+//                         they read as 0 but are not stored
+// -------------------------------------------------------------------
+void SingleCycleMIPS::ParseDataDirective(const vector<string> &tokens, Program &prog, uint32_t &dataAddr) {
+    auto number = [&](const string &tok, int64_t &v) {
+        try {
+            size_t used = 0;
+            v = stoll(tok, &used, 0);
+            if (used == tok.size()) return true;
+        } catch (const std::exception &e) {
+        }
+        cerr << "Invalid " << tokens[0] << " value: " << tok << "\n";
+        return false;
+    };
+    int64_t v = 0;
+    if (tokens[0] == ".data") {
+        if (number(tokens[1], v)) dataAddr = (uint32_t)v & ~3u;
+    } else if (tokens[0] == ".space") {
+        if (tokens.size() > 1 && number(tokens[1], v) && v > 0) {
+            if (dataAddr + (((uint64_t)v + 3) & ~3ull) > 0x100000000ull) {
+                cerr << ".space " << tokens[1] << " at 0x" << hex << dataAddr << dec << " runs past the top of memory\n";
+                return;
+            }
+            dataAddr += ((uint32_t)v + 3) & ~3u;
+        }
+    } else {
+        uint32_t start = dataAddr;
+        for (size_t i = 1; i < tokens.size(); i++) {
+            string tok = tokens[i];
+            int64_t repeat = 1;
+            auto colon = tok.find(':');
+            if (colon != string::npos) {
+                if (!number(tok.substr(colon + 1), repeat)) continue;
+                tok = tok.substr(0, colon);
+            }
+            if (!number(tok, v)) continue;
+            if (repeat < 0) repeat = 0;
+            if (dataAddr + 4 * (uint64_t)repeat > 0x100000000ull) {
+                cerr << ".word " << tokens[i] << " at 0x" << hex << dataAddr << dec << " runs past the top of memory\n";
+                continue;
+            }
+            if (prog.data.size() + (uint64_t)repeat > MAX_DATA_WORDS) {
+                cerr << ".word " << tokens[i] << ": a program holds at most " << MAX_DATA_WORDS
+                     << " data words (use --load-image for more)\n";
+                continue;
+            }
+            for (int64_t k = 0; k < repeat; k++) {
+                prog.AddDataWord(dataAddr, (int32_t)v);
+                dataAddr += 4;
+            }
+        }
+        if (debugLog) cout << "[DEBUG] => .word: " << dec << (dataAddr - start) / 4 << " word(s) at 0x"
+                           << hex << start << dec << "\n\n";
+    }
+}
+
+// -------------------------------------------------------------------
+// InitialMemory: the .data words of the current program with the binary
+// images stored over them, rebuilt only when the program changes
+// -------------------------------------------------------------------
+const SparseMem &SingleCycleMIPS::InitialMemory() const {
+    if (initialFor != program) {
+        initialFor = program;
+        if (program->dataSegments.empty()) {
+            initialMem = binaryImages;
+        } else {
+            initialMem.Clear();
+            for (const DataSegment &seg : program->dataSegments) {
+                for (uint32_t i = 0; i < seg.count; i++) initialMem.Store(seg.addr + 4 * i, program->data[seg.first + i]);
+            }
+            binaryImages.ForEach([&](uint32_t addr, int32_t value) { initialMem.Store(addr, value); });
+        }
+    }
+    return initialMem;
+}
+
+// -------------------------------------------------------------------
+// LoadBinaryImage: maps a raw file and stores it word by word (host
+// order, a short last word padded with zeros) from 'addr' on
+// -------------------------------------------------------------------
+bool SingleCycleMIPS::LoadBinaryImage(const string &filename, uint32_t addr, string &error) {
+    if (addr & 3) {
+        error = "the load address of " + filename + " is not word aligned";
+        return false;
+    }
+    MappedFile file;
+    if (!file.Open(filename)) {
+        error = "cannot open " + filename;
+        return false;
+    }
+    uint64_t words = (file.Size() + 3) / 4;
+    if ((uint64_t)addr + words * 4 > 0x100000000ull) {
+        error = filename + " does not fit below the top of memory";
+        return false;
+    }
+    const char *p = file.Data();
+    for (uint64_t i = 0; i < words; i++) {
+        int32_t value = 0;
+        memcpy(&value, p + i * 4, min<uint64_t>(4, file.Size() - i * 4));
+        binaryImages.Store(addr + (uint32_t)(i * 4), value);
+    }
+    initialFor.reset();
+    return true;
+}
+
+// -------------------------------------------------------------------
+// ResolveLabels: once the whole file is read, turn every branch/jump
+// label into an instruction index so nothing is looked up while running.
+// -------------------------------------------------------------------
+void SingleCycleMIPS::ResolveLabels(Program &prog) {
+    for (Instruction &ins : prog.instrs) {
+        if (ins.op!=OP_J && ins.op!=OP_BEQ && ins.op!=OP_BNE) continue;
+        const string &lbl = prog.Label(ins);
+        if (lbl.empty()) {
+            ins.target = -2;
+        } else {
+            auto it = prog.labelMap.find(lbl);
+            ins.target = (it == prog.labelMap.end()) ? -1 : it->second;
+        }
+    }
+}
+
+// -------------------------------------------------------------------
+// RunSimulation: Executes instructions 1 cycle at a time until we
+//                either "run out" of instructions or see the halt.
+//
+//  - outFile: name of the output file to create (compressed if it ends
+//    in .lz, see OutputFile)
+//  - cyclesToPrint: which cycle numbers to log
+//  - includeLast: if true, we also print final registers/memory after
+//    the simulation ends
+// Returns false (after saying why on stderr) if the file could not be
+// opened or written.
+// -------------------------------------------------------------------
+bool SingleCycleMIPS::RunSimulation(const string &outFile, const vector<int64_t> &cyclesToPrint, bool includeLast) {
+    OutputFile file;
+    if(!file.Open(outFile)){
+        cerr<<"Cannot open "<<outFile<<"\n";
+        return false;
+    }
+    ostream &out = file.Stream();
+    // Print
+    out<<OUTPUT_HEADER;
+
+    RunSimulation(out, cyclesToPrint, includeLast);
+
+    MIPS_PHASE(PH_WRITE);
+    if (!file.Close()) {
+        cerr << "Cannot write " << outFile << "\n";
+        return false;
+    }
+    return true;
+}
+
+// -------------------------------------------------------------------
+// SetInitialRegister: remembers a register value that RunSimulation
+// applies after the usual $gp/$sp initialization.
+// -------------------------------------------------------------------
+void SingleCycleMIPS::SetInitialRegister(int reg, int32_t value) {
+    if (reg < 0 || reg >= 32) return;
+    initialRegs.push_back({reg, value});
+}
+
+// -------------------------------------------------------------------
+// RunSimulation (stream version): the actual run loop. The file version
+// above only opens the output and prints the header.
+// -------------------------------------------------------------------
+void SingleCycleMIPS::RunSimulation(ostream &out, const vector<int64_t> &cyclesToPrint, bool includeLast) {
+    Reset();
+    ContinueSimulation(out, cyclesToPrint, includeLast);
+}
+
+// -------------------------------------------------------------------
+// ContinueSimulation: the run loop from whatever state the simulator is
+// in, so a restored checkpoint can pick up where it was taken.
+// -------------------------------------------------------------------
+void SingleCycleMIPS::ContinueSimulation(ostream &out, const vector<int64_t> &cyclesToPrint, bool includeLast) {
+    // The selection, sorted so each cycle is one binary search
+    vector<int64_t> selected(cyclesToPrint);
+    sort(selected.begin(), selected.end());
+    bool printAll = binary_search(selected.begin(), selected.end(), -1);
+    auto isSelected = [&](uint64_t cycle) {
+        return binary_search(selected.begin(), selected.end(), (int64_t)cycle);
+    };
+
+    // Main loop: one cycle at a time, printing the ones asked for
+    while(!finished) {
+        if (incremental) incremental->AtCycle(*this, out);
+
+        // Capture oldPC BEFORE executing the instruction
+        uint32_t oldPC = rf.pc;
+        bool watchHit = false;
+        if (!StepCycle(watchHit)) break;
+
+        // If this cycle is one the user asked to print (or if "all"),
+        // we log it
+        bool shouldPrint = false;
+        if (sampler) {
+            if (cycleCount == sampler->Next()) {
+                string text;
+                if (sampler->Deferred()) {
+                    ostringstream cycleText;
+                    PrintCycleInformation(cycleText, oldPC);
+                    text = cycleText.str();
+                } else {
+                    shouldPrint = true;
+                }
+                sampler->Take(cycleCount, oldPC, IR->op, std::move(text));
+            }
+        } else if (finished) {
+            MIPS_PHASE(PH_SELECT);
+            // If we just executed the halt (final) cycle, print its monitor info only if the user
+            // explicitly requested that cycle number.
+            if (isSelected(cycleCount))
+                shouldPrint = true;
+        } else {
+            MIPS_PHASE(PH_SELECT);
+            if (printAll || isSelected(cycleCount))
+                shouldPrint = true;
+        }
+        
+        if (watchHit) shouldPrint = true;
+
+        if (deltaOut) {
+            deltaDirty.insert(changedAddrs.begin(), changedAddrs.end());
+        }
+        if (renderer) {
+            imageDirty.insert(imageDirty.end(), changedAddrs.begin(), changedAddrs.end());
+        }
+        if (shouldPrint) {
+            if (renderer) {
+                renderer->Add(TakeSnapshot(oldPC));
+            } else if (deltaOut) {
+                ostringstream monitors;
+                PrintMonitors(monitors, oldPC);
+                deltaOut->WriteCycle(cycleCount, rf.pc, rf.regs, mem, deltaDirty, monitors.str());
+                deltaDirty.clear();
+            } else {
+                PrintCycleInformation(out, oldPC);
+            }
+        }
+        if (stopRequested || livelocked || outOfBudget || interrupted) break;
+    }
+
+    if (reference && !diverged) CheckReferenceEnded();
+    if (progress && !progress->Write(cycleCount, rf.pc,
+                                     chrono::duration<double>(chrono::steady_clock::now() - runStart).count(),
+                                     StopReason())) {
+        cerr << "Warning: could not write the progress marker\n";
+    }
+
+    // With a renderer the rest of the output goes through it as well
+    ostringstream rendered;
+    ostream &rest = renderer ? rendered : out;
+
+    if (sampler && sampler->Deferred()) sampler->WriteDeferred(rest);
+
+    // If user wants final snapshot, print it now
+    if (includeLast){
+        if (deltaOut) deltaOut->WriteFinal(cycleCount, rf.pc, rf.regs, mem);
+        else          PrintFinalState(rest);
+    }
+    if (sampler) sampler->WriteSummary(rest, cycleCount);
+    if (renderer) renderer->AddText(rendered.str());
+}
+
+// -------------------------------------------------------------------
+// TakeSnapshot: this cycle's printout as data, for the renderer. Only
+// the Monitors block is formatted here; it depends on the decoded
+// instruction, and it is short.
+// -------------------------------------------------------------------
+CycleSnapshot SingleCycleMIPS::TakeSnapshot(uint32_t oldPC) {
+    MIPS_PHASE(PH_FORMAT);
+    CycleSnapshot snap;
+    snap.cycle = cycleCount;
+    snap.pc = rf.pc;
+    memcpy(snap.regs, rf.regs, sizeof(snap.regs));
+    ostringstream monitors;
+    PrintMonitors(monitors, oldPC);
+    snap.monitors = monitors.str();
+    memImage = UpdateMemoryImage(memImage, mem, imageDirty);
+    snap.memory = memImage;
+    return snap;
+}
+
+// -------------------------------------------------------------------
+// Reset: back to the starting state ($gp/$sp defaults plus the initial
+// registers, PC 0, the initial memory) without reloading the program.
+// -------------------------------------------------------------------
+void SingleCycleMIPS::Reset() {
+    // Initialize registers
+    memset(rf.regs,0,sizeof(rf.regs));
+    // Typical GP and SP initialization that are given
+    rf.regs[28]=0x10008000; // $gp
+    rf.regs[29]=0x7ffffffc; // $sp
+    for (auto &r : initialRegs) {
+        rf.regs[r.first] = r.second;
+    }
+    rf.pc=0;
+    // O(1): the pages stay shared with the initial memory until stored to
+    mem = InitialMemory();
+
+    cycleCount=0;
+    finished=false;
+    stopRequested=false;
+    for (Predicate &pr : predicates) {
+        pr.hits = 0;
+        pr.lastValue = false;
+        pr.evaluatedAt = 0;
+    }
+    livelocked=false;
+    outOfBudget=false;
+    outOfTime=false;
+    interrupted=false;
+    runStart = chrono::steady_clock::now();
+    nextPoll = (timeBudget > 0 || progress) ? LONG_RUN_POLL : UINT64_MAX;
+    if (detectLoops) StartLoopDetection();
+    if (sampler) sampler->Start();
+    if (execProfile) execProfile->Start(*program);
+    bool laidOut = layout && layout->program == program;
+    layoutInstrs = laidOut ? layout->instrs.data() : nullptr;
+    layoutSlot = laidOut ? layout->slotOf.data() : nullptr;
+    layoutNext = laidOut ? layout->next.data() : nullptr;
+    nextSlotPC = UINT32_MAX;
+    memImage.reset();
+    imageDirty.clear();
+}
+
+// -------------------------------------------------------------------
+// StepCycle: fetches and executes one instruction, then runs the
+// per-cycle checks (commit trace, reference, breakpoints, livelock,
+// budget). Returns false when no cycle ran: the PC left the program
+// (which ends the run) or the cycle did not match the reference.
+// -------------------------------------------------------------------
+bool SingleCycleMIPS::StepCycle(bool &watchHit) {
+    const Program &prog = *program;
+    uint32_t oldPC = rf.pc;
+    uint32_t idx = oldPC/4;
+    uint32_t slot = 0;      // position in the layout, if there is one
+
+    // Fetch
+    const Instruction *fetched;
+    {
+        MIPS_PHASE(PH_FETCH);
+        if(idx >= prog.instrs.size()) {
+            // the slot after the last instruction stands for "ran off the end"
+            if (firstExecuted && (*firstExecuted)[prog.instrs.size()] == 0)
+                (*firstExecuted)[prog.instrs.size()] = cycleCount + 1;
+            finished = true;
+            return false;
+        }
+        if (layoutSlot) {
+            slot = oldPC == nextSlotPC ? nextSlot : layoutSlot[idx];
+            fetched = &layoutInstrs[slot];
+        } else {
+            fetched = &prog.instrs[idx];
+        }
+        if (firstExecuted && (*firstExecuted)[idx] == 0) (*firstExecuted)[idx] = cycleCount + 1;
+    }
+    const Instruction &ins = *fetched;
+    IR = &ins;
+    irIndex = idx;
+
+    cycleCount++;
+    MIPS_CYCLE_DONE();
+
+    // Reset the monitoring for this cycle
+    didLoad=false;
+    didStore=false;
+    memAddress=0;
+    storeValue=0;
+    loadValue=0;
+    showBranchLabel=false;
+    aluOut=0;
+    memDataReg=0;
+    regA=0;
+    regB=0;
+    changedAddrs.clear();
+    regWritten=-1;
+
+    // Single-cycle logic
+    ExecuteInstruction(ins);
+    if (execProfile) execProfile->Record(idx, rf.pc / 4);
+    if (layoutSlot) {
+        nextSlotPC = rf.pc;
+        if (rf.pc == oldPC + 4) nextSlot = layoutNext[2 * slot];
+        else if (ins.target >= 0 && rf.pc == (uint32_t)ins.target * 4) nextSlot = layoutNext[2 * slot + 1];
+        else nextSlotPC = UINT32_MAX;
+    }
+
+    // Record / check what this cycle changed
+    if (commitOut || reference) {
+        CommitRecord rec = MakeCommitRecord(oldPC);
+        if (commitOut) commitOut->Write(rec, rf.pc, rf.regs);
+        if (reference && !CheckAgainstReference(rec)) return false;
+    }
+
+    watchHit = havePredicates && CheckPredicates(oldPC);
+
+    if (!finished && detectLoops && CheckForLoop()) {
+        if (stopReports) cerr << "Livelock at cycle " << dec << cycleCount << " (PC 0x" << hex << rf.pc << dec
+             << "): the state of cycle " << savedAt << " repeats every " << period
+             << " cycles, the program never halts\n";
+        livelocked = true;
+    }
+    else if (!finished && cycleBudget && cycleCount >= cycleBudget) {
+        if (stopReports) cerr << "Cycle budget of " << dec << cycleBudget << " used up (PC 0x" << hex << rf.pc << dec
+             << "), stopping\n";
+        outOfBudget = true;
+    }
+    else if (!finished && cycleCount >= nextPoll) PollLongRun();
+    return true;
+}
+
+// -------------------------------------------------------------------
+// PollLongRun: the checks that only run every LONG_RUN_POLL cycles -
+// a stop signal, the wall-clock budget and the progress marker
+// -------------------------------------------------------------------
+void SingleCycleMIPS::PollLongRun() {
+    nextPoll = cycleCount + LONG_RUN_POLL;
+    auto now = chrono::steady_clock::now();
+    double elapsed = chrono::duration<double>(now - runStart).count();
+    if (stopSignal) {
+        if (stopReports) cerr << "Interrupted at cycle " << dec << cycleCount << " (PC 0x" << hex << rf.pc << dec
+             << "), stopping\n";
+        interrupted = true;
+    } else if (timeBudget > 0 && elapsed >= timeBudget) {
+        if (stopReports) cerr << "Time budget of " << timeBudget << " s used up at cycle " << dec << cycleCount
+             << " (PC 0x" << hex << rf.pc << dec << "), stopping\n";
+        outOfBudget = outOfTime = true;
+    } else if (progress && progress->Due(now)) {
+        progress->Write(cycleCount, rf.pc, elapsed, "running");
+    }
+}
+
+const char *SingleCycleMIPS::StopReason() const {
+    if (finished)      return "halted";
+    if (diverged)      return "diverged";
+    if (livelocked)    return "livelock";
+    if (outOfTime)     return "time-budget";
+    if (outOfBudget)   return "cycle-budget";
+    if (interrupted)   return "interrupted";
+    if (stopRequested) return "breakpoint";
+    return "running";
+}
+
+// -------------------------------------------------------------------
+// Step: runs up to n cycles for a caller driving the simulator directly.
+// Stops early when the program ends or a breakpoint, livelock, budget or
+// reference difference stops it; a later Step continues past a
+// breakpoint. Returns the number of cycles run.
+// -------------------------------------------------------------------
+uint64_t SingleCycleMIPS::Step(uint64_t n) {
+    stopRequested = false;
+    uint64_t ran = 0;
+    while (ran < n && !Stopped()) {
+        bool watchHit = false;
+        if (!StepCycle(watchHit)) break;
+        ran++;
+        if (stopRequested) break;
+    }
+    return ran;
+}
+
+// -------------------------------------------------------------------
+// RunUntil: Step, but also stops as soon as stop(*this, ctx) is true
+// after a cycle (or after maxCycles cycles, 0 = no limit).
+// -------------------------------------------------------------------
+uint64_t SingleCycleMIPS::RunUntil(bool (*stop)(const SingleCycleMIPS &, void *), void *ctx, uint64_t maxCycles) {
+    stopRequested = false;
+    uint64_t ran = 0;
+    while ((maxCycles == 0 || ran < maxCycles) && !Stopped()) {
+        bool watchHit = false;
+        if (!StepCycle(watchHit)) break;
+        ran++;
+        if (stopRequested || (stop && stop(*this, ctx))) break;
+    }
+    return ran;
+}
+
+// -------------------------------------------------------------------
+// ExecuteInstruction: runs one instruction through the handler for its
+// opcode. The handlers are instantiated from the ISA table, one per
+// Opcode, and reached through a table of member pointers.
+// -------------------------------------------------------------------
+template <size_t... OPS>
+const auto &SingleCycleMIPS::ExecuteHandlers(index_sequence<OPS...>) {
+    typedef void (SingleCycleMIPS::*Handler)(const Instruction &);
+    static constexpr Handler handlers[] = { &SingleCycleMIPS::Execute<(uint8_t)OPS>... };
+    return handlers;
+}
+
+void SingleCycleMIPS::ExecuteInstruction(const Instruction &ins) {
+    static const auto &handlers = ExecuteHandlers(make_index_sequence<OP_UNKNOWN + 1>());
+    (this->*handlers[ins.op])(ins);
+}
+
+// -------------------------------------------------------------------
+// Execute<OP>: The main single-cycle logic for one instruction.
+// 1) Determine control signals
+// 2) Read register file
+// 3) (immediates were already sign/zero-extended by ParseInstruction)
+// 4) Handle jumps/branches
+// 5) ALU
+// 6) Memory read/write
+// 7) Write back
+// 8) PC increment
+// Every step is decided by ISA[OP] at compile time.
+// -------------------------------------------------------------------
+template <uint8_t OP>
+void SingleCycleMIPS::Execute(const Instruction &ins) {
+    constexpr IsaEntry E = ISA[OP];
+
+    // Step 1: Control
+    {
+        MIPS_PHASE(PH_CONTROL);
+        ctrl = E.control;
+    }
+
+    // Step 2: read regs
+    regA = rf.regs[ins.rs];
+    regB = rf.regs[ins.rt];
+
+    // Step 4: handle j, beq, bne (which modify PC directly)
+    if constexpr (E.format == FMT_JUMP) {
+        if (debugLog) LogJump(E.name, ins);
+
+        if(ins.target!=-2){
+            if(ins.target>=0){
+                rf.pc = ins.target*4;
+            } else {
+                finished=true;
+            }
+        }
+        return;
+    } else if constexpr (E.format == FMT_BRANCH) {
+        showBranchLabel = true;
+
+        bool taken = (E.cond == COND_EQ) ? (regA==regB) : (regA!=regB);
+        if (debugLog) LogBranch(E.name, taken, ins);
+        if(taken){
+            if(ins.target!=-2){
+                if(ins.target>=0){
+                    rf.pc = ins.target*4;
+                } else {
+                    finished=true;
+                }
+            }
+        } else {
+            rf.pc+=4;
+        }
+        return;
+    } else {
+        // Step 5: normal ALU (shifts take the amount from the immediate)
+        {
+            MIPS_PHASE(PH_ALU);
+            if constexpr (E.format == FMT_SHIFT) aluOut = IsaAluResult<E.alu>(regB, ins.imm);
+            else aluOut = IsaAluResult<E.alu>(regA, E.control.ALUSource ? ins.imm : regB);
+        }
+
+        // Step 6: memory ops
+        if constexpr (E.control.MemoryRead) {
+            MIPS_PHASE(PH_MEMORY);
+            didLoad=true;
+            memAddress= aluOut;
+            // If address not in memory, default 0
+            memDataReg=mem.Load(aluOut);
+        } else if constexpr (E.control.MemoryWrite) {
+            MIPS_PHASE(PH_MEMORY);
+            didStore=true;
+            memAddress= aluOut;
+            storeValue= regB;
+            if (detectLoops) {
+                uint64_t key = STATE_KEY_MEM | (uint32_t)aluOut;
+                stateHash ^= StateTerm(key, mem.Load(aluOut)) ^ StateTerm(key, regB);
+            }
+            mem.Store(aluOut, regB);       // store
+            changedAddrs.push_back(aluOut);
+        }
+
+        // Step 7: write back
+        // If it's the "halt" instruction, we stop
+        if constexpr (OP == OP_SLL) {
+            if(IsHalt(ins)){
+                finished = true;
+                rf.pc += 4;  // increment PC for the halt cycle so that final PC becomes PC+4
+                return;
+            }
+        }
+        if constexpr (E.format == FMT_R && (E.alu == ALU_SLT || E.alu == ALU_SLTU)) {
+            // R-type set-less-than: the boolean goes to the register but the
+            // ALU out shows the raw subtraction result
+            WriteRegister(ins.rd, aluOut);
+            aluOut = (int32_t)((uint32_t)regA - (uint32_t)regB);
+        } else if constexpr (E.dest == DEST_RD) {
+            WriteRegister(ins.rd, aluOut);
+        } else if constexpr (E.dest == DEST_RT) {
+            WriteRegister(ins.rt, E.control.MemoryToRegister ? memDataReg : aluOut);
+        }
+
+        // Step 8: increment PC
+        rf.pc +=4;
+    }
+}
+
+// -------------------------------------------------------------------
+// LogJump / LogBranch: the [DEBUG] lines of a jump or branch, printed
+// before it changes the PC
+// -------------------------------------------------------------------
+void SingleCycleMIPS::LogJump(const char *name, const Instruction &ins) {
+    // Show the current PC, the jump, and where we go
+    cout << "[DEBUG] (PC=0x" << hex << rf.pc << ") " << name << " " << program->Label(ins) << "\n";
+    if (ins.target >= 0) cout << "       => Jumping to PC=0x" << ins.target*4 << "\n";
+    else if (ins.target != -2) cout << "       => label not found => finishing.\n";
+}
+
+void SingleCycleMIPS::LogBranch(const char *name, bool taken, const Instruction &ins) {
+    // Show the current PC, the condition, and the result
+    cout << "[DEBUG] (PC=0x" << hex << rf.pc << ") " << name << ": regA=0x" << regA << ", regB=0x" << regB << "\n";
+    if (!taken) {
+        cout << "       => NOT taken => next PC=0x" << (rf.pc+4) << "\n";
+        return;
+    }
+    cout << "       => condition is TRUE => branch TAKEN\n";
+    if (ins.target >= 0) cout << "       => new PC=0x" << ins.target*4 << "\n";
+    else if (ins.target != -2) cout << "       => label not found => finishing.\n";
+}
+
+// -------------------------------------------------------------------
+// AddPredicate: compiles a --break/--watch expression and files it under
+// the PC, register or addresses that can make it fire.
+// -------------------------------------------------------------------
+bool SingleCycleMIPS::AddPredicate(const string &spec, bool isBreak, string &error) {
+    PredicateCompiler compiler(*program, [](const string &name) { return ParseRegister(name); });
+    Predicate pred;
+    if (!compiler.Compile(spec, isBreak, pred, error)) return false;
+
+    int id = (int)predicates.size();
+    switch (pred.trigger) {
+    case Predicate::AT_PC:
+        pcPredicates[pred.where].push_back(id);
+        pcHasPredicate.resize(program->instrs.size(), 0);
+        if (pred.where % 4 == 0 && pred.where / 4 < pcHasPredicate.size()) pcHasPredicate[pred.where / 4] = 1;
+        break;
+    case Predicate::WRITE_REG:
+        regPredicates[pred.where].push_back(id);
+        regPredicateMask |= 1u << pred.where;
+        break;
+    case Predicate::WRITE_MEM:
+        memPredicates[pred.where].push_back(id);
+        break;
+    case Predicate::BECOMES_TRUE:
+        if (pred.readsPcOrCycle) {
+            everyCyclePredicates.push_back(id);
+            break;
+        }
+        for (int r : pred.regsRead) {
+            if (regPredicates[r].empty() || regPredicates[r].back() != id) regPredicates[r].push_back(id);
+            regPredicateMask |= 1u << r;
+        }
+        for (uint32_t a : pred.addrsRead) memPredicates[a].push_back(id);
+        if (pred.readsAnyAddr) anyStorePredicates.push_back(id);
+        break;
+    }
+    predicates.push_back(pred);
+    havePredicates = true;
+    return true;
+}
+
+// -------------------------------------------------------------------
+// CheckPredicates: runs only the predicates this cycle can affect: the
+// ones at this PC, on the register just written, or on the stored word.
+// -------------------------------------------------------------------
+bool SingleCycleMIPS::CheckPredicates(uint32_t oldPC) {
+    bool print = false;
+    uint32_t idx = oldPC / 4;
+    if (idx < pcHasPredicate.size() && pcHasPredicate[idx]) {
+        for (int id : pcPredicates[oldPC]) print |= EvaluatePredicate(id, oldPC);
+    }
+    if (regWritten >= 0 && (regPredicateMask >> regWritten) & 1) {
+        for (int id : regPredicates[regWritten]) print |= EvaluatePredicate(id, oldPC);
+    }
+    if (!changedAddrs.empty()) {
+        if (!memPredicates.empty()) {
+            for (uint32_t addr : changedAddrs) {
+                auto it = memPredicates.find(addr);
+                if (it == memPredicates.end()) continue;
+                for (int id : it->second) print |= EvaluatePredicate(id, oldPC);
+            }
+        }
+        for (int id : anyStorePredicates) print |= EvaluatePredicate(id, oldPC);
+    }
+    for (int id : everyCyclePredicates) print |= EvaluatePredicate(id, oldPC);
+    return print;
+}
+
+// -------------------------------------------------------------------
+// EvaluatePredicate: one trigger of one predicate; reports it and
+// returns true if it fired.
+// -------------------------------------------------------------------
+bool SingleCycleMIPS::EvaluatePredicate(int id, uint32_t oldPC) {
+    Predicate &pred = predicates[id];
+    if (pred.evaluatedAt == cycleCount) return false;   // already seen this cycle
+    pred.evaluatedAt = cycleCount;
+
+    PredicateContext ctx = {rf.regs, &mem, oldPC, cycleCount, pred.hits};
+    bool fired;
+    if (pred.trigger == Predicate::BECOMES_TRUE) {
+        bool value = RunPredicate(pred.code, ctx) != 0;
+        fired = value && !pred.lastValue;
+        pred.lastValue = value;
+        if (fired) pred.hits++;
+    } else {
+        ctx.hits = ++pred.hits;
+        fired = pred.code.empty() || RunPredicate(pred.code, ctx) != 0;
+    }
+    if (!fired) return false;
+
+    if (stopReports) cout << (pred.isBreak ? "[BREAK] " : "[WATCH] ") << "cycle " << dec << cycleCount
+         << ", PC 0x" << hex << oldPC << dec << ": " << pred.text << "\n";
+    if (pred.isBreak) stopRequested = true;
+    return true;
+}
+
+// -------------------------------------------------------------------
+// StartLoopDetection: hashes the starting state in full; from here on
+// WriteRegister and sw keep the hash up to date.
+// -------------------------------------------------------------------
+void SingleCycleMIPS::StartLoopDetection() {
+    stateHash = 0;
+    for (int r = 0; r < 32; r++) stateHash ^= StateTerm(r, rf.regs[r]);
+    mem.ForEach([&](uint32_t addr, int32_t value) { stateHash ^= StateTerm(STATE_KEY_MEM | addr, value); });
+    power = 1;
+    period = 0;
+    savedAt = cycleCount;
+    savedHash = stateHash ^ StateTerm(STATE_KEY_PC, rf.pc);
+    saved.pc = rf.pc;
+    memcpy(saved.regs, rf.regs, sizeof(saved.regs));
+    saved.mem = mem;
+}
+
+// -------------------------------------------------------------------
+// CheckForLoop: Brent's algorithm. The state is compared with the one
+// saved at the last power-of-two checkpoint, which finds any loop within
+// about twice its start + length cycles while only keeping one snapshot.
+// A hash match is confirmed against the snapshot, so a report is proof.
+// -------------------------------------------------------------------
+bool SingleCycleMIPS::CheckForLoop() {
+    uint64_t h = stateHash ^ StateTerm(STATE_KEY_PC, rf.pc);
+    period++;
+    if (h == savedHash && saved.Same(rf.pc, rf.regs, mem)) return true;
+    if (period == power) {
+        power *= 2;
+        period = 0;
+        savedAt = cycleCount;
+        savedHash = h;
+        saved.pc = rf.pc;
+        memcpy(saved.regs, rf.regs, sizeof(saved.regs));
+        saved.mem = mem;
+    }
+    return false;
+}
+
+// -------------------------------------------------------------------
+// Fork: a copy of the whole simulator. Copying is cheap by design: the
+// memory shares its pages and the program is shared; only the outputs
+// are dropped so the child does not write into the parent's files.
+// -------------------------------------------------------------------
+SingleCycleMIPS SingleCycleMIPS::Fork() const {
+    SingleCycleMIPS child(*this);
+    child.commitOut = nullptr;
+    child.reference = nullptr;
+    child.deltaOut = nullptr;
+    child.sampler = nullptr;
+    child.renderer = nullptr;
+    child.incremental = nullptr;
+    child.firstExecuted = nullptr;
+    child.progress = nullptr;
+    child.execProfile = nullptr;
+    if (child.timeBudget <= 0) child.nextPoll = UINT64_MAX;
+    return child;
+}
+
+// -------------------------------------------------------------------
+// SetRegisterNow / StoreWord / SetPC: change the live state. A changed
+// state starts loop detection over, since the states seen so far may
+// not lead to the new one any more.
+// -------------------------------------------------------------------
+void SingleCycleMIPS::SetRegisterNow(int reg, int32_t value) {
+    if (reg < 0 || reg >= 32) return;
+    rf.regs[reg] = value;
+    if (detectLoops) StartLoopDetection();
+}
+
+void SingleCycleMIPS::StoreWord(uint32_t addr, int32_t value) {
+    mem.Store(addr, value);
+    memImage.reset();
+    if (detectLoops) StartLoopDetection();
+}
+
+void SingleCycleMIPS::SetPC(uint32_t pc) {
+    rf.pc = pc;
+    finished = false;
+    if (detectLoops) StartLoopDetection();
+}
+
+// -------------------------------------------------------------------
+// PatchInstruction: replaces the instruction at 'pc' in this simulator's
+// own copy of the program (other simulators keep the original)
+// -------------------------------------------------------------------
+bool SingleCycleMIPS::PatchInstruction(uint32_t pc, const string &text, string &error) {
+    if (pc % 4 != 0 || pc / 4 >= program->instrs.size()) {
+        ostringstream msg;
+        msg << "no instruction at 0x" << hex << pc;
+        error = msg.str();
+        return false;
+    }
+    string body = text;
+    Trim(body);
+    auto patched = make_shared<Program>(*program);
+    Instruction ins;
+    try {
+        ParseInstruction(body, ins, *patched);     // a bad immediate throws
+    } catch (const std::exception &) {
+        ins.op = OP_UNKNOWN;                         // this may run on a variant's thread
+    }
+    if (ins.op == OP_NONE || ins.op == OP_UNKNOWN) {
+        error = "cannot parse instruction '" + body + "'";
+        return false;
+    }
+    patched->instrs[pc / 4] = ins;
+    patched->sourceLines[pc / 4] = patched->strings.Intern(body);
+    ResolveLabels(*patched);
+    program = patched;
+    layoutInstrs = nullptr;       // the layout was made for the old program
+    layoutSlot = layoutNext = nullptr;
+    if (detectLoops) StartLoopDetection();
+    return true;
+}
+
+// -------------------------------------------------------------------
+// ApplyEdit: parses one what-if edit and applies it
+// -------------------------------------------------------------------
+bool SingleCycleMIPS::ApplyEdit(const string &edit, string &error) {
+    string e = edit;
+    Trim(e);
+    auto number = [&](const string &text, int64_t &value) {
+        string t = text;
+        Trim(t);
+        try {
+            size_t used = 0;
+            value = stoll(t, &used, 0);
+            return used == t.size();
+        } catch (const std::exception &) {
+            return false;
+        }
+    };
+    int64_t where = 0, value = 0;
+    size_t eq = e.find('=');
+
+    if (!e.empty() && e[0] == '$' && eq != string::npos) {
+        int reg = ParseRegister(e.substr(0, eq));
+        if (reg < 0 || !number(e.substr(eq + 1), value)) {
+            error = "bad register edit '" + e + "'";
+            return false;
+        }
+        SetRegisterNow(reg, (int32_t)value);
+        return true;
+    }
+    if (e.compare(0, 4, "mem[") == 0) {
+        size_t close = e.find("]=");
+        if (close == string::npos || !number(e.substr(4, close - 4), where) ||
+            !number(e.substr(close + 2), value)) {
+            error = "bad memory edit '" + e + "'";
+            return false;
+        }
+        StoreWord((uint32_t)where, (int32_t)value);
+        return true;
+    }
+    if (e.compare(0, 3, "pc=") == 0) {
+        if (!number(e.substr(3), value)) {
+            error = "bad pc edit '" + e + "'";
+            return false;
+        }
+        SetPC((uint32_t)value);
+        return true;
+    }
+    size_t colon = e.find(':');
+    if (colon != string::npos) {
+        string at = e.substr(0, colon);
+        Trim(at);
+        auto label = program->labelMap.find(at);
+        if (label != program->labelMap.end()) where = (int64_t)label->second * 4;
+        else if (!number(at, where)) {
+            error = "unknown label or address '" + at + "'";
+            return false;
+        }
+        return PatchInstruction((uint32_t)where, e.substr(colon + 1), error);
+    }
+    error = "cannot understand edit '" + e + "'";
+    return false;
+}
+
+// -------------------------------------------------------------------
+// RunVariants: the --fork-at mode. The parent runs once up to the fork
+// point; every variant then only pays for its own cycles after it.
+// -------------------------------------------------------------------
+bool SingleCycleMIPS::RunVariants(ostream &out, uint64_t forkCycle, const vector<string> &variants,
+                                  unsigned threads, string &error) {
+    Reset();
+    Step(forkCycle);
+    if (cycleCount < forkCycle) {
+        error = "the program stopped at cycle " + to_string(cycleCount) + ", before the fork point";
+        return false;
+    }
+
+    vector<string> results(variants.size());
+    vector<string> errors(variants.size());
+    vector<char> outOfBudgets(variants.size(), 0);
+    atomic<size_t> next{0};
+    auto work = [&]() {
+        for (size_t v = next++; v < variants.size(); v = next++) {
+            SingleCycleMIPS child = Fork();
+            stringstream edits(variants[v]);
+            string edit;
+            bool ok = true;
+            while (ok && getline(edits, edit, ';')) {
+                Trim(edit);
+                if (!edit.empty() && edit != "-") ok = child.ApplyEdit(edit, errors[v]);
+            }
+            if (!ok) continue;
+            child.Step(UINT64_MAX);
+            outOfBudgets[v] = child.OutOfBudget();
+            ostringstream text;
+            text << "-----Variant " << v + 1 << ": " << variants[v];
+            if (outOfBudgets[v]) text << " (stopped at the cycle budget)";
+            text << "-----\n";
+            child.PrintFinalState(text);
+            results[v] = text.str();
+        }
+    };
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+    threads = (unsigned)min<size_t>(threads, max<size_t>(1, variants.size()));
+    vector<thread> pool;
+    for (unsigned t = 1; t < threads; t++) pool.emplace_back(work);
+    work();
+    for (thread &t : pool) t.join();
+
+    for (size_t v = 0; v < variants.size(); v++) {
+        if (!errors[v].empty()) {
+            error = "variant " + to_string(v + 1) + ": " + errors[v];
+            return false;
+        }
+        out << results[v];
+        if (outOfBudgets[v]) outOfBudget = true;
+    }
+    return true;
+}
+
+// -------------------------------------------------------------------
+// LoadVariants: one variant per line, '#' starts a comment; a line of
+// just "-" is the unchanged continuation
+// -------------------------------------------------------------------
+bool SingleCycleMIPS::LoadVariants(const string &filename, vector<string> &variants) {
+    ifstream fin(filename);
+    if (!fin.is_open()) {
+        cerr << "Cannot open " << filename << "\n";
+        return false;
+    }
+    string line;
+    while (getline(fin, line)) {
+        auto cpos = line.find('#');
+        if (cpos != string::npos) line = line.substr(0, cpos);
+        auto first = line.find_first_not_of(" \t\r");
+        if (first == string::npos) continue;
+        auto last = line.find_last_not_of(" \t\r");
+        variants.push_back(line.substr(first, last - first + 1));
+    }
+    return true;
+}
+
+// -------------------------------------------------------------------
+// WriteRegister: the register-file write port. Also remembers which
+// register this cycle wrote, for the commit trace.
+// -------------------------------------------------------------------
+void SingleCycleMIPS::WriteRegister(int reg, int32_t value) {
+    if (detectLoops) stateHash ^= StateTerm(reg, rf.regs[reg]) ^ StateTerm(reg, value);
+    rf.regs[reg] = value;
+    regWritten = reg;
+    regWriteValue = value;
+}
+
+// -------------------------------------------------------------------
+// MakeCommitRecord: what the cycle that just ran changed
+// -------------------------------------------------------------------
+CommitRecord SingleCycleMIPS::MakeCommitRecord(uint32_t oldPC) const {
+    CommitRecord rec;
+    rec.cycle = cycleCount;
+    rec.pc = oldPC;
+    if (regWritten >= 0) {
+        rec.flags |= CommitRecord::HAS_REG;
+        rec.reg = (uint8_t)regWritten;
+        rec.regValue = regWriteValue;
+    }
+    if (!changedAddrs.empty()) {
+        rec.flags |= CommitRecord::HAS_MEM;
+        rec.memAddr = changedAddrs.back();
+        rec.memValue = storeValue;
+    }
+    return rec;
+}
+
+// -------------------------------------------------------------------
+// CheckAgainstReference: compares this cycle with the next record of the
+// reference trace. On the first difference it prints which field
+// differs (expected vs actual) and returns false so the run stops.
+// -------------------------------------------------------------------
+bool SingleCycleMIPS::CheckAgainstReference(const CommitRecord &actual) {
+    CommitRecord expected;
+    if (!reference->Next(expected)) {
+        if (reference->BadLine()) {
+            cerr << "Reference trace: bad line " << dec << reference->BadLine() << "\n";
+            diverged = true;
+            return false;
+        }
+        cerr << "Divergence at cycle " << dec << actual.cycle
+             << ": reference trace ended, simulator still running (PC 0x" << hex << actual.pc << ")\n";
+        diverged = true;
+        return false;
+    }
+
+    auto report = [&](const string &field, const string &exp, const string &act) {
+        cerr << "Divergence at cycle " << dec << actual.cycle << " (PC 0x" << hex << actual.pc << "): "
+             << field << " expected " << exp << ", actual " << act << "\n";
+        diverged = true;
+        return false;
+    };
+    auto hexStr = [](uint32_t v) { ostringstream o; o << "0x" << hex << v; return o.str(); };
+    auto regWrite = [&](const CommitRecord &r) {
+        if (!(r.flags & CommitRecord::HAS_REG)) return string("none");
+        return "$" + to_string(r.reg) + "=" + hexStr((uint32_t)r.regValue);
+    };
+    auto memWrite = [&](const CommitRecord &r) {
+        if (!(r.flags & CommitRecord::HAS_MEM)) return string("none");
+        return "[" + hexStr(r.memAddr) + "]=" + hexStr((uint32_t)r.memValue);
+    };
+
+    if (expected.cycle != actual.cycle)
+        return report("cycle", to_string(expected.cycle), to_string(actual.cycle));
+    if (expected.pc != actual.pc)
+        return report("pc", hexStr(expected.pc), hexStr(actual.pc));
+    if ((expected.flags & CommitRecord::HAS_REG) != (actual.flags & CommitRecord::HAS_REG) ||
+        ((actual.flags & CommitRecord::HAS_REG) &&
+         (expected.reg != actual.reg || expected.regValue != actual.regValue)))
+        return report("register write", regWrite(expected), regWrite(actual));
+    if ((expected.flags & CommitRecord::HAS_MEM) != (actual.flags & CommitRecord::HAS_MEM) ||
+        ((actual.flags & CommitRecord::HAS_MEM) &&
+         (expected.memAddr != actual.memAddr || expected.memValue != actual.memValue)))
+        return report("memory write", memWrite(expected), memWrite(actual));
+    return true;
+}
+
+// -------------------------------------------------------------------
+// CheckReferenceEnded: the run finished; the reference must end too.
+// -------------------------------------------------------------------
+void SingleCycleMIPS::CheckReferenceEnded() {
+    CommitRecord expected;
+    if (reference->Next(expected)) {
+        cerr << "Divergence after cycle " << dec << cycleCount
+             << ": simulator finished but the reference continues at cycle " << expected.cycle
+             << " (PC 0x" << hex << expected.pc << ")\n";
+        diverged = true;
+    } else if (reference->BadLine()) {
+        cerr << "Reference trace: bad line " << dec << reference->BadLine() << "\n";
+        diverged = true;
+    }
+}
+
+// -------------------------------------------------------------------
+// Trim: removes leading/trailing whitespace in a string
+// -------------------------------------------------------------------
+void SingleCycleMIPS::Trim(string &s){
+    while(!s.empty() && isspace((unsigned char)s.front())) s.erase(s.begin());
+    while(!s.empty() && isspace((unsigned char)s.back()))  s.pop_back();
+}
+
+// -------------------------------------------------------------------
+// ParseLine: checks if there's a label ("something:") in the line,
+//            then parses the rest as an instruction.
+//
+// e.g. "start: addi $t0, $zero, 5"
+// -------------------------------------------------------------------
+void SingleCycleMIPS::ParseLine(const string &line, Instruction &ins, string &lbl, Program &prog){
+    auto p=line.find(':');
+    if(p!=string::npos){
+        lbl=line.substr(0,p);
+        Trim(lbl);
+        string after=line.substr(p+1);
+        Trim(after);
+        if(!after.empty()){
+            ParseInstruction(after,ins,prog);
+        }
+    } else {
+        // no label, just parse
+        ParseInstruction(line,ins,prog);
+    }
+}
+
+// -------------------------------------------------------------------
+// ParseInstruction: splits the text into tokens and interprets them
+// as a MIPS instruction format (e.g. opcode, registers, immediate)
+// -------------------------------------------------------------------
+void SingleCycleMIPS::ParseInstruction(const string &text, Instruction &ins, Program &prog){
+
+
+        // Make a copy of 'text'
+        string line = text;
+        // 1) Replace all commas with spaces:
+        for (char &c : line) {
+            if (c == ',') {
+                c = ' ';
+            }
+        }
+
+    vector<string> tokens;
+    {
+        istringstream iss(line);
+        string t;
+        while(iss >> t) tokens.push_back(t);
+    }
+    if(tokens.empty()) return;
+    ins.op = OpcodeFromName(tokens[0]);
+    // An unknown name must not reach the register file as -1
+    auto registerOf = [](const string &token) {
+        int reg = ParseRegister(token);
+        if (reg < 0) throw invalid_argument("unknown register '" + token + "'");
+        return reg;
+    };
+
+    // The operand syntax comes from the opcode's format (see ISA)
+    switch (ISA[ins.op].format) {
+    case FMT_JUMP:          // j LABEL
+        if(tokens.size()>=2){
+            ins.label = prog.strings.Intern(tokens[1]);
+        }
+        return;
+    case FMT_BRANCH:        // beq $rs, $rt, LABEL
+        if(tokens.size()>=4){
+            ins.rs = registerOf(tokens[1]);
+            ins.rt = registerOf(tokens[2]);
+            ins.label= prog.strings.Intern(tokens[3]);
+        }
+        return;
+    case FMT_SHIFT:         // sll $rd, $rt, shamt
+        if(tokens.size() < 4) return;
+        ins.rd = registerOf(tokens[1]);                 // destination register
+        ins.rt = registerOf(tokens[2]);                 // register to shift
+        ins.imm = stoi(tokens[3], nullptr, 0);            // shift amount (immediate)
+        ins.rs = 0;                                     // not used in shift instructions
+        return;
+    case FMT_R:             // add $rd, $rs, $rt
+        if(tokens.size() < 4) return;
+        ins.rd = registerOf(tokens[1]);
+        ins.rs = registerOf(tokens[2]);
+        ins.rt = registerOf(tokens[3]);
+        return;
+    case FMT_I:             // addi $rt, $rs, IMM
+        if(tokens.size()<4) return;
+        ins.rt=registerOf(tokens[1]);
+        ins.rs=registerOf(tokens[2]);
+        // Parse imm with base=0 so 0xNNN works
+        ins.imm= stoi(tokens[3],nullptr,0);
+        break;
+    case FMT_MEM: {         // lw $rt, offset($rs)
+        if(tokens.size()<3) return;
+        ins.rt=registerOf(tokens[1]);
+        string expr=tokens[2];
+        auto p1=expr.find('(');
+        auto p2=expr.find(')');
+        if(p1!=string::npos && p2!=string::npos){
+            string off=expr.substr(0,p1);
+            string bas=expr.substr(p1+1,p2-(p1+1));
+              // parse offset with base=0
+              ins.imm= stoi(off,nullptr,0);
+              ins.rs= registerOf(bas);
+        }
+        break;
+    }
+    default:
+        return;
+    }
+
+    // andi, ori => zero-extend, the other I-types => sign-extend
+    if (ISA[ins.op].extend == EXT_ZERO16) {
+        ins.imm=(int32_t)(uint16_t)(ins.imm & 0xffff);
+    } else if (ISA[ins.op].extend == EXT_SIGN16) {
+        ins.imm=(int32_t)(int16_t)(ins.imm & 0xffff);
+    }
+}
+
+// -------------------------------------------------------------------
+// ParseRegister: converts a register name string to an int code
+//
+// e.g. "$t0" => 8, "$s1" => 17, "$ra" => 31, etc.
+// -------------------------------------------------------------------
+int SingleCycleMIPS::ParseRegister(string token){
+    // remove trailing comma if any
+    if(!token.empty() && token.back()==',') token.pop_back();
+    // remove leading '$' if present
+    if(!token.empty() && token.front()=='$') token.erase(token.begin());
+
+    if(token=="zero") return 0;
+    if(token=="at")   return 1;
+    if(token=="v0")   return 2;
+    if(token=="v1")   return 3;
+    if(token=="a0")   return 4;
+    if(token=="a1")   return 5;
+    if(token=="a2")   return 6;
+    if(token=="a3")   return 7;
+    if(token=="t0")   return 8;
+    if(token=="t1")   return 9;
+    if(token=="t2")   return 10;
+    if(token=="t3")   return 11;
+    if(token=="t4")   return 12;
+    if(token=="t5")   return 13;
+    if(token=="t6")   return 14;
+    if(token=="t7")   return 15;
+    if(token=="s0")   return 16;
+    if(token=="s1")   return 17;
+    if(token=="s2")   return 18;
+    if(token=="s3")   return 19;
+    if(token=="s4")   return 20;
+    if(token=="s5")   return 21;
+    if(token=="s6")   return 22;
+    if(token=="s7")   return 23;
+    if(token=="t8")   return 24;
+    if(token=="t9")   return 25;
+    if(token=="k0")   return 26;
+    if(token=="k1")   return 27;
+    if(token=="gp")   return 28;
+    if(token=="sp")   return 29;
+    if(token=="fp")   return 30;
+    if(token=="ra")   return 31;
+    return -1; // unrecognized
+}
+
+// -------------------------------------------------------------------
+// IsHalt: returns true if instruction is "sll $zero,$zero,0"
+// -------------------------------------------------------------------
+bool SingleCycleMIPS::IsHalt(const Instruction &ins){
+    if(ins.op==OP_SLL && ins.rs==0 && ins.rt==0 && ins.rd==0 && ins.imm==0){
+        return true;
+    }
+    return false;
+}
+
+// -------------------------------------------------------------------
+// DecodeMonitorRegisters: decide which registers to display in columns
+// (3), (4), (5) of the "Monitors" line.
+//
+// - j => no registers
+// - beq/bne => show (rs, rt, -)
+// - R-type => show (rs, rt, rd)
+// - shifts => show (rt, -, rd)
+// - I-type, lw/sw => show (rs, -, rt)
+// -------------------------------------------------------------------
+void SingleCycleMIPS::DecodeMonitorRegisters(const Instruction &ins,
+                                             string &m3, string &m4, string &m5)
+{
+    auto regName=[&](int r)->string{
+        if(r>=0 && r<32) return string(REGISTER_NAMES[r]);
+        return "-";
+    };
+
+    switch (ISA[ins.op].format) {
+    case FMT_BRANCH:        // (3=rs,4=rt,5="-")
+        m3=regName(ins.rs);
+        m4=regName(ins.rt);
+        m5="-";
+        return;
+    case FMT_R:             // (3=rs,4=rt,5=rd)
+        m3=regName(ins.rs);
+        m4=regName(ins.rt);
+        m5=regName(ins.rd);
+        return;
+    case FMT_SHIFT:         // (3=rt, the register being shifted, 4="-", 5=rd)
+        m3 = regName(ins.rt);
+        m4 = "-";
+        m5 = regName(ins.rd);
+        return;
+    case FMT_I:             // (3=rs,4="-",5=rt)
+    case FMT_MEM:           // lw,sw => ( 3=rs(base), 4="-", 5=rt) //etsi einai sto sample, den kserw giati
+        m3 = regName(ins.rs);
+        m4 = "-";
+        m5 = regName(ins.rt);
+        return;
+    default:                // jump and everything else => all "-"
+        m3="-"; m4="-"; m5="-";
+        return;
+    }
+}
+
+// -------------------------------------------------------------------
+// PrintCycleInformation
+// - The "Registers" portion -> prints PC plus all 32 regs in hex
+// - The "Monitors" portion -> prints essential pipeline-like fields
+// - The "Memory State" portion -> every stored word from $gp upwards
+// -------------------------------------------------------------------
+void SingleCycleMIPS::PrintCycleInformation(ostream &out, uint32_t oldPC) {
+    MIPS_PHASE(PH_FORMAT);
+    PrintCycleRegisters(out);
+    PrintMonitors(out, oldPC);
+    PrintMemoryState(out);
+}
+
+// -------------------------------------------------------------------
+// PrintCycleRegisters: cycle header plus PC and all 32 registers
+// -------------------------------------------------------------------
+void SingleCycleMIPS::PrintCycleRegisters(ostream &out) {
+    FormatCycleRegisters(out, cycleCount, rf.pc, rf.regs);
+}
+
+// -------------------------------------------------------------------
+// PrintMonitors: the "Monitors" block for the instruction in IR
+// -------------------------------------------------------------------
+void SingleCycleMIPS::PrintMonitors(ostream &out, uint32_t oldPC) {
+    const Program &prog = *program;
+    auto toHexCustom = ToHexCustom;
+
+    // 2) Print "Monitors"
+    out << "Monitors:\n";
+
+    // (1) previous PC
+    out << hex << uppercase << oldPC << "\t";  
+    // (2) the instruction text
+    out << prog.SourceLine(irIndex) << "\t";
+
+    // (3),(4),(5) => registers from decodeMonitorRegisters
+    string m3, m4, m5;
+    DecodeMonitorRegisters(*IR, m3, m4, m5);
+    out << m3 << "\t" << m4 << "\t" << m5 << "\t";
+
+    // (6),(7),(8) => register contents after execution, by format
+    switch (ISA[IR->op].format) {
+    case FMT_SHIFT:
+        out << toHexCustom(rf.regs[IR->rd]) << "\t";   // destination (result) after execution
+        out << toHexCustom(rf.regs[IR->rt]) << "\t";   // operand value (from the register being shifted)
+        out << "-\t";                                  // no second source operand
+        break;
+    case FMT_R:
+        out << toHexCustom(rf.regs[IR->rd]) << "\t";  // Monitor 6: rd
+        out << toHexCustom(rf.regs[IR->rs]) << "\t";  // Monitor 7: rs
+        out << toHexCustom(rf.regs[IR->rt]) << "\t";  // Monitor 8: rt
+        break;
+    case FMT_I:
+    case FMT_MEM:
+    case FMT_BRANCH:
+        // the destination register (rt) shows its updated value
+        out << toHexCustom(rf.regs[IR->rt]) << "\t";  // Monitor 6: destination (rt)
+        out << toHexCustom(rf.regs[IR->rs]) << "\t";  // Monitor 7: source (rs)
+        out << "-\t";                                 // Monitor 8: dash
+        break;
+    default:
+        // Other cases (e.g., j): -, -, -
+        out << "-\t";  // Monitor 6: -
+        out << "-\t";  // Monitor 7: -
+        out << "-\t";  // Monitor 8: -
+        break;
+    }
+
+    // (9) => ALU out
+    out << toHexCustom(aluOut) << "\t";
+
+    // (10) Branch label if used, else '-'
+    out << (showBranchLabel ? prog.Label(*IR) : string("-")) << "\t";
+
+    // (11) Memory address if lw/sw
+    if (ISA[IR->op].format == FMT_MEM && memAddress != 0) {
+        out << hex << uppercase << memAddress << "\t";
+    } else {
+        out << "-\t";
+    }
+
+    // (12) Store data if sw
+    if (didStore) {
+        out << hex << uppercase << storeValue << "\t";
+    } else {
+        out << "-\t";
+    }
+
+    // (13) Load data if lw
+    if (didLoad) {
+        out << hex << uppercase << memDataReg << "\t";
+    } else {
+        out << "-\t";
+    }
+
+    // (14) Control signals in some textual form
+    out << (ctrl.RegisterDestination ? "1\t" : "0\t")
+        << (ctrl.JumpSignal          ? "1\t" : "0\t")
+        << (ctrl.BranchSignal        ? "1\t" : "0\t")
+        << (ctrl.MemoryRead          ? "1\t" : "0\t")
+        << (ctrl.MemoryToRegister    ? "1\t" : "0\t")
+        << ISA[IR->op].alu2       << "\t"      // e.g. "10" ,not sure for the correct bits! Check again on next Part
+        << (ctrl.MemoryWrite         ? "1\t" : "0\t")
+        << (ctrl.ALUSource           ? "1\t" : "0\t")
+        << (ctrl.RegisterWrite       ? "1"   : "0")
+        << "\n\n";
+}
+
+// -------------------------------------------------------------------
+// PrintMemoryState: the "Memory State" block of a cycle printout
+// -------------------------------------------------------------------
+void SingleCycleMIPS::PrintMemoryState(ostream &out) {
+    MemoryImage image;
+    image.reserve(mem.Size());
+    mem.ForEach([&](uint32_t addr, int32_t value) { image.push_back({addr, value}); });
+    sort(image.begin(), image.end());
+    FormatMemoryState(out, image);
+}
+
+// -------------------------------------------------------------------
+// ReconstructDeltaTrace: replays a delta trace record by record and
+// prints the selected cycles exactly as PrintCycleInformation would
+// have (the Monitors block is stored verbatim).
+// -------------------------------------------------------------------
+bool SingleCycleMIPS::ReconstructDeltaTrace(const string &deltaFile, ostream &out,
+                                            const vector<int64_t> &cyclesToPrint, bool includeLast,
+                                            ParallelRenderer *renderer) {
+    ifstream fin(deltaFile, ios::binary);
+    if (!fin.is_open()) {
+        cerr << "Cannot open " << deltaFile << "\n";
+        return false;
+    }
+    streambuf *sb = fin.rdbuf();
+    bool truncated = false;
+    auto getVarint = [&]() -> uint64_t {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int c = sb->sbumpc();
+            if (c == EOF) { truncated = true; return 0; }
+            v |= (uint64_t)(c & 0x7f) << shift;
+            if (!(c & 0x80)) break;
+        }
+        return v;
+    };
+
+    char magic[sizeof(DELTA_TRACE_MAGIC)];
+    if (sb->sgetn(magic, sizeof(magic)) != (streamsize)sizeof(magic) ||
+        memcmp(magic, DELTA_TRACE_MAGIC, sizeof(magic)) != 0) {
+        cerr << deltaFile << " is not a delta trace\n";
+        return false;
+    }
+    getVarint();   // keyframe interval, informational only
+
+    bool printAll = cyclesToPrint.empty() ||
+                    find(cyclesToPrint.begin(), cyclesToPrint.end(), -1) != cyclesToPrint.end();
+    unordered_set<int64_t> wanted(cyclesToPrint.begin(), cyclesToPrint.end());
+
+    SingleCycleMIPS view;
+    uint64_t cycle = 0;
+    string monitors;
+
+    auto readFullState = [&]() {
+        view.rf.pc = (uint32_t)getVarint();
+        for (int i = 0; i < 32; i++) view.rf.regs[i] = (int32_t)getVarint();
+        view.mem.Clear();
+        view.memImage.reset();
+        uint64_t n = getVarint();
+        for (uint64_t k = 0; k < n && !truncated; k++) {
+            uint32_t addr = (uint32_t)getVarint();
+            view.mem.Store(addr, (int32_t)getVarint());
+        }
+    };
+
+    if (renderer) renderer->AddText(OUTPUT_HEADER);
+    else          out << OUTPUT_HEADER;
+    for (int tag = sb->sbumpc(); tag != EOF && !truncated; tag = sb->sbumpc()) {
+        if (tag == 'F') {
+            view.cycleCount = getVarint();
+            readFullState();
+            if (truncated) break;
+            if (includeLast && renderer) {
+                ostringstream finalState;
+                view.PrintFinalState(finalState);
+                renderer->AddText(finalState.str());
+            } else if (includeLast) {
+                view.PrintFinalState(out);
+            }
+            continue;
+        }
+        if (tag == 'K') {
+            cycle = getVarint();
+            readFullState();
+        } else if (tag == 'D') {
+            cycle += getVarint();
+            view.rf.pc = (uint32_t)getVarint();
+            uint32_t changed = (uint32_t)getVarint();
+            for (uint32_t m = changed; m; m &= m - 1) view.rf.regs[__builtin_ctz(m)] = (int32_t)getVarint();
+            uint64_t n = getVarint();
+            for (uint64_t k = 0; k < n && !truncated; k++) {
+                uint32_t addr = (uint32_t)getVarint();
+                view.mem.Store(addr, (int32_t)getVarint());
+                if (renderer) view.imageDirty.push_back(addr);
+            }
+        } else {
+            cerr << deltaFile << ": bad record tag\n";
+            return false;
+        }
+        monitors.resize(getVarint());
+        if (truncated || sb->sgetn(&monitors[0], monitors.size()) != (streamsize)monitors.size()) {
+            truncated = true;
+            break;
+        }
+
+        if (printAll || wanted.count((int64_t)cycle)) {
+            view.cycleCount = cycle;
+            if (renderer) {
+                CycleSnapshot snap;
+                snap.cycle = cycle;
+                snap.pc = view.rf.pc;
+                memcpy(snap.regs, view.rf.regs, sizeof(snap.regs));
+                snap.monitors = monitors;
+                view.memImage = UpdateMemoryImage(view.memImage, view.mem, view.imageDirty);
+                snap.memory = view.memImage;
+                renderer->Add(std::move(snap));
+                continue;
+            }
+            view.PrintCycleRegisters(out);
+            out << monitors;
+            view.PrintMemoryState(out);
+        }
+    }
+    if (truncated) {
+        cerr << deltaFile << ": trace is truncated\n";
+        return false;
+    }
+    return true;
+}
+
+// -------------------------------------------------------------------
+// PrintFinalState: logs final CPU and memory contents when the program
+// has finished executing (or on user request).
+// -------------------------------------------------------------------
+void SingleCycleMIPS::PrintFinalState(ostream &out) {
+    MIPS_PHASE(PH_FORMAT);
+    out << "-----Final State-----\n";
+    out << "Registers:\n";
+
+    // Force $zero to 0 for safety:because sometimes its not zero for some reason 
+    rf.regs[0] = 0;
+
+    // Print final PC + all registers
+    out << hex << uppercase << rf.pc << "\t";
+    for (int i = 0; i < 32; i++) {
+        out << rf.regs[i] << "\t";
+    }
+    out << "\n\nMemory State:\n";
+
+    // base = 0x10008000 (the usual gp)
+    uint32_t gpBase = 0x10008000; //logo tou sample Instead of printing real addresses, let's gather them as offsets from $gp
+    // in ascending offset from $gp
+    // 1) Gather the stored words into a vector
+vector<pair<uint32_t,int32_t>> sortedWords;
+sortedWords.reserve(mem.Size());
+mem.ForEach([&](uint32_t addr, int32_t value) {
+    sortedWords.push_back({addr, value});
+});
+
+// 2) Sort them ascending
+sort(sortedWords.begin(), sortedWords.end());
+
+// 3) Print values in ascending address order
+for (auto &word : sortedWords) {
+    // Now we get them in offset=0, offset=4, offset=8, offset=12, etc.
+    // Print the value in hex or decimal as you wish
+    out << hex << uppercase << word.second << "\t";
+}
+    out << "\n\nTotal Cycles:\n" << dec << cycleCount << "\n";
+}
+
+
+// -------------------------------------------------------------------
+// SaveStateImage: the current state as a final-state image, built in
+// memory and written with one write
+// -------------------------------------------------------------------
+bool SingleCycleMIPS::SaveStateImage(const string &path, string &error) const {
+    vector<pair<uint32_t, const MemoryPage*>> pages;
+    vector<pair<uint32_t,int32_t>> unaligned;
+    mem.ForEachPage([&](uint32_t page, const MemoryPage &p) { pages.push_back({page, &p}); },
+                    [&](uint32_t addr, int32_t value) { unaligned.push_back({addr, value}); });
+    sort(pages.begin(), pages.end());
+    sort(unaligned.begin(), unaligned.end());
+
+    StateImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STATE_IMAGE_MAGIC, sizeof(header.magic));
+    header.pc = rf.pc;
+    header.pageCount = (uint32_t)pages.size();
+    header.cycles = cycleCount;
+    memcpy(header.regs, rf.regs, sizeof(header.regs));
+    header.regs[0] = 0;                     // as PrintFinalState prints it
+    header.unalignedCount = (uint32_t)unaligned.size();
+
+    string image(sizeof(header) + pages.size() * sizeof(StateImagePage) +
+                 unaligned.size() * sizeof(unaligned[0]), '\0');
+    char *at = &image[0];
+    memcpy(at, &header, sizeof(header));
+    at += sizeof(header);
+    for (auto &p : pages) {
+        StateImagePage *out = (StateImagePage*)at;
+        out->page = p.first;
+        memcpy(out->present, p.second->present, sizeof(out->present));
+        memcpy(out->words, p.second->words, sizeof(out->words));
+        at += sizeof(StateImagePage);
+    }
+    if (!unaligned.empty()) memcpy(at, unaligned.data(), unaligned.size() * sizeof(unaligned[0]));
+
+    MIPS_PHASE(PH_WRITE);
+    ofstream out(path, ios::binary | ios::trunc);
+    if (!out.is_open()) {
+        error = "cannot open " + path;
+        return false;
+    }
+    out.write(image.data(), image.size());
+    out.close();
+    if (!out) {
+        error = "cannot write " + path;
+        return false;
+    }
+    return true;
+}
+
+// -------------------------------------------------------------------
+// IncrementalRunner::AtCycle: takes a checkpoint when one is due. Forks
+// share memory pages, so a checkpoint only costs the pages written
+// after it. Past MAX_CHECKPOINTS the odd ones go (the first, at cycle 0,
+// always stays), which keeps them evenly spaced at twice the interval.
+// -------------------------------------------------------------------
+void IncrementalRunner::AtCycle(const SingleCycleMIPS &at, ostream &out) {
+    if (at.cycleCount < nextCheckpoint) return;
+    if (checkpoints.size() >= MAX_CHECKPOINTS) {
+        size_t kept = 0;
+        for (size_t i = 0; i < checkpoints.size(); i += 2) checkpoints[kept++] = move(checkpoints[i]);
+        checkpoints.resize(kept);
+        every *= 2;
+        if (at.cycleCount < checkpoints.back().cycle + every) {
+            nextCheckpoint = checkpoints.back().cycle + every;
+            return;
+        }
+    }
+    out.flush();
+    checkpoints.push_back({at.cycleCount, (streamoff)out.tellp(),
+                           make_shared<const SingleCycleMIPS>(at.Fork())});
+    nextCheckpoint = at.cycleCount + every;
+}
+
+bool IncrementalRunner::ReadSource(string &text) {
+    ifstream fin(inFile, ios::binary);
+    if (!fin.is_open()) return false;
+    ostringstream all;
+    all << fin.rdbuf();
+    text = all.str();
+    return true;
+}
+
+// -------------------------------------------------------------------
+// FirstChangedCycle: the earliest cycle (as recorded in firstExecuted)
+// at which the old run fetched an instruction that is different in the
+// new program, or UINT64_MAX if no changed instruction ever ran. An
+// instruction is "different" if anything that is executed or printed
+// differs, including its label text and source line.
+// -------------------------------------------------------------------
+uint64_t IncrementalRunner::FirstChangedCycle(const Program &before, const Program &after,
+                                              size_t &changedIdx) const {
+    if (!before.SameData(after)) {
+        changedIdx = SIZE_MAX;     // the .data words: the very first cycle already sees them
+        return 1;
+    }
+    uint64_t first = UINT64_MAX;
+    size_t n = max(before.instrs.size(), after.instrs.size());
+    for (size_t i = 0; i <= n; i++) {
+        uint64_t ran = i < firstExecuted.size() ? firstExecuted[i] : 0;
+        if (ran == 0 || ran >= first) continue;
+        bool same = i < before.instrs.size() && i < after.instrs.size();
+        if (same) {
+            const Instruction &a = before.instrs[i], &b = after.instrs[i];
+            same = a.op == b.op && a.rs == b.rs && a.rt == b.rt && a.rd == b.rd && a.imm == b.imm &&
+                   a.target == b.target && before.Label(a) == after.Label(b) &&
+                   before.SourceLine(i) == after.SourceLine(i);
+        } else if (i >= before.instrs.size() && i >= after.instrs.size()) {
+            same = true;     // ran off the end in both
+        }
+        if (!same) {
+            first = ran;
+            changedIdx = i;
+        }
+    }
+    return first;
+}
+
+// -------------------------------------------------------------------
+// Resume: cuts the output back to the checkpoint and runs on from it
+// -------------------------------------------------------------------
+bool IncrementalRunner::Resume(const Checkpoint &from, shared_ptr<const Program> program) {
+    sim = from.state->Fork();
+    sim.program = program;
+    if (from.cycle == 0) sim.Reset();      // picks up changed .data words
+    sim.incremental = this;
+    sim.firstExecuted = &firstExecuted;
+    for (uint64_t &ran : firstExecuted) {
+        if (ran > from.cycle) ran = 0;      // only the replayed prefix still holds
+    }
+    firstExecuted.resize(program->instrs.size() + 1, 0);
+    nextCheckpoint = from.cycle;            // retake this one, it has the old program
+
+    {
+        MIPS_PHASE(PH_WRITE);
+        error_code ec;
+        filesystem::resize_file(outFile, (uintmax_t)from.outOffset, ec);
+        if (ec) {
+            cerr << "Cannot truncate " << outFile << ": " << ec.message() << "\n";
+            return false;
+        }
+    }
+    fstream out(outFile, ios::in | ios::out);
+    if (!out.is_open()) {
+        cerr << "Cannot open " << outFile << "\n";
+        return false;
+    }
+    out.seekp(from.outOffset);
+    sim.ContinueSimulation(out, cyclesToPrint, includeLast);
+    return (bool)out;
+}
+
+bool IncrementalRunner::Watch(unsigned pollMillis) {
+    string source;
+    if (!ReadSource(source)) {
+        cerr << "Cannot open " << inFile << "\n";
+        return false;
+    }
+    try {
+        sim.LoadAssembly(source.data(), source.size());
+    } catch (const std::exception &e) {
+        cerr << "Cannot parse " << inFile << ": " << e.what() << "\n";
+        return false;
+    }
+    firstExecuted.assign(sim.program->instrs.size() + 1, 0);
+    sim.incremental = this;
+    sim.firstExecuted = &firstExecuted;
+
+    auto start = chrono::steady_clock::now();
+    {
+        ofstream out(outFile);
+        if (!out.is_open()) {
+            cerr << "Cannot open " << outFile << "\n";
+            return false;
+        }
+        out << OUTPUT_HEADER;
+        sim.RunSimulation(out, cyclesToPrint, includeLast);
+    }
+    auto millis = [&]() {
+        return (long long)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    };
+    cout << dec << "[watch] " << inFile << ": " << sim.cycleCount << " cycles in " << millis()
+         << " ms, watching for changes" << endl;
+
+    for (;;) {
+        this_thread::sleep_for(chrono::milliseconds(pollMillis));
+        string now;
+        if (!ReadSource(now) || now == source) continue;     // also rides out a half-saved file
+        source = now;
+
+        start = chrono::steady_clock::now();
+        SingleCycleMIPS loader;
+        loader.SetDebugLog(false);
+        try {
+            loader.LoadAssembly(source.data(), source.size());
+        } catch (const std::exception &e) {
+            // keep the old program and output until the file parses again
+            cout << "[watch] " << inFile << " does not parse (" << e.what() << "): output kept" << endl;
+            continue;
+        }
+        shared_ptr<const Program> program = loader.program;
+
+        size_t changedIdx = 0;
+        uint64_t first = FirstChangedCycle(*sim.program, *program, changedIdx);
+        if (first == UINT64_MAX) {
+            // nothing that ran changed; later resumes must still see the edit
+            sim.program = program;
+            firstExecuted.resize(program->instrs.size() + 1, 0);
+            cout << "[watch] " << inFile << " changed, but no changed instruction ran: output kept" << endl;
+            continue;
+        }
+
+        // the last checkpoint taken before the first changed cycle ran
+        while (checkpoints.size() > 1 && checkpoints.back().cycle >= first) checkpoints.pop_back();
+        Checkpoint from = checkpoints.back();
+        checkpoints.pop_back();
+        if (!Resume(from, program)) return false;
+        cout << dec << "[watch] " << inFile;
+        if (changedIdx == SIZE_MAX) cout << " changed its .data words: re-ran cycles ";
+        else cout << " changed at instruction " << changedIdx << " (first ran in cycle " << first << "): re-ran cycles ";
+        cout << from.cycle + 1 << "-" << sim.cycleCount << " in " << millis()
+             << " ms" << endl;
+    }
+}
+
+// -------------------------------------------------------------------
+// =================== Lockstep (SIMD) Sweep Engine ==================
+// -------------------------------------------------------------------
+// Runs LOCKSTEP_LANES instances of the same program at once, one
+// instance per vector lane. The register file is stored as
+// structure-of-arrays (regs[32][LANES]) so one instruction updates the
+// same register of every lane with a single vector operation.
+//
+// Lanes stay together while they agree on the PC. When a beq/bne sends
+// them different ways, the lanes with the lowest PC run first (masked),
+// and the others wait until the low group catches up to them again,
+// which is where the lanes reconverge. A group of one lane runs on the
+// plain scalar path, and lw/sw always go lane-by-lane since every lane
+// has its own sparse memory.
+//
+// AVX-512 gives 16 lanes, AVX2 gives 8; without either we fall back to
+// simple per-lane loops (the compiler may still vectorize those).
+#if defined(__AVX512F__)
+#define LOCKSTEP_LANES 16
+#else
+#define LOCKSTEP_LANES 8
+#endif
+
+#if defined(__AVX512F__)
+typedef __m512i LaneVec;
+static inline LaneVec LvLoad(const int32_t *p)        { return _mm512_load_si512(p); }
+static inline LaneVec LvSet1(int32_t v)               { return _mm512_set1_epi32(v); }
+static inline LaneVec LvAdd(LaneVec a, LaneVec b)     { return _mm512_add_epi32(a, b); }
+static inline LaneVec LvSub(LaneVec a, LaneVec b)     { return _mm512_sub_epi32(a, b); }
+static inline LaneVec LvAnd(LaneVec a, LaneVec b)     { return _mm512_and_si512(a, b); }
+static inline LaneVec LvOr(LaneVec a, LaneVec b)      { return _mm512_or_si512(a, b); }
+static inline LaneVec LvNor(LaneVec a, LaneVec b)     { return _mm512_xor_si512(_mm512_or_si512(a, b), _mm512_set1_epi32(-1)); }
+static inline LaneVec LvSlt(LaneVec a, LaneVec b)     { return _mm512_maskz_mov_epi32(_mm512_cmplt_epi32_mask(a, b), _mm512_set1_epi32(1)); }
+static inline LaneVec LvSltu(LaneVec a, LaneVec b)    { return _mm512_maskz_mov_epi32(_mm512_cmplt_epu32_mask(a, b), _mm512_set1_epi32(1)); }
+static inline LaneVec LvSll(LaneVec a, int n)         { return _mm512_sll_epi32(a, _mm_cvtsi32_si128(n)); }
+static inline LaneVec LvSrl(LaneVec a, int n)         { return _mm512_srl_epi32(a, _mm_cvtsi32_si128(n)); }
+static inline uint32_t LvEqMask(LaneVec a, LaneVec b) { return _mm512_cmpeq_epi32_mask(a, b); }
+static inline void LvStoreMasked(int32_t *p, LaneVec v, uint32_t m) { _mm512_mask_store_epi32(p, (__mmask16)m, v); }
+#elif defined(__AVX2__)
+typedef __m256i LaneVec;
+static inline LaneVec LvLoad(const int32_t *p)        { return _mm256_load_si256((const __m256i*)p); }
+static inline LaneVec LvSet1(int32_t v)               { return _mm256_set1_epi32(v); }
+static inline LaneVec LvAdd(LaneVec a, LaneVec b)     { return _mm256_add_epi32(a, b); }
+static inline LaneVec LvSub(LaneVec a, LaneVec b)     { return _mm256_sub_epi32(a, b); }
+static inline LaneVec LvAnd(LaneVec a, LaneVec b)     { return _mm256_and_si256(a, b); }
+static inline LaneVec LvOr(LaneVec a, LaneVec b)      { return _mm256_or_si256(a, b); }
+static inline LaneVec LvNor(LaneVec a, LaneVec b)     { return _mm256_xor_si256(_mm256_or_si256(a, b), _mm256_set1_epi32(-1)); }
+static inline LaneVec LvSlt(LaneVec a, LaneVec b)     { return _mm256_and_si256(_mm256_cmpgt_epi32(b, a), _mm256_set1_epi32(1)); }
+static inline LaneVec LvSltu(LaneVec a, LaneVec b) {
+    // AVX2 only has a signed compare, so flip the sign bits first
+    LaneVec flip = _mm256_set1_epi32((int32_t)0x80000000);
+    return _mm256_and_si256(_mm256_cmpgt_epi32(_mm256_xor_si256(b, flip), _mm256_xor_si256(a, flip)),
+                            _mm256_set1_epi32(1));
+}
+static inline LaneVec LvSll(LaneVec a, int n)         { return _mm256_sll_epi32(a, _mm_cvtsi32_si128(n)); }
+static inline LaneVec LvSrl(LaneVec a, int n)         { return _mm256_srl_epi32(a, _mm_cvtsi32_si128(n)); }
+static inline uint32_t LvEqMask(LaneVec a, LaneVec b) {
+    return (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b)));
+}
+static inline void LvStoreMasked(int32_t *p, LaneVec v, uint32_t m) {
+    // expand the lane bitmask into a per-lane all-ones/all-zeros vector
+    const LaneVec bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    LaneVec sel = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32((int32_t)m), bits), bits);
+    _mm256_maskstore_epi32(p, sel, v);
+}
+#else
+struct LaneVec { int32_t v[LOCKSTEP_LANES]; };
+#define LANE_LOOP(expr) LaneVec r; for (int l = 0; l < LOCKSTEP_LANES; l++) r.v[l] = (expr); return r
+static inline LaneVec LvLoad(const int32_t *p)        { LANE_LOOP(p[l]); }
+static inline LaneVec LvSet1(int32_t x)               { LANE_LOOP(x); }
+static inline LaneVec LvAdd(LaneVec a, LaneVec b)     { LANE_LOOP((int32_t)((uint32_t)a.v[l] + (uint32_t)b.v[l])); }
+static inline LaneVec LvSub(LaneVec a, LaneVec b)     { LANE_LOOP((int32_t)((uint32_t)a.v[l] - (uint32_t)b.v[l])); }
+static inline LaneVec LvAnd(LaneVec a, LaneVec b)     { LANE_LOOP(a.v[l] & b.v[l]); }
+static inline LaneVec LvOr(LaneVec a, LaneVec b)      { LANE_LOOP(a.v[l] | b.v[l]); }
+static inline LaneVec LvNor(LaneVec a, LaneVec b)     { LANE_LOOP(~(a.v[l] | b.v[l])); }
+static inline LaneVec LvSlt(LaneVec a, LaneVec b)     { LANE_LOOP(a.v[l] < b.v[l] ? 1 : 0); }
+static inline LaneVec LvSltu(LaneVec a, LaneVec b)    { LANE_LOOP((uint32_t)a.v[l] < (uint32_t)b.v[l] ? 1 : 0); }
+static inline LaneVec LvSll(LaneVec a, int n)         { LANE_LOOP((int32_t)((uint32_t)a.v[l] << n)); }
+static inline LaneVec LvSrl(LaneVec a, int n)         { LANE_LOOP((int32_t)((uint32_t)a.v[l] >> n)); }
+#undef LANE_LOOP
+static inline uint32_t LvEqMask(LaneVec a, LaneVec b) {
+    uint32_t m = 0;
+    for (int l = 0; l < LOCKSTEP_LANES; l++) if (a.v[l] == b.v[l]) m |= 1u << l;
+    return m;
+}
+static inline void LvStoreMasked(int32_t *p, LaneVec v, uint32_t m) {
+    for (int l = 0; l < LOCKSTEP_LANES; l++) if (m & (1u << l)) p[l] = v.v[l];
+}
+#endif
+
+class LockstepMIPS {
+public:
+    // One instance's starting registers (applied over the $gp/$sp defaults)
+    typedef vector<pair<int,int32_t>> LaneInputs;
+
+    explicit LockstepMIPS(const SingleCycleMIPS &program);
+
+    // Reads a sweep file (one line of register assignments per instance)
+    static bool LoadInputs(const string &filename, vector<LaneInputs> &inputs);
+
+    // Runs every input set (LOCKSTEP_LANES at a time) and prints each
+    // instance's final state in the same format as PrintFinalState. An
+    // instance still running after maxCycles cycles (0 = no limit) stops
+    // there and is marked in its header; returns how many did.
+    size_t RunSweep(ostream &out, const vector<LaneInputs> &inputs, uint64_t maxCycles);
+
+    // Driving the lanes directly (the differential fuzzer): Start loads
+    // the first LOCKSTEP_LANES input sets, RunLanesTo runs every live
+    // lane until it has run 'cycle' cycles or finished.
+    void Start(const vector<LaneInputs> &inputs);
+    void RunLanesTo(uint64_t cycle);
+    bool LaneLive(int lane) const { return (liveMask >> lane) & 1; }
+    int32_t LaneRegister(int lane, int reg) const { return regs[reg][lane]; }
+    uint32_t LanePC(int lane) const { return pc[lane]; }
+    uint64_t LaneCycles(int lane) const { return cycles[lane]; }
+    const SparseMem &LaneMemory(int lane) const { return mem[lane]; }
+
+private:
+    // The lane operations; several opcodes share one (addi/add/addu...).
+    enum LaneOp : uint8_t {
+        L_ADD, L_SUB, L_AND, L_OR, L_NOR, L_SLT, L_SLTU, L_SLL, L_SRL,
+        L_LW, L_SW, L_BEQ, L_BNE, L_J, L_HALT, L_NOP
+    };
+    static const uint8_t NO_REG = 0xFF;
+
+    // The program decoded once up front so the hot loop never compares strings.
+    // target: instruction index of the label, -1 if the label does not
+    // exist (the instance finishes), -2 if there is no label (PC stays put).
+    struct LaneInstr {
+        LaneOp  op;
+        uint8_t rs, rt, dst;  // dst = NO_REG when nothing is written back
+        bool    useImm;       // second ALU input is the (extended) immediate
+        int32_t imm;
+        int32_t target;
+    };
+
+    vector<LaneInstr> code;
+    SparseMem initialMem;     // .data words and binary images, shared by every lane
+
+    // Per-lane CPU state
+    alignas(64) int32_t regs[32][LOCKSTEP_LANES];
+    uint32_t  pc[LOCKSTEP_LANES];
+    uint64_t  cycles[LOCKSTEP_LANES];
+    SparseMem mem[LOCKSTEP_LANES];
+    uint32_t  liveMask = 0;
+
+    void ResetLanes(const vector<LaneInputs> &inputs, size_t first, int count);
+    uint32_t LowestGroup(uint32_t lanes, uint32_t &lowPC) const;   // lanes at the lowest PC
+    void StepGroup(const LaneInstr &ins, uint32_t mask);    // vector path
+    void StepLane(const LaneInstr &ins, int lane);          // scalar path
+    void RedirectLane(int lane, int32_t target);
+};
+
+// -------------------------------------------------------------------
+// LockstepMIPS constructor: decodes the loaded program into LaneInstr
+// records, with the write-back register and ALU input taken from the
+// ISA table, and branch/jump labels resolved ahead of time.
+// -------------------------------------------------------------------
+LockstepMIPS::LockstepMIPS(const SingleCycleMIPS &program) {
+    // Opcode -> lane operation
+    static const LaneOp ops[] = {
+        L_NOP,  L_ADD,  L_ADD,  L_SUB,  L_SUB,  L_AND,  L_OR,   L_NOR,    // NONE..NOR
+        L_SLT,  L_SLTU, L_SLL,  L_SRL,  L_ADD,  L_ADD,  L_AND,  L_OR,     // SLT..ORI
+        L_SLT,  L_SLTU, L_LW,   L_SW,   L_BEQ,  L_BNE,  L_J,    L_NOP     // SLTI..UNKNOWN
+    };
+    static_assert(sizeof(ops) / sizeof(ops[0]) == OP_UNKNOWN + 1, "one entry per Opcode");
+    initialMem = program.InitialMemory();
+
+    for (const Instruction &ins : program.program->instrs) {
+        LaneInstr d;
+        d.op = ops[ins.op];
+        d.rs = (uint8_t)(ins.rs & 31);
+        d.rt = (uint8_t)(ins.rt & 31);
+        d.imm = ins.imm;          // already extended by the parser
+        d.target = ins.target;
+
+        // write-back register and ALU input straight from the ISA table
+        const IsaEntry &e = ISA[ins.op];
+        d.dst = e.dest == DEST_RD ? (uint8_t)(ins.rd & 31) : e.dest == DEST_RT ? d.rt : NO_REG;
+        d.useImm = e.format == FMT_I;
+        if (ins.op==OP_SLL && ins.rs==0 && ins.rt==0 && ins.rd==0 && ins.imm==0) {
+            d.op = L_HALT;
+        }
+        code.push_back(d);
+    }
+}
+
+// -------------------------------------------------------------------
+// ResetLanes: loads the next batch of input sets into the lanes. Lanes
+// past the end of the input list are simply left dead.
+// -------------------------------------------------------------------
+void LockstepMIPS::ResetLanes(const vector<LaneInputs> &inputs, size_t first, int count) {
+    memset(regs, 0, sizeof(regs));
+    liveMask = 0;
+    for (int l = 0; l < LOCKSTEP_LANES; l++) {
+        regs[28][l] = 0x10008000; // $gp
+        regs[29][l] = 0x7ffffffc; // $sp
+        pc[l] = 0;
+        cycles[l] = 0;
+        mem[l] = initialMem;
+        if (l < count) {
+            for (auto &r : inputs[first + l]) regs[r.first][l] = r.second;
+            liveMask |= 1u << l;
+        }
+    }
+}
+
+// -------------------------------------------------------------------
+// RedirectLane: taken branch or jump for one lane
+// -------------------------------------------------------------------
+void LockstepMIPS::RedirectLane(int lane, int32_t target) {
+    if (target >= 0) {
+        pc[lane] = (uint32_t)target * 4;
+    } else if (target == -1) {
+        liveMask &= ~(1u << lane);      // label not found => finishing
+    }
+    // target == -2: no label, PC stays where it is
+}
+
+// -------------------------------------------------------------------
+// StepGroup: executes one instruction for every lane in 'mask' (all of
+// them sit at the same PC) using the vector operations above.
+// -------------------------------------------------------------------
+void LockstepMIPS::StepGroup(const LaneInstr &ins, uint32_t mask) {
+    for (uint32_t m = mask; m; m &= m - 1) cycles[__builtin_ctz(m)]++;
+
+    LaneVec a = LvLoad(regs[ins.rs]);
+    LaneVec b = ins.useImm ? LvSet1(ins.imm) : LvLoad(regs[ins.rt]);
+    LaneVec r;
+
+    switch (ins.op) {
+    case L_ADD:  r = LvAdd(a, b);  break;
+    case L_SUB:  r = LvSub(a, b);  break;
+    case L_AND:  r = LvAnd(a, b);  break;
+    case L_OR:   r = LvOr(a, b);   break;
+    case L_NOR:  r = LvNor(a, b);  break;
+    case L_SLT:  r = LvSlt(a, b);  break;
+    case L_SLTU: r = LvSltu(a, b); break;
+    case L_SLL:  r = LvSll(LvLoad(regs[ins.rt]), ins.imm & 31); break;
+    case L_SRL:  r = LvSrl(LvLoad(regs[ins.rt]), ins.imm & 31); break;
+    case L_BEQ:
+    case L_BNE: {
+        uint32_t eq = LvEqMask(a, b);
+        uint32_t taken = (ins.op == L_BEQ ? eq : ~eq) & mask;
+        for (uint32_t m = mask & ~taken; m; m &= m - 1) pc[__builtin_ctz(m)] += 4;
+        for (uint32_t m = taken; m; m &= m - 1) RedirectLane(__builtin_ctz(m), ins.target);
+        return;
+    }
+    case L_J:
+        for (uint32_t m = mask; m; m &= m - 1) RedirectLane(__builtin_ctz(m), ins.target);
+        return;
+    case L_LW:
+    case L_SW:
+        // every lane has its own sparse memory => one lane at a time
+        for (uint32_t m = mask; m; m &= m - 1) {
+            int l = __builtin_ctz(m);
+            uint32_t addr = (uint32_t)regs[ins.rs][l] + (uint32_t)ins.imm;
+            if (ins.op == L_SW) {
+                mem[l].Store(addr, regs[ins.rt][l]);
+            } else {
+                regs[ins.rt][l] = mem[l].Load(addr);
+            }
+            pc[l] += 4;
+        }
+        return;
+    case L_HALT:
+        for (uint32_t m = mask; m; m &= m - 1) pc[__builtin_ctz(m)] += 4;
+        liveMask &= ~mask;
+        return;
+    default:
+        for (uint32_t m = mask; m; m &= m - 1) pc[__builtin_ctz(m)] += 4;
+        return;
+    }
+
+    LvStoreMasked(regs[ins.dst], r, mask);
+    for (uint32_t m = mask; m; m &= m - 1) pc[__builtin_ctz(m)] += 4;
+}
+
+// -------------------------------------------------------------------
+// StepLane: executes one instruction for a single lane (the scalar
+// fallback once a lane has split off from the others).
+// -------------------------------------------------------------------
+void LockstepMIPS::StepLane(const LaneInstr &ins, int l) {
+    cycles[l]++;
+
+    int32_t a = regs[ins.rs][l];
+    int32_t b = ins.useImm ? ins.imm : regs[ins.rt][l];
+    int32_t r = 0;
+
+    switch (ins.op) {
+    case L_ADD:  r = (int32_t)((uint32_t)a + (uint32_t)b); break;
+    case L_SUB:  r = (int32_t)((uint32_t)a - (uint32_t)b); break;
+    case L_AND:  r = a & b;    break;
+    case L_OR:   r = a | b;    break;
+    case L_NOR:  r = ~(a | b); break;
+    case L_SLT:  r = (a < b) ? 1 : 0; break;
+    case L_SLTU: r = ((uint32_t)a < (uint32_t)b) ? 1 : 0; break;
+    case L_SLL:  r = (int32_t)((uint32_t)regs[ins.rt][l] << (ins.imm & 31)); break;
+    case L_SRL:  r = (int32_t)((uint32_t)regs[ins.rt][l] >> (ins.imm & 31)); break;
+    case L_LW: {
+        r = mem[l].Load((uint32_t)a + (uint32_t)ins.imm);
+        break;
+    }
+    case L_SW:
+        mem[l].Store((uint32_t)a + (uint32_t)ins.imm, regs[ins.rt][l]);
+        break;
+    case L_BEQ:
+    case L_BNE:
+        if ((a == b) == (ins.op == L_BEQ)) RedirectLane(l, ins.target);
+        else pc[l] += 4;
+        return;
+    case L_J:
+        RedirectLane(l, ins.target);
+        return;
+    case L_HALT:
+        pc[l] += 4;
+        liveMask &= ~(1u << l);
+        return;
+    default:
+        break;
+    }
+
+    if (ins.dst != NO_REG) regs[ins.dst][l] = r;
+    pc[l] += 4;
+}
+
+// -------------------------------------------------------------------
+// LowestGroup: reconvergence - of the given lanes, the ones sitting at
+// the lowest PC always run next
+// -------------------------------------------------------------------
+uint32_t LockstepMIPS::LowestGroup(uint32_t lanes, uint32_t &lowPC) const {
+    lowPC = UINT32_MAX;
+    for (uint32_t m = lanes; m; m &= m - 1) lowPC = min(lowPC, pc[__builtin_ctz(m)]);
+    uint32_t group = 0;
+    for (uint32_t m = lanes; m; m &= m - 1) {
+        if (pc[__builtin_ctz(m)] == lowPC) group |= m & (~m + 1);
+    }
+    return group;
+}
+
+// -------------------------------------------------------------------
+// RunSweep: runs all input sets, LOCKSTEP_LANES at a time. A lane that
+// reaches the budget waits there (like RunLanesTo), so one that never
+// halts cannot hold up the others behind it.
+// -------------------------------------------------------------------
+size_t LockstepMIPS::RunSweep(ostream &out, const vector<LaneInputs> &inputs, uint64_t maxCycles) {
+    size_t stopped = 0;
+    for (size_t first = 0; first < inputs.size(); first += LOCKSTEP_LANES) {
+        int count = (int)min<size_t>(LOCKSTEP_LANES, inputs.size() - first);
+        ResetLanes(inputs, first, count);
+
+        uint32_t waiting = 0;            // lanes at the budget
+        while (liveMask & ~waiting) {
+            uint32_t lowPC;
+            uint32_t group = LowestGroup(liveMask & ~waiting, lowPC);
+
+            uint32_t idx = lowPC / 4;
+            if (idx >= code.size()) {
+                liveMask &= ~group;      // ran off the end of the program
+                continue;
+            }
+            if ((group & (group - 1)) == 0) StepLane(code[idx], __builtin_ctz(group));
+            else                            StepGroup(code[idx], group);
+
+            if (maxCycles) {
+                for (uint32_t m = group; m; m &= m - 1) {
+                    if (cycles[__builtin_ctz(m)] >= maxCycles) waiting |= m & (~m + 1);
+                }
+            }
+        }
+
+        // Print each instance through the normal final-state printer
+        for (int l = 0; l < count; l++) {
+            SingleCycleMIPS view;
+            for (int r = 0; r < 32; r++) view.rf.regs[r] = regs[r][l];
+            view.rf.pc = pc[l];
+            view.mem = mem[l];
+            view.cycleCount = cycles[l];
+            out << "-----Lane " << dec << (first + l);
+            if (LaneLive(l)) {
+                out << " (stopped at the cycle budget)";
+                stopped++;
+            }
+            out << "-----\n";
+            view.PrintFinalState(out);
+            out << "\n";
+        }
+    }
+    return stopped;
+}
+
+// -------------------------------------------------------------------
+// Start / RunLanesTo: the same loop as RunSweep, but a lane that has run
+// 'cycle' cycles waits there, so the caller can look at every lane at
+// the same point of its run.
+// -------------------------------------------------------------------
+void LockstepMIPS::Start(const vector<LaneInputs> &inputs) {
+    ResetLanes(inputs, 0, (int)min<size_t>(LOCKSTEP_LANES, inputs.size()));
+}
+
+void LockstepMIPS::RunLanesTo(uint64_t cycle) {
+    uint32_t waiting = 0;
+    for (uint32_t m = liveMask; m; m &= m - 1) {
+        if (cycles[__builtin_ctz(m)] >= cycle) waiting |= m & (~m + 1);
+    }
+    while (liveMask & ~waiting) {
+        uint32_t lowPC;
+        uint32_t group = LowestGroup(liveMask & ~waiting, lowPC);
+
+        uint32_t idx = lowPC / 4;
+        if (idx >= code.size()) {
+            liveMask &= ~group;      // ran off the end of the program
+            continue;
+        }
+        if ((group & (group - 1)) == 0) StepLane(code[idx], __builtin_ctz(group));
+        else                            StepGroup(code[idx], group);
+
+        for (uint32_t m = group; m; m &= m - 1) {
+            if (cycles[__builtin_ctz(m)] >= cycle) waiting |= m & (~m + 1);
+        }
+    }
+}
+
+// -------------------------------------------------------------------
+// LoadInputs: reads a sweep file, one instance per line, each line a
+// list of register assignments like "$a0=5, $t1=0x10". Blank lines and
+// '#' comments are skipped.
+// -------------------------------------------------------------------
+bool LockstepMIPS::LoadInputs(const string &filename, vector<LaneInputs> &inputs) {
+    ifstream fin(filename);
+    if (!fin.is_open()) {
+        cerr << "Cannot open " << filename << "\n";
+        return false;
+    }
+    SingleCycleMIPS names;   // only for ParseRegister
+    string line;
+    while (getline(fin, line)) {
+        auto cpos = line.find('#');
+        if (cpos != string::npos) line = line.substr(0, cpos);
+        for (char &c : line) if (c == ',') c = ' ';
+        istringstream iss(line);
+        string tok;
+        LaneInputs lane;
+        while (iss >> tok) {
+            auto eq = tok.find('=');
+            int reg = (eq == string::npos) ? -1 : names.ParseRegister(tok.substr(0, eq));
+            if (reg < 0) {
+                cerr << "Invalid sweep input: " << tok << "\n";
+                return false;
+            }
+            try {
+                lane.push_back({reg, (int32_t)stoll(tok.substr(eq + 1), nullptr, 0)});
+            } catch (const std::exception &e) {
+                cerr << "Invalid sweep input: " << tok << "\n";
+                return false;
+            }
+        }
+        if (!lane.empty()) inputs.push_back(lane);
+    }
+    return true;
+}
+
+// -------------------------------------------------------------------
+// =================== Differential Fuzzing ==========================
+// -------------------------------------------------------------------
+// Generates random programs over the ISA table and runs each one on
+// every engine: the normal simulator (the reference), the lockstep
+// sweep engine (a lane per input set, so both its vector and its
+// one-lane paths run), a simulator that forks itself at every
+// comparison point and continues in the child, which exercises the
+// copy-on-write memory, and a simulator running a --layout made from
+// a short profile of the first lane, so it also leaves the profiled
+// blocks for the cold ones. Every N cycles the full architectural state
+// (cycles, PC, all 32 registers, every stored word) of each engine is
+// compared with the reference, and the parent left behind by the last
+// fork must still hold the state it had then.
+//
+// The Monitors values (aluOut and the rest) only exist in the reference
+// engine, so they are not part of the comparison.
+//
+// A failing program is shrunk before it is reported: lanes, then runs
+// of instructions (halving the run length), then the input registers
+// are removed as long as some engine still disagrees. The result is
+// written as fuzz-<seed>.txt and fuzz-<seed>.lanes, which --in and
+// --sweep (with or without --sweep-scalar) read directly.
+class DifferentialFuzzer {
+public:
+    DifferentialFuzzer(uint64_t seed, uint64_t compareEvery, uint64_t maxCycles)
+        : baseSeed(seed), every(compareEvery ? compareEvery : 1), budget(maxCycles) {}
+
+    // Runs programs baseSeed, baseSeed+1, ... on 'threads' threads for
+    // 'seconds' seconds (0 = no limit) or 'programs' programs (0 = no
+    // limit). Returns the number of failing programs.
+    uint64_t Run(unsigned threads, uint64_t seconds, uint64_t programs);
+
+    // One test case: the program lines and one input set per lane
+    struct Case {
+        vector<string> lines;
+        vector<LockstepMIPS::LaneInputs> lanes;
+    };
+    static Case Generate(uint64_t seed);
+
+    // "" when every engine agrees, otherwise the first difference
+    string Check(const Case &c, uint64_t &cyclesRun) const;
+    Case Minimize(Case c) const;
+
+private:
+    // The state compared between engines (memory sorted by address)
+    struct State {
+        uint64_t cycles = 0;
+        uint32_t pc = 0;
+        int32_t regs[32] = {};
+        vector<pair<uint32_t,int32_t>> words;
+    };
+    static State Capture(const SingleCycleMIPS &sim);
+    static State Capture(const LockstepMIPS &engine, int lane);
+    static void SortWords(const SparseMem &mem, State &st);
+    static string Compare(const char *engine, const State &expected, const State &actual);
+    bool Report(uint64_t seed, const Case &c, const string &difference) const;
+
+    uint64_t baseSeed, every, budget;
+    mutable mutex reportMutex;
+};
+
+// -------------------------------------------------------------------
+// Generate: a random program of 8-48 instructions plus one input set
+// per lane. Branches and jumps mostly go forward so most programs end
+// well within the cycle budget; a quarter can go anywhere (loops, or a
+// label that does not exist, which ends the run). Lanes draw their
+// inputs from a small palette so that they often agree and stay
+// together in the lockstep engine, and split on the branches where
+// they do not.
+// -------------------------------------------------------------------
+DifferentialFuzzer::Case DifferentialFuzzer::Generate(uint64_t seed) {
+    static const int pool[] = {0, 8, 9, 10, 16, 17, 4, 2};   // $zero $t0 $t1 $t2 $s0 $s1 $a0 $v0
+    static const int poolSize = sizeof(pool) / sizeof(pool[0]);
+    static const int32_t special[] = {0, 1, -1, 2, 0x7fff, 0x8000, -32768, 0xffff,
+                                      INT32_MAX, INT32_MIN, 0x10008000, 31, 32};
+    static const int specialSize = sizeof(special) / sizeof(special[0]);
+
+    mt19937_64 rng(seed);
+    auto pick = [&](uint64_t n) { return (int)(rng() % n); };
+    auto reg = [&] { return string(REGISTER_NAMES[pool[pick(poolSize)]]); };
+
+    vector<uint8_t> ops;
+    for (const IsaEntry &e : ISA) {
+        if (e.format != FMT_NONE) ops.push_back(e.op);
+    }
+
+    Case c;
+    int n = 8 + pick(41);
+    for (int i = 0; i < n; i++) {
+        const IsaEntry &e = ISA[ops[pick(ops.size())]];
+        string line = pick(4) == 0 ? "L" + to_string(i) + ":\t" : "\t";
+        line += e.name;
+        line += " ";
+        string target = "L" + to_string(pick(4) ? i + 1 + pick(n - i) : pick(n + 8));
+        switch (e.format) {
+        case FMT_R:
+            line += reg() + ", " + reg() + ", " + reg();
+            break;
+        case FMT_SHIFT: {
+            string rd = reg(), rt = reg();
+            int sh = pick(32);
+            if (rd == "$zero" && rt == "$zero" && sh == 0) sh = 1;   // not the halt
+            line += rd + ", " + rt + ", " + to_string(sh);
+            break;
+        }
+        case FMT_I: {
+            int kind = pick(5);
+            string imm;
+            if (kind < 2)       imm = to_string(pick(80001) - 40000);
+            else if (kind < 4)  { char h[16]; snprintf(h, sizeof(h), "0x%x", pick(0x10000)); imm = h; }
+            else                imm = to_string(special[pick(7)]);
+            line += reg() + ", " + reg() + ", " + imm;
+            break;
+        }
+        case FMT_MEM: {
+            int kind = pick(10);
+            string base = kind < 8 ? "$gp" : kind < 9 ? "$sp" : reg();
+            int offset = 4 * (pick(33) - 8) + (pick(32) == 0 ? 1 + pick(3) : 0);
+            line += reg() + ", " + to_string(offset) + "(" + base + ")";
+            break;
+        }
+        case FMT_BRANCH:
+            line += reg() + ", " + reg() + ", " + target;
+            break;
+        default:    // FMT_JUMP
+            line += target;
+            break;
+        }
+        c.lines.push_back(line);
+    }
+    c.lines.push_back("L" + to_string(n) + ":\taddi $t0, $t0, 1");
+    if (pick(8)) c.lines.push_back("\tsll $zero, $zero, 0");
+
+    int32_t palette[4];
+    for (int32_t &v : palette) v = pick(2) ? special[pick(specialSize)] : (int32_t)rng();
+    c.lanes.resize(LOCKSTEP_LANES);
+    for (auto &lane : c.lanes) {
+        for (int r = 1; r < poolSize; r++) {
+            int kind = pick(8);
+            if (kind < 4)       lane.push_back({pool[r], palette[pick(4)]});
+            else if (kind < 6)  lane.push_back({pool[r], (int32_t)(pick(64) - 32)});
+            else if (kind < 7)  lane.push_back({pool[r], (int32_t)rng()});
+        }
+    }
+    return c;
+}
+
+// -------------------------------------------------------------------
+// Capture / Compare: the state of one engine, and the first field where
+// two of them differ ("" if none)
+// -------------------------------------------------------------------
+void DifferentialFuzzer::SortWords(const SparseMem &mem, State &st) {
+    st.words.reserve(mem.Size());
+    mem.ForEach([&](uint32_t addr, int32_t value) { st.words.push_back({addr, value}); });
+    sort(st.words.begin(), st.words.end());
+}
+
+DifferentialFuzzer::State DifferentialFuzzer::Capture(const SingleCycleMIPS &sim) {
+    State st;
+    st.cycles = sim.Cycles();
+    st.pc = sim.PC();
+    memcpy(st.regs, sim.Registers(), sizeof(st.regs));
+    SortWords(sim.Memory(), st);
+    return st;
+}
+
+DifferentialFuzzer::State DifferentialFuzzer::Capture(const LockstepMIPS &engine, int lane) {
+    State st;
+    st.cycles = engine.LaneCycles(lane);
+    st.pc = engine.LanePC(lane);
+    for (int r = 0; r < 32; r++) st.regs[r] = engine.LaneRegister(lane, r);
+    SortWords(engine.LaneMemory(lane), st);
+    return st;
+}
+
+string DifferentialFuzzer::Compare(const char *engine, const State &expected, const State &actual) {
+    ostringstream why;
+    why << engine << ": ";
+    if (actual.cycles != expected.cycles) {
+        why << "ran " << actual.cycles << " cycles, the reference " << expected.cycles;
+        return why.str();
+    }
+    why << hex;
+    if (actual.pc != expected.pc) {
+        why << "pc = 0x" << actual.pc << ", the reference 0x" << expected.pc;
+        return why.str();
+    }
+    for (int r = 0; r < 32; r++) {
+        if (actual.regs[r] != expected.regs[r]) {
+            why << REGISTER_NAMES[r] << " = 0x" << (uint32_t)actual.regs[r]
+                << ", the reference 0x" << (uint32_t)expected.regs[r];
+            return why.str();
+        }
+    }
+    if (actual.words == expected.words) return "";
+    size_t i = 0;
+    while (i < actual.words.size() && i < expected.words.size() && actual.words[i] == expected.words[i]) i++;
+    if (i == expected.words.size()) {
+        why << "mem[0x" << actual.words[i].first << "] = 0x" << (uint32_t)actual.words[i].second
+            << ", never stored in the reference";
+    } else if (i == actual.words.size() || actual.words[i].first > expected.words[i].first) {
+        why << "mem[0x" << expected.words[i].first << "] never stored, the reference 0x"
+            << (uint32_t)expected.words[i].second;
+    } else if (actual.words[i].first < expected.words[i].first) {
+        why << "mem[0x" << actual.words[i].first << "] = 0x" << (uint32_t)actual.words[i].second
+            << ", never stored in the reference";
+    } else {
+        why << "mem[0x" << actual.words[i].first << "] = 0x" << (uint32_t)actual.words[i].second
+            << ", the reference 0x" << (uint32_t)expected.words[i].second;
+    }
+    return why.str();
+}
+
+// -------------------------------------------------------------------
+// Check: runs one case on every engine, comparing them every 'every'
+// cycles and once more when the reference runs have all stopped.
+// -------------------------------------------------------------------
+string DifferentialFuzzer::Check(const Case &c, uint64_t &cyclesRun) const {
+    string text;
+    for (const string &line : c.lines) text += line + "\n";
+    SingleCycleMIPS loaded;
+    loaded.SetDebugLog(false);
+    loaded.SetStopReports(false);
+    loaded.LoadAssembly(text.data(), text.size());
+    loaded.SetCycleBudget(budget);
+
+    LockstepMIPS lockstep(loaded);
+    lockstep.Start(c.lanes);
+
+    size_t lanes = min<size_t>(c.lanes.size(), LOCKSTEP_LANES);
+    vector<SingleCycleMIPS> reference, forked, parent, laidOut;
+    vector<State> parentWas(lanes);
+    for (size_t l = 0; l < lanes; l++) {
+        SingleCycleMIPS run = loaded;
+        for (auto &r : c.lanes[l]) run.SetInitialRegister(r.first, r.second);
+        run.Reset();
+        reference.push_back(run);
+        forked.push_back(run.Fork());
+        parent.push_back(run);
+    }
+
+    // The layout comes from the first few cycles of lane 0 only
+    const uint64_t PROFILE_CYCLES = 32;
+    if (lanes) {
+        ExecutionProfile profile;
+        SingleCycleMIPS profiled = reference[0];
+        profiled.SetExecutionProfile(&profile);
+        profiled.Reset();
+        profiled.Step(PROFILE_CYCLES);
+        shared_ptr<const ProgramLayout> layout = ProgramLayout::Build(loaded.GetProgram(), profile);
+        for (size_t l = 0; l < lanes; l++) {
+            laidOut.push_back(reference[l]);
+            laidOut[l].SetLayout(layout);
+            laidOut[l].Reset();
+        }
+    }
+
+    cyclesRun = 0;
+    for (uint64_t at = 0; ; ) {
+        at = budget ? min(at + every, budget) : at + every;
+        bool running = false;
+        for (size_t l = 0; l < lanes; l++) {
+            parent[l] = forked[l];
+            parentWas[l] = Capture(reference[l]);
+            forked[l] = parent[l].Fork();
+            cyclesRun += reference[l].Step(every);
+            forked[l].Step(every);
+            laidOut[l].Step(every);
+            running |= !reference[l].Stopped();
+        }
+        lockstep.RunLanesTo(at);
+
+        for (size_t l = 0; l < lanes; l++) {
+            State expected = Capture(reference[l]);
+            string why = Compare("lockstep", expected, Capture(lockstep, (int)l));
+            if (why.empty()) why = Compare("fork", expected, Capture(forked[l]));
+            if (why.empty()) why = Compare("fork parent", parentWas[l], Capture(parent[l]));
+            if (why.empty()) why = Compare("layout", expected, Capture(laidOut[l]));
+            if (!why.empty()) {
+                return "lane " + to_string(l) + ", cycle " + to_string(expected.cycles) + ", " + why;
+            }
+        }
+        if (!running) break;
+    }
+
+    // Only a run stopped by the budget may still be going
+    for (size_t l = 0; l < lanes; l++) {
+        if (lockstep.LaneLive((int)l) != reference[l].OutOfBudget()) {
+            return "lane " + to_string(l) + ": lockstep " +
+                   (lockstep.LaneLive((int)l) ? "is still running" : "has finished") +
+                   ", the reference " + (reference[l].OutOfBudget() ? "is not" : "is");
+        }
+    }
+    return "";
+}
+
+// -------------------------------------------------------------------
+// Minimize: removes whatever the failure does not need, repeating the
+// passes until none of them removes anything
+// -------------------------------------------------------------------
+DifferentialFuzzer::Case DifferentialFuzzer::Minimize(Case c) const {
+    auto fails = [&](const Case &t) {
+        uint64_t cycles;
+        return !Check(t, cycles).empty();
+    };
+
+    for (bool changed = true; changed; ) {
+        changed = false;
+
+        for (size_t l = 0; l < c.lanes.size() && c.lanes.size() > 1; ) {
+            Case t = c;
+            t.lanes.erase(t.lanes.begin() + l);
+            if (fails(t)) { c = t; changed = true; }
+            else l++;
+        }
+
+        for (size_t run = max<size_t>(c.lines.size() / 2, 1); ; run /= 2) {
+            for (size_t i = 0; i < c.lines.size(); ) {
+                Case t = c;
+                t.lines.erase(t.lines.begin() + i, t.lines.begin() + min(i + run, t.lines.size()));
+                if (fails(t)) { c = t; changed = true; }
+                else i += run;
+            }
+            if (run == 1) break;
+        }
+
+        for (size_t l = 0; l < c.lanes.size(); l++) {
+            for (size_t k = 0; k < c.lanes[l].size(); ) {
+                Case t = c;
+                t.lanes[l].erase(t.lanes[l].begin() + k);
+                if (fails(t)) { c = t; changed = true; }
+                else k++;
+            }
+        }
+    }
+    return c;
+}
+
+// -------------------------------------------------------------------
+// Report: writes a failing case as fuzz-<seed>.txt / .lanes and prints
+// where it went
+// -------------------------------------------------------------------
+bool DifferentialFuzzer::Report(uint64_t seed, const Case &c, const string &difference) const {
+    string base = "fuzz-" + to_string(seed);
+    ofstream prog(base + ".txt"), lanes(base + ".lanes");
+    prog << "# differential fuzz failure, seed " << seed << ": " << difference << "\n.text\n";
+    for (const string &line : c.lines) prog << line << "\n";
+    for (auto &lane : c.lanes) {
+        if (lane.empty()) lanes << "$zero=0";    // keeps the lane (blank lines are skipped)
+        for (size_t k = 0; k < lane.size(); k++) {
+            lanes << (k ? " " : "") << REGISTER_NAMES[lane[k].first] << "=" << lane[k].second;
+        }
+        lanes << "\n";
+    }
+    lock_guard<mutex> lock(reportMutex);
+    cout << "[fuzz] seed " << dec << seed << ": " << difference << "\n"
+         << "       minimized to " << c.lines.size() << " lines, " << c.lanes.size()
+         << " lanes: " << base << ".txt, " << base << ".lanes" << endl;
+    return prog.good() && lanes.good();
+}
+
+// -------------------------------------------------------------------
+// Run: the worker threads take program numbers from a shared counter;
+// the calling thread prints the progress every few seconds.
+// -------------------------------------------------------------------
+uint64_t DifferentialFuzzer::Run(unsigned threads, uint64_t seconds, uint64_t programs) {
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+    atomic<uint64_t> next{0}, done{0}, cycles{0}, failures{0};
+    atomic<unsigned> running{threads};
+    auto start = chrono::steady_clock::now();
+    auto deadline = start + chrono::seconds(seconds);
+
+    cout << "[fuzz] seed " << dec << baseSeed << ", " << threads << " threads, state compared every "
+         << every << " cycles, budget " << budget << " cycles" << endl;
+
+    vector<thread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&] {
+            for (;;) {
+                uint64_t i = next++;
+                if (programs && i >= programs) break;
+                if (seconds && chrono::steady_clock::now() >= deadline) break;
+                uint64_t seed = baseSeed + i;
+                Case c = Generate(seed);
+                uint64_t ran = 0;
+                string why = Check(c, ran);
+                cycles += ran;
+                done++;
+                if (!why.empty()) {
+                    failures++;
+                    Case small = Minimize(c);
+                    string smallWhy = Check(small, ran);
+                    if (!Report(seed, small, smallWhy.empty() ? why : smallWhy)) {
+                        cerr << "[fuzz] cannot write fuzz-" << seed << ".txt\n";
+                    }
+                }
+            }
+            running--;
+        });
+    }
+
+    auto progress = [&](const char *prefix) {
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cerr << prefix << dec << done.load() << " programs, " << cycles.load() << " cycles, "
+             << fixed << setprecision(0) << done.load() / max(secs, 1e-9) << " programs/s, "
+             << failures.load() << " failing" << endl;
+        cerr.unsetf(ios::floatfield);
+    };
+    auto lastReport = start;
+    while (running.load()) {
+        this_thread::sleep_for(chrono::milliseconds(100));
+        if (chrono::steady_clock::now() - lastReport >= chrono::seconds(5)) {
+            lastReport = chrono::steady_clock::now();
+            progress("[fuzz] ");
+        }
+    }
+    for (thread &w : workers) w.join();
+    progress("[fuzz] done: ");
+    return failures.load();
+}
+
+// -------------------------------------------------------------------
+// ParseCycleSelection: turns the user's "30,34,last" / "all" answer
+// into the list of cycles to print (-1 means every cycle).
+// -------------------------------------------------------------------
+static bool ParseCycleSelection(const string &input, vector<int64_t> &cyclesToPrint, bool &includeLast) {
+    // If user typed "all", we store -1 to indicate we print every cycle
+    if (input == "all") {
+        cyclesToPrint.push_back(-1);
+        return true;
+    }
+    // Otherwise, parse comma-separated tokens
+    istringstream iss(input);
+    string token;
+    while (getline(iss, token, ',')) {
+        if (token == "last") {
+            includeLast = true;
+        } else {
+            try {
+                cyclesToPrint.push_back(stoll(token));
+            } catch (const std::exception& e) {
+                cerr << "Invalid input: " << token << " is not a number or 'last'." << endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+#ifdef MIPS_POSIX
+// -------------------------------------------------------------------
+// =================== Simulation Server =============================
+// -------------------------------------------------------------------
+// Keeps running and accepts jobs on a Unix domain socket, so a test
+// harness does not pay for process startup and parsing on every run.
+// Decoded programs are cached by the hash of their source text (a hit
+// also compares the text) and shared (read-only) between jobs. One
+// thread polls every connection and cuts what arrives into jobs; a
+// complete job goes to a pool of worker threads, so a connected client
+// that sends nothing holds no worker. Every job runs with a cycle
+// budget, so a program that never halts cannot keep a worker either.
+//
+// A job is a few text lines, ended by RUN:
+//     PROGRAM_PATH <path>          or   PROGRAM <nbytes>\n<source bytes>
+//     CYCLES <selection>           optional, like the prompt (default "last")
+//     OUTPUT <path>                optional, write the output to a file
+//     RUN
+// Reply: "OK <n>\n" followed by n bytes of output (n is 0 when it went to
+// a file), or "ERR <message>\n". "QUIT" closes the connection and
+// "SHUTDOWN" stops the server.
+static const uint64_t SERVER_JOB_CYCLES = 100000000;   // default budget per job
+
+class SimulationServer {
+public:
+    SimulationServer(size_t threads, size_t cacheEntries, uint64_t jobCycles)
+        : workerCount(threads ? threads : 1), cacheLimit(cacheEntries ? cacheEntries : 1),
+          jobBudget(jobCycles ? jobCycles : SERVER_JOB_CYCLES) {}
+
+    int Serve(const string &socketPath);
+
+private:
+    // One client. The polling thread appends what arrives to buf and cuts
+    // it into commands; the commands up to RUN, QUIT or SHUTDOWN are one
+    // batch, run by one worker. The job settings live here between them.
+    struct Connection {
+        int fd;
+        string buf;
+        size_t pos=0;
+        bool eof=false;               // the client closed its side
+        bool busy=false;              // a worker has the batch
+        vector<pair<string, string>> batch;   // command line, PROGRAM bytes
+        string source, selection = "last", outputPath;
+        bool haveSource=false;
+        bool TakeBatch();
+    };
+
+    shared_ptr<const Program> GetProgram(const string &source);
+    void Worker();
+    bool RunBatch(Connection &conn);
+    void Dispatch(Connection &conn);
+    void Wake();
+    static bool ParseSize(const string &text, size_t &n);
+    static bool SendAll(int fd, const string &data);
+
+    size_t workerCount, cacheLimit;
+    uint64_t jobBudget;
+    int listenFd=-1;
+    int wakeFds[2] = {-1, -1};        // a worker writes a byte here when it is done
+
+    mutex queueMutex;
+    condition_variable queueCv;
+    deque<Connection*> jobs;          // connections with a complete batch
+    deque<pair<Connection*, bool>> done;   // back from a worker; false = close it
+    bool stopping=false;
+    unordered_map<int, unique_ptr<Connection>> connections;   // polling thread only
+
+    struct CacheEntry {
+        string source;                  // a hash match only counts if this matches too
+        shared_ptr<const Program> prog;
+    };
+    mutex cacheMutex;
+    unordered_map<uint64_t, CacheEntry> cache;
+    deque<uint64_t> cacheOrder;   // oldest first, for eviction
+};
+
+bool SimulationServer::ParseSize(const string &text, size_t &n) {
+    if (text.empty() || !isdigit((unsigned char)text[0])) return false;
+    errno = 0;
+    char *end = nullptr;
+    unsigned long long v = strtoull(text.c_str(), &end, 10);
+    if (errno != 0 || *end != '\0') return false;
+    n = (size_t)v;
+    return true;
+}
+
+// -------------------------------------------------------------------
+// TakeBatch: moves complete commands from buf into batch; true once
+// the batch is ended by RUN, QUIT or SHUTDOWN (or a bad PROGRAM line,
+// which RunBatch then reports)
+// -------------------------------------------------------------------
+bool SimulationServer::Connection::TakeBatch() {
+    bool complete = false;
+    size_t nl;
+    while (!complete && (nl = buf.find('\n', pos)) != string::npos) {
+        string line(buf, pos, nl - pos);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        string cmd = line.substr(0, line.find(' '));
+        string payload;
+        if (cmd == "PROGRAM") {
+            size_t n = 0;
+            string arg = (line.size() > cmd.size()) ? line.substr(cmd.size() + 1) : string();
+            if (!ParseSize(arg, n)) {
+                complete = true;
+            } else {
+                if (buf.size() - (nl + 1) < n) break;       // the source is not all here yet
+                payload.assign(buf, nl + 1, n);
+                nl += n;
+            }
+        }
+        complete = complete || cmd == "RUN" || cmd == "QUIT" || cmd == "SHUTDOWN";
+        batch.emplace_back(move(line), move(payload));
+        pos = nl + 1;
+    }
+    if (pos > 0 && pos * 2 >= buf.size()) {
+        buf.erase(0, pos);
+        pos = 0;
+    }
+    return complete;
+}
+
+bool SimulationServer::SendAll(int fd, const string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        sent += (size_t)n;
+    }
+    return true;
+}
+
+// -------------------------------------------------------------------
+// GetProgram: returns the decoded program for this source text, parsing
+// it only the first time it is seen.
+// -------------------------------------------------------------------
+shared_ptr<const Program> SimulationServer::GetProgram(const string &source) {
+    uint64_t key = HashBytes(source.data(), source.size()) ^ source.size();
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        auto it = cache.find(key);
+        if (it != cache.end() && it->second.source == source) return it->second.prog;
+    }
+
+    // Parse outside the lock; two jobs racing on a new program just both parse it
+    SingleCycleMIPS loader;
+    loader.SetDebugLog(false);
+    istringstream in(source);
+    try {
+        loader.LoadAssembly(in);
+    } catch (const std::exception &e) {
+        // RUN replies ERR with this; nothing is cached
+        throw invalid_argument(string("the program does not parse: ") + e.what());
+    }
+    shared_ptr<const Program> prog = loader.GetProgram();
+
+    lock_guard<mutex> lock(cacheMutex);
+    auto it = cache.find(key);
+    if (it == cache.end()) {
+        cache.emplace(key, CacheEntry{source, prog});
+        cacheOrder.push_back(key);
+        if (cacheOrder.size() > cacheLimit) {
+            cache.erase(cacheOrder.front());
+            cacheOrder.pop_front();
+        }
+    } else if (it->second.source != source) {
+        it->second = CacheEntry{source, prog};   // a colliding source takes over the slot
+    }
+    return prog;
+}
+
+// -------------------------------------------------------------------
+// RunBatch: runs the commands of one batch in order; false if the
+// connection is to be closed afterwards
+// -------------------------------------------------------------------
+bool SimulationServer::RunBatch(Connection &conn) {
+    int fd = conn.fd;
+    auto fail = [&](const string &msg) { return SendAll(fd, "ERR " + msg + "\n"); };
+    vector<pair<string, string>> batch;
+    batch.swap(conn.batch);
+
+    for (auto &[line, payload] : batch) {
+        string cmd = line.substr(0, line.find(' '));
+        string arg = (line.size() > cmd.size()) ? line.substr(cmd.size() + 1) : string();
+
+        if (cmd == "PROGRAM_PATH") {
+            ifstream fin(arg, ios::binary);
+            if (!fin.is_open()) {
+                if (!fail("cannot open " + arg)) return false;
+                continue;
+            }
+            ostringstream text;
+            text << fin.rdbuf();
+            conn.source = text.str();
+            conn.haveSource = true;
+        } else if (cmd == "PROGRAM") {
+            size_t n;
+            if (!ParseSize(arg, n)) {
+                fail("bad PROGRAM size");
+                return false;
+            }
+            conn.source = move(payload);
+            conn.haveSource = true;
+        } else if (cmd == "CYCLES") {
+            conn.selection = arg;
+        } else if (cmd == "OUTPUT") {
+            conn.outputPath = arg;
+        } else if (cmd == "RUN") {
+            bool ok;
+            if (!conn.haveSource) {
+                ok = fail("no program given");
+            } else {
+                vector<int64_t> cyclesToPrint;
+                bool includeLast = false;
+                if (!ParseCycleSelection(conn.selection, cyclesToPrint, includeLast)) {
+                    ok = fail("bad cycle selection: " + conn.selection);
+                } else {
+                    try {
+                        SingleCycleMIPS sim;
+                        sim.SetDebugLog(false);
+                        sim.SetProgram(GetProgram(conn.source));
+                        sim.SetCycleBudget(jobBudget);
+                        string budgetError = "stopped at the job budget of " + to_string(jobBudget) + " cycles";
+                        if (conn.outputPath.empty()) {
+                            ostringstream out;
+                            out << OUTPUT_HEADER;
+                            sim.RunSimulation(out, cyclesToPrint, includeLast);
+                            string text = out.str();
+                            ok = sim.OutOfBudget() ? fail(budgetError)
+                                                   : SendAll(fd, "OK " + to_string(text.size()) + "\n") && SendAll(fd, text);
+                        } else {
+                            OutputFile file;
+                            if (!file.Open(conn.outputPath)) {
+                                ok = fail("cannot open " + conn.outputPath);
+                            } else {
+                                file.Stream() << OUTPUT_HEADER;
+                                sim.RunSimulation(file.Stream(), cyclesToPrint, includeLast);
+                                if (!file.Close())          ok = fail("cannot write " + conn.outputPath);
+                                else if (sim.OutOfBudget()) ok = fail(budgetError);
+                                else                        ok = SendAll(fd, "OK 0\n");
+                            }
+                        }
+                    } catch (const std::exception &e) {
+                        ok = fail(string("job failed: ") + e.what());
+                    }
+                }
+            }
+            // the next job on this connection starts from scratch
+            conn.haveSource = false;
+            conn.source.clear();
+            conn.selection = "last";
+            conn.outputPath.clear();
+            if (!ok) return false;
+        } else if (cmd == "QUIT") {
+            return false;
+        } else if (cmd == "SHUTDOWN") {
+            {
+                lock_guard<mutex> lock(queueMutex);
+                stopping = true;
+            }
+            queueCv.notify_all();
+            return false;
+        } else if (!cmd.empty()) {
+            if (!fail("unknown command " + cmd)) return false;
+        }
+    }
+    return true;
+}
+
+void SimulationServer::Wake() {
+    char byte = 1;
+    while (write(wakeFds[1], &byte, 1) < 0 && errno == EINTR) {}
+}
+
+void SimulationServer::Worker() {
+    for (;;) {
+        Connection *conn;
+        {
+            unique_lock<mutex> lock(queueMutex);
+            queueCv.wait(lock, [&] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) return;          // stopping and nothing left
+            conn = jobs.front();
+            jobs.pop_front();
+        }
+        bool keep = RunBatch(*conn);
+        {
+            lock_guard<mutex> lock(queueMutex);
+            done.emplace_back(conn, keep);
+        }
+        Wake();
+    }
+}
+
+// -------------------------------------------------------------------
+// Dispatch (polling thread): hands the connection to the workers if a
+// batch is complete, and closes it if the client is gone
+// -------------------------------------------------------------------
+void SimulationServer::Dispatch(Connection &conn) {
+    if (conn.TakeBatch()) {
+        conn.busy = true;
+        lock_guard<mutex> lock(queueMutex);
+        jobs.push_back(&conn);
+        queueCv.notify_one();
+    } else if (conn.eof) {
+        close(conn.fd);
+        connections.erase(conn.fd);
+    }
+}
+
+// -------------------------------------------------------------------
+// Serve: binds the socket, then polls it and every idle connection,
+// handing complete jobs to the worker threads until a SHUTDOWN request
+// arrives.
+// -------------------------------------------------------------------
+int SimulationServer::Serve(const string &socketPath) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(addr.sun_path)) {
+        cerr << "Socket path too long: " << socketPath << "\n";
+        return 1;
+    }
+    strcpy(addr.sun_path, socketPath.c_str());
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str());
+    if (listenFd < 0 || bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, 128) < 0 ||
+        pipe(wakeFds) < 0) {
+        cerr << "Cannot listen on " << socketPath << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+    cout << "Listening on " << socketPath << " with " << workerCount << " worker thread(s)" << endl;
+
+    vector<thread> workers;
+    for (size_t i = 0; i < workerCount; i++) workers.emplace_back(&SimulationServer::Worker, this);
+
+    vector<pollfd> fds;
+    for (;;) {
+        fds.clear();
+        fds.push_back({listenFd, POLLIN, 0});
+        fds.push_back({wakeFds[0], POLLIN, 0});
+        for (auto &entry : connections) {
+            if (!entry.second->busy) fds.push_back({entry.first, POLLIN, 0});
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (fds[1].revents) {
+            char drain[256];
+            if (read(wakeFds[0], drain, sizeof(drain)) < 0 && errno != EINTR && errno != EAGAIN) break;
+            deque<pair<Connection*, bool>> finished;
+            {
+                lock_guard<mutex> lock(queueMutex);
+                if (stopping) break;
+                finished.swap(done);
+            }
+            for (auto &[conn, keep] : finished) {
+                conn->busy = false;
+                if (keep) {
+                    Dispatch(*conn);            // the next job may already be buffered
+                } else {
+                    close(conn->fd);
+                    connections.erase(conn->fd);
+                }
+            }
+        }
+        for (size_t i = 2; i < fds.size(); i++) {
+            if (!fds[i].revents) continue;
+            auto it = connections.find(fds[i].fd);
+            if (it == connections.end() || it->second->busy) continue;
+            Connection &conn = *it->second;
+            char tmp[65536];
+            ssize_t n = recv(conn.fd, tmp, sizeof(tmp), MSG_DONTWAIT);
+            if (n > 0) conn.buf.append(tmp, (size_t)n);
+            else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) conn.eof = true;
+            Dispatch(conn);
+        }
+        if (fds[0].revents) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd >= 0) {
+                auto conn = make_unique<Connection>();
+                conn->fd = fd;
+                connections.emplace(fd, move(conn));
+            } else if (errno != EINTR && errno != ECONNABORTED) {
+                break;
+            }
+        }
+    }
+    {
+        lock_guard<mutex> lock(queueMutex);
+        stopping = true;
+    }
+    queueCv.notify_all();
+    for (auto &t : workers) t.join();          // the jobs already queued still run
+    for (auto &entry : connections) close(entry.first);
+    connections.clear();
+    close(wakeFds[0]);
+    close(wakeFds[1]);
+    close(listenFd);
+    unlink(socketPath.c_str());
+    return 0;
+}
+
+#ifndef MIPS_NO_MAIN
+// -------------------------------------------------------------------
+// SubmitJob: client side of the server protocol; sends the program text
+// and writes the reply to outFile.
+// -------------------------------------------------------------------
+static int SubmitJob(const string &socketPath, const string &inFile, const string &selection,
+                     const string &outFile) {
+    ifstream fin(inFile, ios::binary);
+    if (!fin.is_open()) {
+        cerr << "Cannot open " << inFile << "\n";
+        return 1;
+    }
+    ostringstream text;
+    text << fin.rdbuf();
+    string source = text.str();
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        cerr << "Cannot connect to " << socketPath << ": " << strerror(errno) << "\n";
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    string job = "PROGRAM " + to_string(source.size()) + "\n" + source +
+                 "CYCLES " + selection + "\nRUN\nQUIT\n";
+    string reply;
+    char buf[65536];
+    ssize_t n;
+    bool sent = true;
+    for (size_t off = 0; off < job.size(); off += (size_t)n) {
+        n = send(fd, job.data() + off, job.size() - off, MSG_NOSIGNAL);
+        if (n <= 0) { sent = false; break; }
+    }
+    while (sent && (n = recv(fd, buf, sizeof(buf), 0)) > 0) reply.append(buf, (size_t)n);
+    close(fd);
+
+    size_t nl = reply.find('\n');
+    if (nl == string::npos || reply.compare(0, 3, "OK ") != 0) {
+        cerr << "Server error: " << reply.substr(0, nl);
+        cerr << "\n";
+        return 1;
+    }
+    ofstream out(outFile, ios::binary);
+    if (!out.is_open()) {
+        cerr << "Cannot open " << outFile << "\n";
+        return 1;
+    }
+    out << reply.substr(nl + 1);
+    return 0;
+}
+#endif
+#endif
+
+// -------------------------------------------------------------------
+// =================== Trace Queries =================================
+// -------------------------------------------------------------------
+// Answers questions about a finished commit trace through its index,
+// with both files mapped rather than read:
+//   reg <reg> at <cycle>    a register after that cycle
+//   pc at <cycle>           the PC the cycle ran at
+//   mem <addr> at <cycle>   a memory word after that cycle
+//   writes <addr>           every write to that word
+//   cycle <cycle>           the trace record of that cycle
+// A state question is a binary search over the keyframes plus a replay
+// of at most one keyframe interval of records; a memory question is a
+// binary search over the sorted write log. Neither depends on the
+// length of the trace.
+class TraceQuery {
+public:
+    bool Open(const string &tracePath, string &error) {
+        if (!trace.Open(tracePath)) {
+            error = "cannot open " + tracePath;
+            return false;
+        }
+        if (!index.Open(tracePath + ".idx") || index.Size() < sizeof(TraceIndexHeader)) {
+            error = "cannot open " + tracePath + ".idx (write the trace with --trace-index)";
+            return false;
+        }
+        hdr = (const TraceIndexHeader*)index.Data();
+        if (memcmp(hdr->magic, TRACE_INDEX_MAGIC, sizeof(hdr->magic)) != 0 ||
+            index.Size() != sizeof(TraceIndexHeader) + hdr->keyframeCount * sizeof(TraceKeyframe) +
+                            hdr->writeCount * sizeof(TraceWrite)) {
+            error = tracePath + ".idx is not a complete trace index";
+            return false;
+        }
+        keys = (const TraceKeyframe*)(index.Data() + sizeof(TraceIndexHeader));
+        writes = (const TraceWrite*)(keys + hdr->keyframeCount);
+        binary = trace.Size() >= sizeof(COMMIT_TRACE_MAGIC) &&
+                 memcmp(trace.Data(), COMMIT_TRACE_MAGIC, sizeof(COMMIT_TRACE_MAGIC)) == 0;
+        return true;
+    }
+
+    bool Answer(const string &question, ostream &out, string &error) {
+        istringstream iss(question);
+        vector<string> words;
+        string word;
+        while (iss >> word) words.push_back(word);
+        uint64_t cycle = 0, addr = 0;
+
+        if (words.size() == 4 && words[0] == "reg" && words[2] == "at" && Number(words[3], cycle)) {
+            int reg = SingleCycleMIPS::ParseRegister(words[1]);
+            if (reg < 0 || reg >= 32) {
+                error = "unknown register " + words[1];
+                return false;
+            }
+            int32_t regs[32];
+            CommitRecord rec;
+            if (!StateAt(cycle, regs, rec, error)) return false;
+            out << "cycle " << dec << cycle << ": " << words[1] << " = " << regs[reg]
+                << " (0x" << hex << (uint32_t)regs[reg] << ")" << dec << "\n";
+            return true;
+        }
+        if (words.size() == 3 && words[0] == "pc" && words[1] == "at" && Number(words[2], cycle)) {
+            int32_t regs[32];
+            CommitRecord rec;
+            if (!StateAt(cycle, regs, rec, error)) return false;
+            out << "cycle " << dec << cycle << ": pc = 0x" << hex << rec.pc << dec << "\n";
+            return true;
+        }
+        if (words.size() == 4 && words[0] == "mem" && words[2] == "at" && Number(words[1], addr) &&
+            Number(words[3], cycle)) {
+            if (cycle > hdr->lastCycle) {
+                error = "the trace ends at cycle " + to_string(hdr->lastCycle);
+                return false;
+            }
+            const TraceWrite *end = writes + hdr->writeCount;
+            const TraceWrite *it = upper_bound(writes, end, TraceWrite{(uint32_t)addr, 0, cycle});
+            out << "cycle " << dec << cycle << ": mem[0x" << hex << addr << "] = ";
+            if (it != writes && (it - 1)->addr == (uint32_t)addr) {
+                out << dec << (it - 1)->value << " (0x" << hex << (uint32_t)(it - 1)->value
+                    << ", written at cycle " << dec << (it - 1)->cycle << ")\n";
+            } else {
+                out << "0 (never written)\n";
+            }
+            out << dec;
+            return true;
+        }
+        if (words.size() == 2 && words[0] == "writes" && Number(words[1], addr)) {
+            const TraceWrite *end = writes + hdr->writeCount;
+            const TraceWrite *it = lower_bound(writes, end, TraceWrite{(uint32_t)addr, 0, 0});
+            size_t count = 0;
+            for (; it != end && it->addr == (uint32_t)addr; ++it, ++count) {
+                out << "cycle " << dec << it->cycle << ": mem[0x" << hex << addr << "] = 0x"
+                    << (uint32_t)it->value << "\n";
+            }
+            out << dec << count << " write(s) to 0x" << hex << addr << dec << "\n";
+            return true;
+        }
+        if (words.size() == 2 && words[0] == "cycle" && Number(words[1], cycle)) {
+            int32_t regs[32];
+            CommitRecord rec;
+            if (!StateAt(cycle, regs, rec, error)) return false;
+            out << dec << rec.cycle << ' ' << hex << rec.pc;
+            if (rec.flags & CommitRecord::HAS_REG) out << " r" << dec << (int)rec.reg << '=' << hex << (uint32_t)rec.regValue;
+            if (rec.flags & CommitRecord::HAS_MEM) out << " m" << hex << rec.memAddr << '=' << (uint32_t)rec.memValue;
+            out << dec << "\n";
+            return true;
+        }
+        error = "cannot understand '" + question + "'";
+        return false;
+    }
+
+private:
+    static bool Number(const string &text, uint64_t &value) {
+        try {
+            size_t used = 0;
+            value = stoull(text, &used, 0);
+            return used == text.size();
+        } catch (const std::exception &) {
+            return false;
+        }
+    }
+
+    // The registers after 'cycle' and that cycle's record: start from the
+    // last keyframe at or before it and replay the records up to it
+    bool StateAt(uint64_t cycle, int32_t *regs, CommitRecord &rec, string &error) {
+        if (hdr->keyframeCount == 0 || cycle < keys[0].cycle || cycle > hdr->lastCycle) {
+            error = "cycle " + to_string(cycle) + " is not in the trace";
+            return false;
+        }
+        const TraceKeyframe *key = upper_bound(keys, keys + hdr->keyframeCount, cycle,
+            [](uint64_t c, const TraceKeyframe &k) { return c < k.cycle; }) - 1;
+        memcpy(regs, key->regs, sizeof(key->regs));
+        uint64_t offset = key->offset;
+        if (!ReadRecord(offset, rec)) {
+            error = badLine ? "bad line " + to_string(badLine) + " in the trace"
+                            : "the trace does not match its index";
+            return false;
+        }
+        while (rec.cycle < cycle) {
+            if (!ReadRecord(offset, rec)) {
+                error = badLine ? "bad line " + to_string(badLine) + " in the trace"
+                                : "the trace ends before cycle " + to_string(cycle);
+                return false;
+            }
+            if (rec.flags & CommitRecord::HAS_REG) regs[rec.reg & 31] = rec.regValue;
+        }
+        return rec.cycle == cycle;
+    }
+
+    // The record at 'offset' (skipping comment lines), advancing past it.
+    // False at the end of the trace, or with badLine set if a text line
+    // does not parse.
+    bool ReadRecord(uint64_t &offset, CommitRecord &rec) {
+        badLine = 0;
+        if (binary) {
+            if (offset + sizeof(rec) > trace.Size()) return false;
+            memcpy(&rec, trace.Data() + offset, sizeof(rec));
+            offset += sizeof(rec);
+            return true;
+        }
+        while (offset < trace.Size()) {
+            const char *start = trace.Data() + offset;
+            const char *nl = (const char*)memchr(start, '\n', trace.Size() - offset);
+            size_t len = nl ? (size_t)(nl - start) : trace.Size() - offset;
+            offset += len + (nl ? 1 : 0);
+            if (len == 0 || start[0] == '#') continue;
+            if (ParseCommitLine(string(start, len), rec)) return true;
+            // only on this error path is it worth counting the lines
+            badLine = 1 + (uint64_t)count(trace.Data(), start, '\n');
+            return false;
+        }
+        return false;
+    }
+
+    MappedFile trace, index;
+    const TraceIndexHeader *hdr=nullptr;
+    const TraceKeyframe *keys=nullptr;
+    const TraceWrite *writes=nullptr;
+    bool binary=false;
+    uint64_t badLine=0;          // set by a failed ReadRecord, 0 if none
+};
+
+// -------------------------------------------------------------------
+// =================== C Interface (mips_sim.h) ======================
+// -------------------------------------------------------------------
+// A thin extern "C" layer over SingleCycleMIPS for callers in other
+// languages (ctypes/cffi). The handle keeps the setup (initial
+// registers, loop detection, budget) so a new load can reapply it.
+// No C++ exception may reach the caller: every entry point that can
+// throw (a malformed operand, bad_alloc) runs under Guard, which turns
+// the exception into the handle's error and a failed result.
+struct mips_sim {
+    unique_ptr<SingleCycleMIPS> sim;
+    vector<pair<int,int32_t>> initialRegs;
+    SparseMem images;
+    bool detectLoops = false;
+    uint64_t cycleBudget = 0;
+    bool failed = false;        // an exception stopped the last step; cleared by reset/load
+    string error;
+
+    // A fresh simulator with this handle's setup (drops breakpoints)
+    void Rebuild() {
+        sim.reset(new SingleCycleMIPS());
+        sim->SetDebugLog(false);
+        sim->SetStopReports(false);
+        for (auto &r : initialRegs) sim->SetInitialRegister(r.first, r.second);
+        sim->SetBinaryImages(images);
+        sim->SetLoopDetection(detectLoops);
+        sim->SetCycleBudget(cycleBudget);
+    }
+};
+
+// Runs body (which returns 0 or -1); an exception becomes -1 and the error
+template <typename F>
+static int Guard(mips_sim *sim, const char *what, F body) {
+    try {
+        return body();
+    } catch (const std::exception &e) {
+        sim->error = string(what) + ": " + e.what();
+    } catch (...) {
+        sim->error = string(what) + ": unknown error";
+    }
+    return -1;
+}
+
+extern "C" {
+
+int mips_sim_abi_version(void) { return MIPS_SIM_ABI_VERSION; }
+
+mips_sim *mips_sim_new(void) {
+    mips_sim *h = nullptr;
+    try {
+        h = new mips_sim();
+        h->Rebuild();
+        h->sim->Reset();
+        return h;
+    } catch (...) {
+        delete h;
+        return nullptr;
+    }
+}
+
+void mips_sim_free(mips_sim *sim) { delete sim; }
+
+int mips_sim_load(mips_sim *sim, const char *source, size_t length) {
+    return Guard(sim, "cannot load the program", [&] {
+        sim->failed = false;
+        sim->Rebuild();
+        try {
+            sim->sim->LoadAssembly(source, length);
+        } catch (...) {
+            sim->Rebuild();             // leave an empty program, not half of this one
+            sim->sim->Reset();
+            throw;
+        }
+        sim->sim->Reset();
+        sim->error.clear();
+        return 0;
+    });
+}
+
+int mips_sim_load_file(mips_sim *sim, const char *path) {
+    return Guard(sim, "cannot load the program", [&] {
+        sim->failed = false;
+        sim->Rebuild();
+        bool opened;
+        try {
+            opened = sim->sim->LoadAssembly(string(path));
+        } catch (...) {
+            sim->Rebuild();
+            sim->sim->Reset();
+            throw;
+        }
+        if (!opened) {
+            sim->error = string("cannot open ") + path;
+            return -1;
+        }
+        sim->sim->Reset();
+        sim->error.clear();
+        return 0;
+    });
+}
+
+int mips_sim_set_register(mips_sim *sim, int reg, int32_t value) {
+    if (reg < 0 || reg >= 32) {
+        sim->error = "register number out of range";
+        return -1;
+    }
+    return Guard(sim, "cannot set the register", [&] {
+        sim->initialRegs.push_back({reg, value});
+        sim->sim->SetInitialRegister(reg, value);
+        return 0;
+    });
+}
+
+int mips_sim_load_image(mips_sim *sim, const char *path, uint32_t addr) {
+    return Guard(sim, "cannot load the image", [&] {
+        if (!sim->sim->LoadBinaryImage(path, addr, sim->error)) return -1;
+        sim->images = sim->sim->BinaryImages();
+        return 0;
+    });
+}
+
+int mips_sim_add_breakpoint(mips_sim *sim, const char *expr) {
+    return Guard(sim, "cannot add the breakpoint", [&] {
+        return sim->sim->AddPredicate(expr, true, sim->error) ? 0 : -1;
+    });
+}
+
+void mips_sim_set_loop_detection(mips_sim *sim, int on) {
+    sim->detectLoops = on != 0;
+    sim->sim->SetLoopDetection(sim->detectLoops);
+}
+
+void mips_sim_set_cycle_budget(mips_sim *sim, uint64_t max_cycles) {
+    sim->cycleBudget = max_cycles;
+    sim->sim->SetCycleBudget(max_cycles);
+}
+
+int mips_sim_reset(mips_sim *sim) {
+    return Guard(sim, "cannot reset", [&] {
+        sim->failed = false;
+        sim->sim->Reset();
+        return 0;
+    });
+}
+
+uint64_t mips_sim_step(mips_sim *sim, uint64_t n) {
+    uint64_t before = sim->sim->Cycles();
+    if (Guard(sim, "step failed", [&] { sim->sim->Step(n); return 0; }) != 0) sim->failed = true;
+    return sim->sim->Cycles() - before;
+}
+
+uint64_t mips_sim_run_until(mips_sim *sim, int (*stop)(const mips_sim *sim, void *ctx),
+                            void *ctx, uint64_t max_cycles) {
+    struct Callback { int (*stop)(const mips_sim *, void *); const mips_sim *handle; void *ctx; };
+    Callback cb = {stop, sim, ctx};
+    auto adapter = [](const SingleCycleMIPS &, void *p) {
+        Callback *c = (Callback *)p;
+        return c->stop(c->handle, c->ctx) != 0;
+    };
+    uint64_t before = sim->sim->Cycles();
+    int result = Guard(sim, "run failed", [&] {
+        if (stop) sim->sim->RunUntil(adapter, &cb, max_cycles);
+        else      sim->sim->RunUntil(nullptr, nullptr, max_cycles);
+        return 0;
+    });
+    if (result != 0) sim->failed = true;
+    return sim->sim->Cycles() - before;
+}
+
+int mips_sim_status(const mips_sim *sim) {
+    const SingleCycleMIPS &s = *sim->sim;
+    if (sim->failed)       return MIPS_SIM_ERROR;
+    if (s.Finished())      return MIPS_SIM_HALTED;
+    if (s.BreakpointHit()) return MIPS_SIM_BREAKPOINT;
+    if (s.Livelocked())    return MIPS_SIM_LIVELOCK;
+    if (s.OutOfBudget())   return MIPS_SIM_BUDGET;
+    return MIPS_SIM_RUNNING;
+}
+
+const int32_t *mips_sim_registers(const mips_sim *sim) { return sim->sim->Registers(); }
+uint32_t mips_sim_pc(const mips_sim *sim) { return sim->sim->PC(); }
+uint64_t mips_sim_cycles(const mips_sim *sim) { return sim->sim->Cycles(); }
+int mips_sim_word(const mips_sim *sim, uint32_t addr, int32_t *value) {
+    int32_t v = 0;
+    bool stored = sim->sim->Word(addr, v);
+    if (value) *value = v;
+    return stored ? 1 : 0;
+}
+
+size_t mips_sim_memory(const mips_sim *sim, uint32_t *addrs, int32_t *values, size_t capacity) {
+    const SparseMem &mem = sim->sim->Memory();
+    size_t i = 0;
+    mem.ForEach([&](uint32_t addr, int32_t value) {
+        if (i < capacity) {
+            addrs[i] = addr;
+            values[i] = value;
+        }
+        i++;
+    });
+    return i;
+}
+
+int mips_sim_save_state(mips_sim *sim, const char *path) {
+    return Guard(sim, "cannot save the state", [&] {
+        return sim->sim->SaveStateImage(path, sim->error) ? 0 : -1;
+    });
+}
+
+const char *mips_sim_error(const mips_sim *sim) { return sim->error.c_str(); }
+
+} // extern "C"
+
+#ifndef MIPS_NO_MAIN
+// -------------------------------------------------------------------
+// FlagValue: the number given to a numeric flag. Prints "Invalid value
+// for <flag>" and returns false unless all of it is a number of the
+// flag's type (no sign for the unsigned ones) that fits.
+// -------------------------------------------------------------------
+template <typename T>
+static bool FlagValue(const string &flag, const char *text, T &value) {
+    errno = 0;
+    char *end = nullptr;
+    bool ok = *text != '\0' && !isspace((unsigned char)*text);
+    if constexpr (is_floating_point<T>::value) {
+        double v = strtod(text, &end);
+        ok = ok && isfinite(v) && v >= 0;
+        value = (T)v;
+    } else if constexpr (is_signed<T>::value) {
+        long long v = strtoll(text, &end, 0);
+        ok = ok && v >= (long long)numeric_limits<T>::min() && v <= (long long)numeric_limits<T>::max();
+        value = (T)v;
+    } else {
+        unsigned long long v = strtoull(text, &end, 0);
+        ok = ok && *text != '-' && *text != '+' && v <= (unsigned long long)numeric_limits<T>::max();
+        value = (T)v;
+    }
+    if (!ok || errno != 0 || *end != '\0') {
+        cerr << "Invalid value for " << flag << ": " << text << "\n";
+        return false;
+    }
+    return true;
+}
+
+// -------------------------------------------------------------------
+// LoadProgramFile: loads --in. A file that cannot be opened, or that
+// does not parse (an unknown register, a bad immediate), is reported
+// and ends the run with exit code 1.
+// -------------------------------------------------------------------
+static bool LoadProgramFile(SingleCycleMIPS &sim, const string &filename) {
+    try {
+        return sim.LoadAssembly(filename);
+    } catch (const std::exception &e) {
+        cerr << "Cannot parse " << filename << ": " << e.what() << "\n";
+        return false;
+    }
+}
+
+// -------------------------------------------------------------------
+// main: simply creates a SingleCycleMIPS, asks user for cycle input,
+// loads instructions, and runs the simulation.
+//
+// Optional flags (without any flags it behaves exactly as before):
+//   --in <file>       assembly file to load (default simple2025.txt)
+//   --out <file>      output file (default simple_output.txt)
+//   --cycles <list>   cycle selection, e.g. 30,34,last (skips the prompt)
+//   --sweep <file>    run the program once per line of <file> on the
+//                     lockstep engine; each line sets starting registers,
+//                     e.g. "$a0=5 $a1=0x10". Prints every final state.
+//   --sweep-scalar    with --sweep: use one normal run per line instead
+//   --commit-trace <file>  write a per-cycle commit trace (PC, register
+//                     write, memory write); binary if <file> ends in .bin
+//   --trace-index     with --commit-trace: also write <file>.idx, with a
+//                     keyframe every --keyframe-every cycles
+//   --query <trace>   answer --ask questions (or one per line from stdin)
+//                     from an indexed commit trace, e.g. "reg $s0 at 812",
+//                     "mem 0x10008000 at 90", "writes 0x10008000"
+//   --cosim <file>    check every cycle against a reference commit trace
+//                     and stop at the first difference (exit code 2)
+//   --delta-trace <file>  write the selected cycles / final state as a
+//                     delta trace instead of text
+//   --keyframe-every <N>  keyframe interval for --delta-trace and
+//                     --trace-index (1000)
+//   --reconstruct <file>  turn a delta trace back into the text output
+//                     (only the --cycles selection, if one is given)
+//   --serve <socket>  run as a server on a Unix domain socket (see
+//                     SimulationServer for the protocol)
+//   --threads <N>     worker threads for --serve (default: all cores)
+//   --cache-entries <N>  decoded programs kept by --serve (default 256)
+//   --submit <socket> send --in/--cycles as a job to a running server
+//                     and write the reply to --out
+//   --program-cache <dir>  keep decoded programs in <dir> and skip parsing
+//                     when the same source is loaded again
+//   --break <expr>    stop when <expr> fires (see Predicate; repeatable)
+//   --watch <expr>    print the cycles where <expr> fires (repeatable)
+//   --detect-loops    stop when the whole state repeats (exit code 3)
+//   --max-cycles <N>  stop after N cycles (exit code 4); for --sweep,
+//                     each lane that runs that long
+//   --sample <mode>   print sampled cycles and a summary instead of a
+//                     cycle list: every:N, random:N[:seed], reservoir:K[:seed]
+//   --render-threads <N>  format the text output on N threads (0 = all
+//                     cores); also applies to --reconstruct
+//   --incremental     keep running: whenever --in changes, re-simulate
+//                     from the last checkpoint before the first cycle
+//                     that ran a changed instruction and rewrite --out
+//                     from there
+//   --checkpoint-every <N>  checkpoint interval for --incremental (10000;
+//                     doubles whenever 64 checkpoints are held)
+//   --fork-at <N> --variants <file>  run to cycle N once, then continue
+//                     one copy-on-write fork per line of <file> (edits
+//                     like "$a0=5; mem[0x10008004]=7; loop: addi ...")
+//                     and print each final state
+//   --load-image <file>[@addr]  store the raw words of <file> into memory
+//                     from addr (default 0x10008000) on before the run
+//                     (repeatable; .word/.space in .data do the same
+//                     from the source)
+//   --max-seconds <S> stop after S seconds of wall time (exit code 4)
+//   --progress <file> keep <file> holding the cycle, PC, elapsed time and
+//                     status, replaced atomically every --progress-every
+//                     seconds (10) and at the end; SIGINT/SIGTERM then
+//                     stop the run cleanly at an exact cycle (exit code 5)
+//   --out <file>.lz   (any mode writing --out) compress the output in
+//                     independently decodable blocks on a worker thread
+//   --decompress <file>  write the text of a .lz output to stdout
+//   --state-image <file>  also write the final state as a binary image
+//   --compare-state <a> <b>  compare two state images and print the
+//                     first difference (exit code 2 if they differ)
+//   --compare-list <file>  the same for every "<a> <b>" line of <file>,
+//                     on --threads threads
+//   --layout-profile <file>  count how often every instruction and every
+//                     jump/taken branch ran and write that to <file>
+//   --layout <file>   fetch from a copy of the decoded program laid out
+//                     by such a profile: hot paths together, blocks that
+//                     never ran at the end (the PCs do not change)
+//   --fuzz <seconds>  differential fuzzing (0 = until stopped): random
+//                     programs on the reference, lockstep and forking
+//                     engines, compared every --fuzz-every cycles (64);
+//                     failures are minimized into fuzz-<seed>.txt/.lanes
+//                     (exit code 2). --fuzz-seed <S> sets the first
+//                     program, --fuzz-programs <N> stops after N programs,
+//                     --threads and --max-cycles (20000) apply.
+// -------------------------------------------------------------------
+int main(int argc, char **argv) {
+    SingleCycleMIPS sim;
+
+    string inFile = "simple2025.txt";
+    string outFile = "simple_output.txt";
+    string input;
+    bool haveCycles = false;
+    string sweepFile;
+    bool sweepScalar = false;
+    string commitTraceFile, referenceFile;
+    bool traceIndex = false;
+    string queryTrace;
+    vector<string> questions;
+    string deltaFile, reconstructFile;
+    uint64_t keyframeEvery = 1000;
+    string serveSocket, submitSocket;
+    string programCacheDir;
+    vector<pair<string,bool>> predicateSpecs;   // (expression, is a breakpoint)
+    bool detectLoops = false;
+    uint64_t maxCycles = 0;
+    double maxSeconds = 0, progressEvery = 10;
+    string progressFile;
+    string decompressFile;
+    string stateImageFile, compareList;
+    string layoutProfileFile, layoutFile;
+    vector<string> compareStates;
+    string sampleSpec;
+    int renderThreads = -1;     // -1: format on the simulation thread
+    string variantsFile;
+    uint64_t forkCycle = 0;
+    vector<string> imageSpecs;
+    bool incremental = false;
+    uint64_t checkpointEvery = 10000;
+    bool fuzz = false;
+    uint64_t fuzzSeconds = 0, fuzzPrograms = 0, fuzzEvery = 64;
+    uint64_t fuzzSeed = random_device()() ^ (uint64_t)chrono::system_clock::now().time_since_epoch().count();
+    size_t serverThreads = thread::hardware_concurrency(), cacheEntries = 256;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = (i + 1 < argc);
+        bool ok = true;         // false once a numeric flag's value did not parse
+        if (arg == "--in" && hasValue)          inFile = argv[++i];
+        else if (arg == "--out" && hasValue)    outFile = argv[++i];
+        else if (arg == "--cycles" && hasValue) { input = argv[++i]; haveCycles = true; }
+        else if (arg == "--sweep" && hasValue)  sweepFile = argv[++i];
+        else if (arg == "--sweep-scalar")       sweepScalar = true;
+        else if (arg == "--commit-trace" && hasValue) commitTraceFile = argv[++i];
+        else if (arg == "--trace-index")        traceIndex = true;
+        else if (arg == "--query" && hasValue)  queryTrace = argv[++i];
+        else if (arg == "--ask" && hasValue)    questions.push_back(argv[++i]);
+        else if (arg == "--cosim" && hasValue)  referenceFile = argv[++i];
+        else if (arg == "--delta-trace" && hasValue)    deltaFile = argv[++i];
+        else if (arg == "--keyframe-every" && hasValue) ok = FlagValue(arg, argv[++i], keyframeEvery);
+        else if (arg == "--reconstruct" && hasValue)    reconstructFile = argv[++i];
+        else if (arg == "--serve" && hasValue)          serveSocket = argv[++i];
+        else if (arg == "--threads" && hasValue)        ok = FlagValue(arg, argv[++i], serverThreads);
+        else if (arg == "--cache-entries" && hasValue)  ok = FlagValue(arg, argv[++i], cacheEntries);
+        else if (arg == "--submit" && hasValue)         submitSocket = argv[++i];
+        else if (arg == "--program-cache" && hasValue)  programCacheDir = argv[++i];
+        else if (arg == "--break" && hasValue)          predicateSpecs.push_back({argv[++i], true});
+        else if (arg == "--watch" && hasValue)          predicateSpecs.push_back({argv[++i], false});
+        else if (arg == "--detect-loops")               detectLoops = true;
+        else if (arg == "--max-cycles" && hasValue)     ok = FlagValue(arg, argv[++i], maxCycles);
+        else if (arg == "--max-seconds" && hasValue)    ok = FlagValue(arg, argv[++i], maxSeconds);
+        else if (arg == "--progress" && hasValue)       progressFile = argv[++i];
+        else if (arg == "--progress-every" && hasValue) ok = FlagValue(arg, argv[++i], progressEvery);
+        else if (arg == "--decompress" && hasValue)     decompressFile = argv[++i];
+        else if (arg == "--state-image" && hasValue)    stateImageFile = argv[++i];
+        else if (arg == "--compare-state" && i + 2 < argc) {
+            compareStates.push_back(argv[++i]);
+            compareStates.push_back(argv[++i]);
+        }
+        else if (arg == "--compare-list" && hasValue)   compareList = argv[++i];
+        else if (arg == "--layout-profile" && hasValue) layoutProfileFile = argv[++i];
+        else if (arg == "--layout" && hasValue)         layoutFile = argv[++i];
+        else if (arg == "--sample" && hasValue)         sampleSpec = argv[++i];
+        else if (arg == "--render-threads" && hasValue) ok = FlagValue(arg, argv[++i], renderThreads);
+        else if (arg == "--incremental")                incremental = true;
+        else if (arg == "--checkpoint-every" && hasValue) ok = FlagValue(arg, argv[++i], checkpointEvery);
+        else if (arg == "--fork-at" && hasValue)        ok = FlagValue(arg, argv[++i], forkCycle);
+        else if (arg == "--variants" && hasValue)       variantsFile = argv[++i];
+        else if (arg == "--load-image" && hasValue)     imageSpecs.push_back(argv[++i]);
+        else if (arg == "--fuzz" && hasValue)           { fuzz = true; ok = FlagValue(arg, argv[++i], fuzzSeconds); }
+        else if (arg == "--fuzz-seed" && hasValue)      ok = FlagValue(arg, argv[++i], fuzzSeed);
+        else if (arg == "--fuzz-programs" && hasValue)  ok = FlagValue(arg, argv[++i], fuzzPrograms);
+        else if (arg == "--fuzz-every" && hasValue)     ok = FlagValue(arg, argv[++i], fuzzEvery);
+        else {
+            cerr << "Unknown or incomplete option: " << arg << endl;
+            return 1;
+        }
+        if (!ok) return 1;
+    }
+
+    if (!queryTrace.empty()) {
+        TraceQuery query;
+        string error;
+        if (!query.Open(queryTrace, error)) {
+            cerr << error << "\n";
+            return 1;
+        }
+        bool fromStdin = questions.empty();
+        bool ok = true;
+        string question;
+        for (size_t q = 0; fromStdin ? (bool)getline(cin, question) : q < questions.size(); q++) {
+            if (!fromStdin) question = questions[q];
+            if (question.find_first_not_of(" \t\r") == string::npos) continue;
+            if (!query.Answer(question, cout, error)) {
+                cerr << error << "\n";
+                ok = false;
+            }
+        }
+        return ok ? 0 : 1;
+    }
+
+    if (!decompressFile.empty()) {
+        string error;
+        if (!DecompressFile(decompressFile, cout, error)) {
+            cerr << "--decompress: " << error << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (!compareStates.empty() || !compareList.empty()) {
+        vector<pair<string,string>> pairs;
+        if (!compareStates.empty()) pairs.push_back({compareStates[0], compareStates[1]});
+        if (!compareList.empty() && !LoadStatePairs(compareList, pairs)) return 1;
+        return CompareStatePairs(pairs, (unsigned)serverThreads, cout);
+    }
+
+    if (fuzz) {
+        DifferentialFuzzer fuzzer(fuzzSeed, fuzzEvery, maxCycles ? maxCycles : 20000);
+        return fuzzer.Run((unsigned)serverThreads, fuzzSeconds, fuzzPrograms) ? 2 : 0;
+    }
+
+    for (const string &spec : imageSpecs) {
+        auto at = spec.rfind('@');
+        uint32_t addr = DATA_SEGMENT_BASE;
+        string error;
+        try {
+            if (at != string::npos) addr = (uint32_t)stoull(spec.substr(at + 1), nullptr, 0);
+        } catch (const std::exception &e) {
+            cerr << "Invalid --load-image address in '" << spec << "'\n";
+            return 1;
+        }
+        if (!sim.LoadBinaryImage(spec.substr(0, at), addr, error)) {
+            cerr << "--load-image: " << error << "\n";
+            return 1;
+        }
+    }
+
+    if (!sweepFile.empty()) {
+        vector<LockstepMIPS::LaneInputs> inputs;
+        if (!LockstepMIPS::LoadInputs(sweepFile, inputs)) return 1;
+        if (!LoadProgramFile(sim, inFile)) return 1;
+
+        OutputFile file;
+        if (!file.Open(outFile)) {
+            cerr << "Cannot open " << outFile << "\n";
+            return 1;
+        }
+        ostream &out = file.Stream();
+        size_t stopped = 0;
+        if (sweepScalar) {
+            sim.SetCycleBudget(maxCycles);
+            sim.SetStopReports(false);       // one summary below instead
+            for (size_t l = 0; l < inputs.size(); l++) {
+                SingleCycleMIPS run = sim;   // fresh copy of the loaded program
+                for (auto &r : inputs[l]) run.SetInitialRegister(r.first, r.second);
+                ostringstream state;         // the header says whether it finished
+                run.RunSimulation(state, vector<int64_t>(), true);
+                out << "-----Lane " << dec << l;
+                if (run.OutOfBudget()) {
+                    out << " (stopped at the cycle budget)";
+                    stopped++;
+                }
+                out << "-----\n" << state.str() << "\n";
+            }
+        } else {
+            LockstepMIPS engine(sim);
+            stopped = engine.RunSweep(out, inputs, maxCycles);
+        }
+        if (!file.Close()) {
+            cerr << "Cannot write " << outFile << "\n";
+            return 1;
+        }
+        if (stopped) {
+            cerr << dec << stopped << " sweep lane(s) stopped at the cycle budget of " << maxCycles << " cycles\n";
+            return 4;
+        }
+        return 0;
+    }
+
+    if (!serveSocket.empty() || !submitSocket.empty()) {
+#ifdef MIPS_POSIX
+        if (!serveSocket.empty()) {
+            SimulationServer server(serverThreads, cacheEntries, maxCycles);
+            return server.Serve(serveSocket);
+        }
+        return SubmitJob(submitSocket, inFile, haveCycles ? input : string("last"), outFile);
+#else
+        cerr << "--serve/--submit need Unix domain sockets, which this platform does not have\n";
+        return 1;
+#endif
+    }
+
+    if (!reconstructFile.empty()) {
+        vector<int64_t> cyclesToPrint;
+        bool includeLast = true;
+        if (haveCycles) {
+            includeLast = false;
+            if (!ParseCycleSelection(input, cyclesToPrint, includeLast)) return 1;
+            if (cyclesToPrint.empty()) cyclesToPrint.push_back(-2);   // only "last"
+        }
+        if (renderThreads >= 0) {
+            ParallelRenderer renderer;
+            if (!renderer.Open(outFile, (unsigned)renderThreads)) {
+                cerr << "Cannot open " << outFile << "\n";
+                return 1;
+            }
+            ostream noText(nullptr);    // everything goes through the renderer
+            bool ok = SingleCycleMIPS::ReconstructDeltaTrace(reconstructFile, noText, cyclesToPrint,
+                                                             includeLast, &renderer);
+            if (!renderer.Finish()) {
+                cerr << "Cannot write " << outFile << "\n";
+                return 1;
+            }
+            return ok ? 0 : 1;
+        }
+        OutputFile file;
+        if (!file.Open(outFile)) {
+            cerr << "Cannot open " << outFile << "\n";
+            return 1;
+        }
+        bool ok = SingleCycleMIPS::ReconstructDeltaTrace(reconstructFile, file.Stream(), cyclesToPrint, includeLast);
+        if (!file.Close()) {
+            cerr << "Cannot write " << outFile << "\n";
+            return 1;
+        }
+        return ok ? 0 : 1;
+    }
+
+    // What-if mode: one run to the fork point, then the variants
+    if (!variantsFile.empty()) {
+        vector<string> variants;
+        if (!SingleCycleMIPS::LoadVariants(variantsFile, variants)) return 1;
+        sim.SetProgramCache(programCacheDir);
+        if (!LoadProgramFile(sim, inFile)) return 1;
+        sim.SetLoopDetection(detectLoops);
+        sim.SetCycleBudget(maxCycles);
+        OutputFile file;
+        if (!file.Open(outFile)) {
+            cerr << "Cannot open " << outFile << "\n";
+            return 1;
+        }
+        file.Stream() << OUTPUT_HEADER;
+        string error;
+        if (!sim.RunVariants(file.Stream(), forkCycle, variants, renderThreads < 0 ? 1u : (unsigned)renderThreads, error)) {
+            cerr << "--variants: " << error << "\n";
+            return 1;
+        }
+        if (!file.Close()) {
+            cerr << "Cannot write " << outFile << "\n";
+            return 1;
+        }
+        return sim.OutOfBudget() ? 4 : 0;
+    }
+
+    // Sampling picks the cycles itself; --cycles only matters for "last"
+    if (!sampleSpec.empty() && !haveCycles) {
+        input = "last";
+        haveCycles = true;
+    }
+
+    if (!haveCycles) {
+        cout << "Enter cycles to print (comma-separated, or 'all', or 'last'. e.g. 30,34,last): ";
+        getline(cin, input);
+    }
+
+    vector<int64_t> cyclesToPrint;
+    bool includeLast = false;
+    if (!ParseCycleSelection(input, cyclesToPrint, includeLast)) {
+        return 1;
+    }
+
+    CommitTraceWriter commitTrace;
+    if (!commitTraceFile.empty()) {
+        if (!commitTrace.Open(commitTraceFile, traceIndex ? keyframeEvery : 0)) {
+            cerr << "Cannot open " << commitTraceFile << "\n";
+            return 1;
+        }
+        sim.SetCommitTrace(&commitTrace);
+    }
+    CommitTraceReader reference;
+    if (!referenceFile.empty()) {
+        if (!reference.Open(referenceFile)) {
+            cerr << "Cannot open " << referenceFile << "\n";
+            return 1;
+        }
+        sim.SetReference(&reference);
+    }
+
+    DeltaTraceWriter deltaTrace;
+    if (!deltaFile.empty()) {
+        if (!deltaTrace.Open(deltaFile, keyframeEvery)) {
+            cerr << "Cannot open " << deltaFile << "\n";
+            return 1;
+        }
+        sim.SetDeltaTrace(&deltaTrace);
+    }
+
+    CycleSampler sampler;
+    if (!sampleSpec.empty()) {
+        string error;
+        if (!sampler.Parse(sampleSpec, error)) {
+            cerr << "Invalid --sample '" << sampleSpec << "': " << error << "\n";
+            return 1;
+        }
+        if (!deltaFile.empty()) {
+            cerr << "--sample writes text output and cannot be combined with --delta-trace\n";
+            return 1;
+        }
+        sim.SetSampler(&sampler);
+    }
+
+    if (incremental) {
+        if (!commitTraceFile.empty() || !referenceFile.empty() || !deltaFile.empty() ||
+            !sampleSpec.empty() || renderThreads >= 0 || !predicateSpecs.empty() || IsCompressedName(outFile) ||
+            !layoutProfileFile.empty() || !layoutFile.empty()) {
+            cerr << "--incremental only writes the plain text output\n";
+            return 1;
+        }
+        sim.SetLoopDetection(detectLoops);
+        sim.SetCycleBudget(maxCycles);
+        IncrementalRunner runner(sim, inFile, outFile, cyclesToPrint, includeLast, checkpointEvery);
+        return runner.Watch(200) ? 0 : 1;
+    }
+
+    // Load instructions from file
+    sim.SetProgramCache(programCacheDir);
+    if (!LoadProgramFile(sim, inFile)) return 1;
+
+    for (auto &spec : predicateSpecs) {
+        string error;
+        if (!sim.AddPredicate(spec.first, spec.second, error)) {
+            cerr << "Invalid " << (spec.second ? "--break" : "--watch") << " '" << spec.first << "': " << error << endl;
+            return 1;
+        }
+    }
+
+    sim.SetLoopDetection(detectLoops);
+    sim.SetCycleBudget(maxCycles);
+    sim.SetTimeBudget(maxSeconds);
+
+    ExecutionProfile executionProfile;
+    if (!layoutProfileFile.empty()) sim.SetExecutionProfile(&executionProfile);
+    if (!layoutFile.empty()) {
+        ExecutionProfile recorded;
+        string error;
+        if (!recorded.Load(layoutFile, *sim.GetProgram(), error)) {
+            cerr << "--layout: " << error << "\n";
+            return 1;
+        }
+        sim.SetLayout(ProgramLayout::Build(sim.GetProgram(), recorded));
+    }
+
+    ProgressMarker progress;
+    if (!progressFile.empty()) {
+        if (!progress.Open(progressFile, progressEvery)) {
+            cerr << "Cannot write " << progressFile << "\n";
+            return 1;
+        }
+        sim.SetProgressMarker(&progress);
+        signal(SIGINT, RequestStop);
+        signal(SIGTERM, RequestStop);
+    }
+
+    // Run the simulation, printing selected cycles and possibly final state
+    if (!deltaFile.empty()) {
+        ostream noText(nullptr);    // everything goes to the delta trace
+        sim.RunSimulation(noText, cyclesToPrint, includeLast);
+    } else if (renderThreads >= 0) {
+        ParallelRenderer renderer;
+        if (!renderer.Open(outFile, (unsigned)renderThreads)) {
+            cerr << "Cannot open " << outFile << "\n";
+            return 1;
+        }
+        renderer.AddText(OUTPUT_HEADER);
+        sim.SetRenderer(&renderer);
+        ostream noText(nullptr);    // everything goes through the renderer
+        sim.RunSimulation(noText, cyclesToPrint, includeLast);
+        sim.SetRenderer(nullptr);
+        if (!renderer.Finish()) {
+            cerr << "Cannot write " << outFile << "\n";
+            return 1;
+        }
+    } else if (!sim.RunSimulation(outFile, cyclesToPrint, includeLast)) {
+        return 1;
+    }
+
+    if (!layoutProfileFile.empty() && !executionProfile.Save(layoutProfileFile)) {
+        cerr << "Cannot write " << layoutProfileFile << "\n";
+        return 1;
+    }
+    if (!stateImageFile.empty()) {
+        string error;
+        if (!sim.SaveStateImage(stateImageFile, error)) {
+            cerr << "--state-image: " << error << "\n";
+            return 1;
+        }
+    }
+
+    if (!referenceFile.empty()) {
+        if (sim.Diverged()) return 2;
+        cout << "Reference check passed: every cycle matched " << referenceFile << "\n";
+    }
+    if (sim.Livelocked()) return 3;
+    if (sim.OutOfBudget()) return 4;
+    if (sim.Interrupted()) return 5;
+    return 0;
+}
+#endif // MIPS_NO_MAIN
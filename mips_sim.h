@@ -0,0 +1,94 @@
+/*
+ * mips_sim.h - C interface to the single-cycle MIPS simulator.
+ *
+ * Build the library from the same source, without main():
+ *   g++ -std=c++17 -O2 -fPIC -shared -pthread -DMIPS_NO_MAIN \
+ *       -o libmipssim.so IoanTsiak.cpp
+ *
+ * A handle holds one loaded program and its machine state. Handles are
+ * independent, so different threads may use different handles at once.
+ * Typical use:
+ *   mips_sim *s = mips_sim_new();
+ *   mips_sim_load(s, source, strlen(source));
+ *   mips_sim_set_register(s, 4, 10);        // $a0 = 10 from every reset on
+ *   mips_sim_reset(s);
+ *   mips_sim_step(s, 1000000);
+ *   int32_t v0 = mips_sim_registers(s)[2];
+ *   mips_sim_free(s);
+ */
+#ifndef MIPS_SIM_H
+#define MIPS_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MIPS_SIM_ABI_VERSION 3
+
+typedef struct mips_sim mips_sim;
+
+/* mips_sim_status() */
+enum {
+    MIPS_SIM_RUNNING    = 0,   /* can take more steps */
+    MIPS_SIM_HALTED     = 1,   /* ran the halt or ran off the program */
+    MIPS_SIM_BREAKPOINT = 2,   /* a breakpoint fired; the next step continues */
+    MIPS_SIM_LIVELOCK   = 3,   /* the state repeated (loop detection on) */
+    MIPS_SIM_BUDGET     = 4,   /* the cycle budget is used up */
+    MIPS_SIM_ERROR      = 5    /* the last step failed (see mips_sim_error) */
+};
+
+int mips_sim_abi_version(void);
+
+/* Functions returning int return 0, or -1 with the reason in
+ * mips_sim_error. No C++ exception ever reaches the caller. */
+
+mips_sim *mips_sim_new(void);   /* NULL if out of memory */
+void mips_sim_free(mips_sim *sim);
+
+/* Loading resets the machine. A program that does not parse leaves an
+ * empty one behind. */
+int mips_sim_load(mips_sim *sim, const char *source, size_t length);
+int mips_sim_load_file(mips_sim *sim, const char *path);
+
+/* Setup, applied by every reset */
+int mips_sim_set_register(mips_sim *sim, int reg, int32_t value);
+int mips_sim_add_breakpoint(mips_sim *sim, const char *expr);  /* --break syntax */
+/* Raw words of a file stored from addr on (like --load-image) */
+int mips_sim_load_image(mips_sim *sim, const char *path, uint32_t addr);
+void mips_sim_set_loop_detection(mips_sim *sim, int on);
+void mips_sim_set_cycle_budget(mips_sim *sim, uint64_t max_cycles);  /* 0 = none */
+
+/* Running. Step and run_until return the number of cycles run; if a
+ * cycle failed, mips_sim_status is MIPS_SIM_ERROR until the next reset. */
+int mips_sim_reset(mips_sim *sim);
+uint64_t mips_sim_step(mips_sim *sim, uint64_t n);
+uint64_t mips_sim_run_until(mips_sim *sim, int (*stop)(const mips_sim *sim, void *ctx),
+                            void *ctx, uint64_t max_cycles);  /* 0 = no limit */
+int mips_sim_status(const mips_sim *sim);
+
+/* State. The registers are read in place; the pointer stays valid until
+ * the next load (a reset keeps it). */
+const int32_t *mips_sim_registers(const mips_sim *sim);        /* 32 entries */
+uint32_t mips_sim_pc(const mips_sim *sim);
+uint64_t mips_sim_cycles(const mips_sim *sim);
+/* A memory word, copied to *value (0 if never stored). Returns 1 if the
+ * word was ever stored, else 0. Words are not handed out as pointers:
+ * the next store may move a word's page. */
+int mips_sim_word(const mips_sim *sim, uint32_t addr, int32_t *value);
+/* Copies up to 'capacity' stored words (any order); returns how many exist. */
+size_t mips_sim_memory(const mips_sim *sim, uint32_t *addrs, int32_t *values, size_t capacity);
+
+/* Writes the current state as a binary state image (like --state-image). */
+int mips_sim_save_state(mips_sim *sim, const char *path);
+
+/* The last error message, or "" */
+const char *mips_sim_error(const mips_sim *sim);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MIPS_SIM_H */